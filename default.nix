@@ -49,6 +49,7 @@
       ncurses
       cmake
       gnumake
+      pkg-config
     ];
 
     # programs and libraries used by the new derivation at run-time
@@ -64,6 +65,11 @@
         asio
         kotur-nixpkgs.cpp-jwt
         openssl
+        libjpeg
+        libpng
+        libwebp
+        zlib
+        liburing
     ];
 
     # builtins.path is used since source of our package is the current directory: ./
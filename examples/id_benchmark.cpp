@@ -0,0 +1,83 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+#include <fmt/format.h>
+
+#include "id_generator.hpp"
+
+/* Compares IdGenerator with the random_device + mt19937 per id it replaced and checks
+ * that ids generated concurrently are unique and ordered within every thread.
+ * Usage: id_benchmark [threads] [ids_per_thread] */
+
+using clock_type = std::chrono::steady_clock;
+
+int random_id() {
+    std::random_device dev;
+    std::mt19937 rgen(dev());
+    std::uniform_int_distribution<std::mt19937::result_type> dist(0, INT_MAX);
+    return dist(rgen);
+}
+
+template <typename F>
+double ids_per_second(unsigned threads, std::size_t per_thread, F &&make_id) {
+    const auto start = clock_type::now();
+    {
+        std::vector<std::jthread> workers;
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&] {
+                for (std::size_t i = 0; i < per_thread; i++) {
+                    auto id = make_id();
+                    asm volatile("" : : "g"(id) : "memory");
+                }
+            });
+        }
+    }
+    const std::chrono::duration<double> elapsed = clock_type::now() - start;
+    return threads * per_thread / elapsed.count();
+}
+
+int main(int argc, char * argv[])
+{
+    const unsigned threads = argc > 1 ? std::max(1, std::atoi(argv[1])) : std::max(1u, std::thread::hardware_concurrency());
+    const std::size_t per_thread = argc > 2 ? std::max(1, std::atoi(argv[2])) : 200000;
+    if (threads > rs::IdGenerator::max_threads) {
+        fmt::print(stderr, "At most {} threads\n", rs::IdGenerator::max_threads);
+        return 1;
+    }
+    const rs::IdGenerator ids;
+
+    std::vector<std::vector<std::uint64_t>> generated(threads);
+    {
+        std::vector<std::jthread> workers;
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                generated[t].reserve(per_thread);
+                for (std::size_t i = 0; i < per_thread; i++) generated[t].push_back(ids.next());
+            });
+        }
+    }
+    bool ordered = true;
+    std::vector<std::uint64_t> all;
+    for (const auto &g : generated) {
+        ordered = ordered && std::is_sorted(g.begin(), g.end());
+        all.insert(all.end(), g.begin(), g.end());
+    }
+    std::sort(all.begin(), all.end());
+    const bool unique = std::adjacent_find(all.begin(), all.end()) == all.end();
+    fmt::print("{} ids from {} threads: {}, {}\n", all.size(), threads,
+               unique ? "unique" : "DUPLICATES", ordered ? "ordered per thread" : "NOT ORDERED");
+
+    /* random_device is slow, fewer ids keep the run short */
+    const std::size_t random_per_thread = std::max<std::size_t>(1, per_thread / 20);
+    const double generator = ids_per_second(threads, per_thread, [&] { return ids.next(); });
+    const double random = ids_per_second(threads, random_per_thread, random_id);
+    fmt::print("{:<24} {:>14.0f} ids/s\n", "IdGenerator", generator);
+    fmt::print("{:<24} {:>14.0f} ids/s\n", "random_device + mt19937", random);
+    fmt::print("speedup {:.1f}x\n", generator / random);
+
+    return unique && ordered ? 0 : 2;
+}
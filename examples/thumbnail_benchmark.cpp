@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <fmt/format.h>
+
+#include "thumbnails.hpp"
+
+/* Compares the in-process thumbnail engine with the convert invocation it replaced.
+ * Usage: thumbnail_benchmark <corpus_dir> [runs] [threads_per_image] */
+
+namespace fs = std::filesystem;
+using clock_type = std::chrono::steady_clock;
+
+double median_ms(unsigned runs, const std::function<bool()> &f, bool &ok) {
+    std::vector<double> times;
+    for (unsigned i = 0; i < runs; i++) {
+        const auto start = clock_type::now();
+        ok = f() && ok;
+        times.push_back(std::chrono::duration<double, std::milli>(clock_type::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+int main(int argc, char * argv[])
+{
+    if (argc < 2) {
+        fmt::print("USAGE {} <corpus_dir> [runs] [threads_per_image]\n", argv[0]);
+        return 1;
+    }
+    const fs::path corpus{argv[1]};
+    const unsigned runs = argc > 2 ? std::max(1, std::atoi(argv[2])) : 5;
+    const unsigned threads = argc > 3 ? std::max(1, std::atoi(argv[3])) : std::max(1u, std::thread::hardware_concurrency());
+    const auto out_dir = fs::temp_directory_path() / "rs-thumbnail-benchmark";
+    fs::create_directories(out_dir);
+
+    fmt::print("{:<40} {:>12} {:>12} {:>12} {:>8}\n", "file", "size", "native ms", "convert ms", "speedup");
+    double native_total = 0, convert_total = 0;
+    for (const auto &entry : fs::directory_iterator(corpus)) {
+        const auto ext = entry.path().extension().string();
+        if (!entry.is_regular_file() || (ext != ".jpg" && ext != ".jpeg" && ext != ".png" && ext != ".gif" && ext != ".bmp"))
+            continue;
+
+        const auto src = entry.path().string();
+        const auto native_out = (out_dir / (entry.path().stem().string() + ".native.jpg")).string();
+        const auto convert_out = (out_dir / (entry.path().stem().string() + ".convert.jpg")).string();
+
+        bool native_ok = true, convert_ok = true;
+        const double native = median_ms(runs, [&] {
+            return rs::image::make_thumbnail(src, native_out, rs::ThumbnailQueue::thumbnail_size, threads) == rs::image::ThumbnailResult::done;
+        }, native_ok);
+        const double convert = median_ms(runs, [&] { return rs::ThumbnailQueue::convert_thumbnail(src, convert_out); }, convert_ok);
+
+        fmt::print("{:<40} {:>12} {:>12.2f} {:>12} {:>8}\n", entry.path().filename().string(), fs::file_size(entry.path()),
+                   native_ok ? native : 0.0,
+                   convert_ok ? fmt::format("{:.2f}", convert) : "n/a",
+                   native_ok && convert_ok ? fmt::format("{:.1f}x", convert / native) : "-");
+        if (native_ok && convert_ok) {
+            native_total += native;
+            convert_total += convert;
+        }
+    }
+
+    if (native_total > 0)
+        fmt::print("\ntotal: native {:.2f} ms, convert {:.2f} ms, speedup {:.1f}x\n", native_total, convert_total, convert_total / native_total);
+    fmt::print("thumbnails written to {}\n", out_dir.string());
+}
@@ -3,9 +3,12 @@
 
 #include <fmt/format.h>
 #include <fmt/ranges.h>
+#include <span>
+#include <unordered_set>
 #include "errors.hpp"
 #include "model/model.hpp"
 #include "user.hpp"
+#include "versions.hpp"
 #include <jwt/jwt.hpp>
 
 namespace rs::actions {
@@ -28,39 +31,158 @@ std::vector<const char *> check_uniquenes_in_db(soci::session &db, std::string_v
     return duplicates;
 }
 
+/* Same as above for a batch of models, duplicates inside the batch itself are reported too.
+ * Issues one query per unique field instead of one per model and field */
+template <rs::model::CModel M>
+std::vector<std::vector<const char *>> check_uniquenes_in_db(soci::session &db, std::string_view table_name, std::span<const M> ms) {
+    constexpr auto ns = M::template field_names_having_cnstr<model::cnstr::Unique>();
+    using unique_values_t = std::array<std::optional<std::string>, ns.size()>;
+
+    std::vector<unique_values_t> values; values.reserve(ms.size());
+    for (const M &m : ms) {
+        unique_values_t &vs = values.emplace_back();
+        auto it = std::begin(vs);
+        std::apply([&](const auto&... fs) {
+            ((*it++ = fs.opt_value.has_value()
+                      ? std::optional<std::string>{fmt::format("{}", *fs.opt_value)}
+                      : std::nullopt), ...);
+        }, m.template fields_having_cnstr<rs::model::cnstr::Unique>());
+    }
+
+    std::vector<std::vector<const char *>> duplicates(ms.size());
+    for (auto n = 0u; n < ns.size(); n++) {
+        std::unordered_map<std::string_view, std::size_t> first_seen;
+        for (auto i = 0u; i < values.size(); i++) {
+            if (!values[i][n].has_value()) continue;
+            if (!first_seen.try_emplace(*values[i][n], i).second)
+                duplicates[i].push_back(ns[n]);
+        }
+        if (first_seen.empty()) continue;
+
+        std::vector<std::string> quoted; quoted.reserve(first_seen.size());
+        for (const auto &[v, i] : first_seen) quoted.push_back(fmt::format("'{}'", v));
+        soci::rowset<std::string> existing = (db.prepare << fmt::format("SELECT CAST({0} AS TEXT) FROM {1} WHERE {0} IN ({2})",
+                                                                        ns[n], table_name, fmt::join(quoted, ",")));
+        std::unordered_set<std::string> existing_set(std::begin(existing), std::end(existing));
+        for (auto i = 0u; i < values.size(); i++) {
+            if (values[i][n].has_value() && existing_set.contains(*values[i][n]))
+                duplicates[i].push_back(ns[n]);
+        }
+    }
+    return duplicates;
+}
+
+/* SQL literals for every field of the model in declaration order, NULL for unset ones */
+template <rs::model::CModel M>
+std::array<std::string, M::num_of_fields()> sql_values(M const& m) {
+    std::array<std::string, M::num_of_fields()> vs;
+    auto it = std::begin(vs);
+    std::apply([&](const auto&... fs) {
+        ((*it = std::invoke([&](const auto& f) {
+               return f.opt_value.has_value()
+                      ? fmt::format("'{}'", *f.opt_value)
+                      : "NULL";
+        }, fs), it++), ...);
+    }, m.fields());
+    return vs;
+}
+
+/* SET assignment bumping the row version, empty for tables without pp.version_field_name */
+inline std::string version_increment(const PermissionParams &pp) {
+    return pp.version_field_name.has_value() ? fmt::format("{0}={0}+1", *pp.version_field_name) : "";
+}
+
+/* Condition of an If-Match precondition (see if_match_versions), empty when any version matches */
+inline std::string version_predicate(const PermissionParams &pp, std::string_view table_name,
+                                     const std::optional<std::vector<std::int64_t>> &if_match) {
+    if (!if_match.has_value()) return "";
+    rs::throw_if<OtherError>(!pp.version_field_name.has_value(), fmt::format("Rows of {} have no version", table_name));
+    if (if_match->empty()) return "0";
+    return fmt::format("{} IN ({})", *pp.version_field_name, fmt::join(*if_match, ","));
+}
+
 template <rs::model::CModel M>
 std::vector<M> get_models_from_db(const model::AuthToken &auth_tok, PermissionParams pp, soci::session &db, std::string_view table_name, std::string_view attr = "*", std::string_view filter = "") {
     AuthorizedModelAccess model_access(permission::READ, auth_tok, pp, db, table_name, M{});
-    std::string filter_stmt = filter.empty() ? "" : fmt::format("WHERE {}", filter);
+    std::string columns = attr == "*" ? model_access.select_columns() : std::string{attr};
+    std::string predicate = model_access.row_predicate();
+    std::string filter_stmt;
+    if (!filter.empty() && !predicate.empty()) filter_stmt = fmt::format("WHERE ({}) AND {}", filter, predicate);
+    else if (!filter.empty()) filter_stmt = fmt::format("WHERE {}", filter);
+    else if (!predicate.empty()) filter_stmt = fmt::format("WHERE {}", predicate);
     soci::statement get_models_stmt = (db.prepare << 
-        fmt::format("SELECT {} FROM {} {}", attr, table_name, std::move(filter_stmt)), soci::into(model_access.unsafe_ref()));
+        fmt::format("SELECT {} FROM {} {}", columns, table_name, std::move(filter_stmt)), soci::into(model_access.unsafe_ref()));
     get_models_stmt.execute();
     std::vector<M> models; models.reserve(get_models_stmt.get_affected_rows());
 
     while (get_models_stmt.fetch()) {
-        models.push_back(std::move(model_access.move_safely()));
+        models.push_back(std::move(model_access.unsafe_ref()));
+        model_access.unsafe_ref().erase_values();
     }
 
+    model_access.filter_safely(models);
+
     return models;
 }
 
+/* Row with given id if the caller can read it as get_models_from_db decides, nullopt otherwise. Only columns
+ * are read and they are not filtered by field permissions, for routes serving files of the row */
+template <rs::model::CModel M>
+std::optional<M> get_readable_model_by_id(const model::AuthToken &auth_tok, PermissionParams pp, soci::session &db, std::string_view table_name, std::int64_t id, std::string_view columns = "id") {
+    AuthorizedModelAccess model_access(permission::READ, auth_tok, std::move(pp), db, table_name, M{});
+    std::string predicate = model_access.row_predicate();
+    M m;
+    db << fmt::format("SELECT {} FROM {} WHERE id={}{}{}", columns, table_name, id, predicate.empty() ? "" : " AND ", std::move(predicate)), soci::into(m);
+    if (!db.got_data()) return std::nullopt;
+    return m;
+}
+
+/* ETag of the row with given id as get_models_from_db returns it to the caller, nullopt if the caller
+ * can not see the row. Reads only the version and owner columns, the model is not fetched */
+template <rs::model::CModel M>
+std::optional<std::string> get_model_etag_from_db(const model::AuthToken &auth_tok, PermissionParams pp, soci::session &db, std::string_view table_name, std::int64_t id) {
+    rs::throw_if<OtherError>(!pp.version_field_name.has_value(), fmt::format("Rows of {} have no version", table_name));
+    const std::string version_field_name = *pp.version_field_name;
+    AuthorizedModelAccess model_access(permission::READ, auth_tok, std::move(pp), db, table_name, M{});
+    std::string predicate = model_access.row_predicate();
+    long long version = 0, owner_id = 0;
+    soci::indicator owner_ind = soci::i_null;
+    db << fmt::format("SELECT {},{} FROM {} WHERE id={}{}{}", version_field_name, model_access.owner_column().value_or("NULL"), table_name,
+                      id, predicate.empty() ? "" : " AND ", std::move(predicate)), soci::into(version), soci::into(owner_id, owner_ind);
+    if (!db.got_data()) return std::nullopt;
+    const auto &mask = model_access.row_mask(owner_ind == soci::i_ok ? std::optional<std::int64_t>{owner_id} : std::nullopt);
+    rs::throw_if<UnauthorizedError>(mask.none(), permissions_to_json(model_access.desired_permissions()));
+    return version_etag(version, mask.to_ullong());
+}
+
 template <rs::model::CModel M>
 void insert_model_into_db(const model::AuthToken &auth_tok, PermissionParams pp, soci::session &db, std::string_view table_name, M &&m) {
     AuthorizedModelAccess model_access(permission::CREATE, auth_tok, pp, db, table_name, std::move(m));
 
-    std::array<std::string, M::num_of_fields()> vs;
-    auto it = std::begin(vs);
-    std::apply([&](const auto&... fs) {
-        ((*it = std::invoke([&](const auto& f) {
-               return f.opt_value.has_value()
-                      ? fmt::format("'{}'", *f.opt_value)
-                      : "NULL";
-        }, fs), it++), ...);
-    }, model_access.move_safely().fields());
-
     db << fmt::format("INSERT INTO {} ({}) VALUES({})", table_name,
               fmt::join(M::field_names(), ","),
-              fmt::join(std::move(vs), ","));
+              fmt::join(sql_values(model_access.move_safely()), ","));
+}
+
+/* Inserts all models within one transaction, using multi-row INSERT statements */
+template <rs::model::CModel M>
+void insert_models_into_db(const model::AuthToken &auth_tok, PermissionParams pp, soci::session &db, std::string_view table_name, std::vector<M> &&ms) {
+    AuthorizedModelAccess model_access(permission::CREATE, auth_tok, pp, db, table_name, M{});
+    model_access.filter_safely(ms);
+
+    constexpr std::size_t rows_per_stmt = 500;
+    std::vector<std::string> rows; rows.reserve(std::min(rows_per_stmt, ms.size()));
+    soci::transaction tr(db);
+    for (std::size_t first = 0; first < ms.size(); first += rows_per_stmt) {
+        rows.clear();
+        for (std::size_t i = first; i < std::min(first + rows_per_stmt, ms.size()); i++)
+            rows.push_back(fmt::format("({})", fmt::join(sql_values(ms[i]), ",")));
+
+        db << fmt::format("INSERT INTO {} ({}) VALUES {}", table_name,
+                  fmt::join(M::field_names(), ","),
+                  fmt::join(rows, ","));
+    }
+    tr.commit();
 }
 
 template <rs::model::CModel M>
@@ -83,7 +205,12 @@ void delete_models_from_db(const model::AuthToken &auth_tok, PermissionParams pp
 template <rs::model::CModel M>
 void modify_models_in_db(const model::AuthToken &auth_tok, PermissionParams pp, soci::session &db, std::string_view table_name, std::string_view filter, M &&m) {
     AuthorizedModelAccess model_access(permission::UPDATE, auth_tok, pp, db, table_name, std::move(m));
-    std::string filter_stmt = filter.empty() ? "" : fmt::format("WHERE {}", filter);
+    const std::string live_cond = model_access.live_predicate();
+    const std::string version_inc = version_increment(pp);
+    std::string filter_stmt;
+    if (!filter.empty() && !live_cond.empty()) filter_stmt = fmt::format("WHERE ({}) AND {}", filter, live_cond);
+    else if (!filter.empty()) filter_stmt = fmt::format("WHERE {}", filter);
+    else if (!live_cond.empty()) filter_stmt = fmt::format("WHERE {}", live_cond);
     std::string set_str; unsigned i =0;
     std::apply([&](const auto&... fs) {
         ((std::invoke([&](const auto& f) {
@@ -94,15 +221,110 @@ void modify_models_in_db(const model::AuthToken &auth_tok, PermissionParams pp,
         }, fs), i++), ...);
     }, model_access.move_safely().fields());
     rs::throw_if<InvalidParamsError>(set_str.empty(), "No valid parameters to modify");
+    if (!version_inc.empty()) set_str.append(fmt::format(",{}", version_inc));
     db << fmt::format("UPDATE {} SET {} {}", table_name, std::move(set_str), std::move(filter_stmt));
 }
 
+/* Called when an id-checked mutation did not touch any row, rows not matching live_cond count as missing
+ * and rows not matching version_cond (see version_predicate) fail the precondition */
+[[noreturn]] inline void throw_not_found_or_unauthorized(soci::session &db, std::string_view table_name, std::int64_t id, uint8_t desired_permissions,
+                                                         std::string_view live_cond = "", std::string_view version_cond = "") {
+    int count = 0;
+    std::string where_str = live_cond.empty() ? fmt::format("id={}", id) : fmt::format("id={} AND {}", id, live_cond);
+    db << fmt::format("SELECT COUNT(*) FROM {} WHERE {}", table_name, where_str), soci::into(count);
+    rs::throw_if<NotFoundError>(count == 0, fmt::format("Resource with id {} does not exist", id));
+    if (!version_cond.empty()) {
+        db << fmt::format("SELECT COUNT(*) FROM {} WHERE {} AND {}", table_name, where_str, version_cond), soci::into(count);
+        rs::throw_if<PreconditionFailedError>(count == 0, fmt::format("Resource with id {} was modified", id));
+    }
+    throw UnauthorizedError(permissions_to_json(desired_permissions));
+}
+
+/* Updates the row with given id in a single statement. Fields which only the owner may
+ * update are guarded inside the statement, so no prior SELECT is needed to find the owner.
+ * With if_match the row is updated only at one of its versions, see if_match_versions */
+template <rs::model::CModel M>
+void modify_model_by_id_in_db(const model::AuthToken &auth_tok, PermissionParams pp, soci::session &db, std::string_view table_name, std::int64_t id, M &&m,
+                              const std::optional<std::vector<std::int64_t>> &if_match = std::nullopt) {
+    const std::string version_inc = version_increment(pp);
+    const std::string version_cond = version_predicate(pp, table_name, if_match);
+    AuthorizedModelAccess model_access(permission::UPDATE, auth_tok, pp, db, table_name, std::move(m));
+    const std::string owner_cond = model_access.owner_predicate();
+    std::string set_str; unsigned i = 0;
+    bool has_values = false, needs_owner = true;
+    std::apply([&](const auto&... fs) {
+        ((std::invoke([&](const auto& f) {
+           if (!f.opt_value.has_value()) return;
+           has_values = true;
+           std::string value = fmt::format("'{}'", *f.opt_value);
+           if (model_access.group_mask().test(i)) {
+               needs_owner = false;
+           } else if (model_access.owner_mask().test(i)) {
+               value = fmt::format("CASE WHEN {} THEN {} ELSE {} END", owner_cond, std::move(value), M::field_name(i));
+           } else {
+               return;
+           }
+           if (!set_str.empty()) set_str.append(",");
+           set_str.append(fmt::format("{}={}", M::field_name(i), std::move(value)));
+        }, fs), i++), ...);
+    }, model_access.unsafe_ref().fields());
+    rs::throw_if<InvalidParamsError>(!has_values, "No valid parameters to modify");
+    rs::throw_if<UnauthorizedError>(set_str.empty(), permissions_to_json(model_access.desired_permissions()));
+
+    if (!version_inc.empty()) set_str.append(fmt::format(",{}", version_inc));
+
+    const std::string live_cond = model_access.live_predicate();
+    std::string where_str = needs_owner ? fmt::format("id={} AND {}", id, owner_cond) : fmt::format("id={}", id);
+    if (!live_cond.empty()) where_str.append(fmt::format(" AND {}", live_cond));
+    if (!version_cond.empty()) where_str.append(fmt::format(" AND {}", version_cond));
+    soci::statement modify_stmt = (db.prepare << fmt::format("UPDATE {} SET {} WHERE {}", table_name, std::move(set_str), std::move(where_str)));
+    modify_stmt.execute(true);
+    if (modify_stmt.get_affected_rows() == 0)
+        throw_not_found_or_unauthorized(db, table_name, id, model_access.desired_permissions(), live_cond, version_cond);
+}
+
+/* Deletes the row with given id in a single statement and returns the requested columns
+ * of the deleted row. Returned values are not filtered by READ permissions */
+template <rs::model::CModel M>
+M delete_model_by_id_from_db(const model::AuthToken &auth_tok, PermissionParams pp, soci::session &db, std::string_view table_name, std::int64_t id, std::string_view returning = "id") {
+    AuthorizedModelAccess model_access(permission::DELETE, auth_tok, pp, db, table_name, M{});
+    std::string predicate = model_access.row_predicate();
+    std::string where_str = predicate.empty() ? fmt::format("id={}", id) : fmt::format("id={} AND {}", id, std::move(predicate));
+    M deleted;
+    db << fmt::format("DELETE FROM {} WHERE {} RETURNING {}", table_name, std::move(where_str), returning), soci::into(deleted);
+    if (!db.got_data())
+        throw_not_found_or_unauthorized(db, table_name, id, model_access.desired_permissions(), model_access.live_predicate());
+    return deleted;
+}
+
+/* Same as above for tables with pp.deleted_field_name, the row is only marked as deleted
+ * and disappears from every query at once. Purger removes it with its files later.
+ * With if_match the row is deleted only at one of its versions, see if_match_versions */
+template <rs::model::CModel M>
+M mark_model_deleted_by_id(const model::AuthToken &auth_tok, PermissionParams pp, soci::session &db, std::string_view table_name, std::int64_t id,
+                           const std::optional<std::vector<std::int64_t>> &if_match = std::nullopt, std::string_view returning = "id") {
+    rs::throw_if<OtherError>(!pp.deleted_field_name.has_value(), fmt::format("Rows of {} can not be marked as deleted", table_name));
+    const std::string deleted_field_name = *pp.deleted_field_name;
+    const std::string version_inc = version_increment(pp);
+    const std::string version_cond = version_predicate(pp, table_name, if_match);
+    AuthorizedModelAccess model_access(permission::DELETE, auth_tok, std::move(pp), db, table_name, M{});
+    std::string predicate = model_access.row_predicate();
+    M deleted;
+    db << fmt::format("UPDATE {} SET {}='{}'{}{} WHERE id={} AND {}{}{} RETURNING {}", table_name, deleted_field_name, rs::iso_date_time_now(),
+                      version_inc.empty() ? "" : ",", version_inc, id, std::move(predicate),
+                      version_cond.empty() ? "" : " AND ", version_cond, returning), soci::into(deleted);
+    if (!db.got_data())
+        throw_not_found_or_unauthorized(db, table_name, id, model_access.desired_permissions(), model_access.live_predicate(), version_cond);
+    return deleted;
+}
+
 model::RefreshAndAuthTokens login(soci::session &db, const model::UserCredentials &credentials) {
     throw_if<InvalidParamsError>(!credentials.username.opt_value.has_value() 
                               || !credentials.password.opt_value.has_value(),
                               "Username or password missing");
     model::User u;
-    db << fmt::format("SELECT id,username,password,permission_group FROM users WHERE username = '{}'", *credentials.username.opt_value), soci::into(u);
+    db << fmt::format("SELECT id,username,password,permission_group FROM users WHERE username = '{}' AND deleted_at IS NULL", *credentials.username.opt_value), soci::into(u);
+    throw_if<InvalidParamsError>(!db.got_data(), "Invalid username or password");
     throw_if<InvalidParamsError>(*credentials.password.opt_value != *u.password.opt_value, "Invalid username or password");
 
     jwt::jwt_object auth_token{jwt::params::algorithm("HS256"), jwt::params::secret("changemesecret")};
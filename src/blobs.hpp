@@ -0,0 +1,136 @@
+#ifndef RS_BLOBS_HPP
+#define RS_BLOBS_HPP
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <soci/soci.h>
+#include <fmt/format.h>
+
+#include "storage.hpp"
+#include "thumbnail_pack.hpp"
+#include "utils.hpp"
+
+/* Content addressed storage of uploaded photos. Every distinct file is stored once as a blob
+ * named by its sha256 and referenced by photos.content_hash, blobs.refcount counts the references.
+ * Per photo files (storage::photo) are hard links to the blob files, so static routes serve them
+ * without knowing about blobs. Thumbnails go to the ThumbnailPack, storage::thumbnail links are
+ * only made when packing fails. */
+namespace rs::blobs {
+
+/* Incremental sha256 for contents received in parts, see UploadSessions */
+class Sha256 {
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> m_ctx {EVP_MD_CTX_new(), &EVP_MD_CTX_free};
+public:
+    Sha256() {
+        throw_if<OtherError>(!m_ctx || !EVP_DigestInit_ex(m_ctx.get(), EVP_sha256(), nullptr), "sha256 could not be initialized");
+    }
+
+    void update(std::string_view data) {
+        EVP_DigestUpdate(m_ctx.get(), data.data(), data.size());
+    }
+
+    std::string hex_digest() {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(m_ctx.get(), digest, &len);
+        return fmt::format("{:02x}", fmt::join(std::span(digest, len), ""));
+    }
+};
+
+std::string sha256_hex(std::string_view data) {
+    Sha256 sha;
+    sha.update(data);
+    return sha.hex_digest();
+}
+
+/* Replaces file at dest with a hard link to blob file */
+void link(const storage::Location &blob, const storage::Location &dest) {
+    storage::prepare(dest);
+    storage::remove(dest);
+    std::filesystem::create_hard_link(blob.existing_path(), dest.path());
+}
+
+struct Reference {
+    bool is_new;                  // caller has to store the file and render the thumbnail
+    std::string extension;        // of the stored blob, may differ from the one of a duplicate upload
+    std::string thumbnail_status;
+};
+
+/* Adds a reference, inserting the blob if it is not known yet.
+ * Must run in the same transaction as the photo insert */
+Reference acquire(soci::session &db, std::string_view hash, std::string_view extension, std::size_t size) {
+    Reference ref;
+    long long refcount = 0;
+    db << fmt::format("INSERT INTO blobs (hash, extension, size) VALUES ('{}', '{}', {}) "
+                      "ON CONFLICT(hash) DO UPDATE SET refcount = refcount + 1 "
+                      "RETURNING refcount, extension, thumbnail_status", hash, extension, size),
+          soci::into(refcount), soci::into(ref.extension), soci::into(ref.thumbnail_status);
+    ref.is_new = refcount == 1;
+    return ref;
+}
+
+/* Drops a reference, the last one removes the blob and its files.
+ * Must run in the same transaction as the photo delete */
+void release(soci::session &db, std::string_view hash) {
+    long long refcount = 0;
+    std::string extension;
+    db << fmt::format("UPDATE blobs SET refcount = refcount - 1 WHERE hash = '{}' RETURNING refcount, extension", hash),
+          soci::into(refcount), soci::into(extension);
+    if (!db.got_data() || refcount > 0)
+        return;
+
+    db << fmt::format("DELETE FROM blobs WHERE hash = '{}'", hash);
+    storage::remove(storage::blob(hash, extension));
+    storage::remove(storage::blob_thumbnail(hash));
+}
+
+/* Records thumbnail result for the blob and every photo referencing it, including photos uploaded while
+ * it was being rendered. Returns ids of the photos to pack the thumbnail for once this is committed,
+ * nullopt when all of them were deleted in the meantime */
+std::optional<std::vector<std::uint64_t>> record_thumbnail(soci::session &db, std::string_view hash, bool success) {
+    const char * status = success ? "ready" : "failed";
+    soci::statement update_stmt = (db.prepare << fmt::format("UPDATE blobs SET thumbnail_status = '{}' WHERE hash = '{}'", status, hash));
+    update_stmt.execute(true);
+    if (update_stmt.get_affected_rows() == 0)
+        return std::nullopt;
+
+    /* thumbnail_status is part of the photo, its ETag changes with the version */
+    db << fmt::format("UPDATE photos SET thumbnail_status = '{}', version = version + 1 WHERE content_hash = '{}'", status, hash);
+    std::vector<std::uint64_t> ids;
+    if (!success)
+        return ids;
+    soci::rowset<long long> rows = (db.prepare << fmt::format("SELECT id FROM photos WHERE content_hash = '{}'", hash));
+    for (long long id : rows) ids.push_back(static_cast<std::uint64_t>(id));
+    return ids;
+}
+
+/* Packs the rendered thumbnail for photos returned by record_thumbnail, links it where packing fails */
+void store_thumbnail(ThumbnailPack &pack, std::string_view hash, const std::optional<std::vector<std::uint64_t>> &ids) {
+    const auto thumbnail = storage::blob_thumbnail(hash);
+    if (!ids.has_value() || ids->empty()) /* failed, or all photos were deleted */ {
+        storage::remove(thumbnail);
+        return;
+    }
+    if (pack.put_file(hash, thumbnail.path(), *ids)) {
+        storage::remove(thumbnail);
+        return;
+    }
+    for (auto id : *ids)
+        link(thumbnail, storage::thumbnail(id));
+}
+
+/* Marks a failed thumbnail to be rendered again for a new upload of the content.
+ * Must run in the transaction of acquire */
+void retry_thumbnail(soci::session &db, std::string_view hash) {
+    db << fmt::format("UPDATE blobs SET thumbnail_status = 'pending' WHERE hash = '{}'", hash);
+}
+
+} // ns rs::blobs
+
+#endif // RS_BLOBS_HPP
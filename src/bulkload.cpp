@@ -0,0 +1,360 @@
+#include <soci/soci.h>
+#include <soci/sqlite3/soci-sqlite3.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <thread>
+
+#include "actions.hpp"
+#include "id_generator.hpp"
+#include "models.hpp"
+#include "permission.hpp"
+#include "utils.hpp"
+#include "3rd_party/color.hpp"
+
+/* Offline loader for User and Photo records, bypasses HTTP and permission checks.
+ * Input is NDJSON (one json object per line) or CSV (header line with field names). */
+namespace rs::bulkload {
+
+enum class InputFormat { ndjson, csv };
+
+struct CmdLineArgs {
+    std::optional<const char *> db_config;
+    std::optional<const char *> table;
+    std::optional<const char *> input;
+    InputFormat format = InputFormat::ndjson;
+    std::size_t batch_size = 10000;
+    unsigned num_of_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::optional<std::uint32_t> node_id;
+    bool help {false};
+
+    static constexpr const char * help_string =
+          "--db -d\t\t\tPath to db to be used\n"
+          "--table -t\t\tusers or photos\n"
+          "--input -i\t\tInput file (stdin if not set)\n"
+          "--csv\t\t\tInput is CSV instead of NDJSON\n"
+          "--batch -b\t\tRows per transaction (default 10000)\n"
+          "--jobs -j\t\tValidation threads (default all cores)\n"
+          "--node-id\t\tNode of generated photo ids, required for photos and distinct from every server on the db\n"
+          "-h --help\t\tShow help menu\n";
+};
+
+CmdLineArgs parse_cmdline_args(std::span<char *> args)
+{
+    CmdLineArgs result{};
+    auto it_end = std::cend(args);
+
+    for (auto it = std::cbegin(args); it != it_end; it++) {
+        auto it_next = std::next(it);
+        std::string_view curr{*it};
+        if ((curr == "--db" || curr == "-d") && it_next != it_end)
+            result.db_config = *it_next;
+        else if ((curr == "--table" || curr == "-t") && it_next != it_end)
+            result.table = *it_next;
+        else if ((curr == "--input" || curr == "-i") && it_next != it_end)
+            result.input = *it_next;
+        else if (curr == "--csv")
+            result.format = InputFormat::csv;
+        else if ((curr == "--batch" || curr == "-b") && it_next != it_end)
+            result.batch_size = std::max(1ul, std::strtoul(*it_next, nullptr, 10));
+        else if ((curr == "--jobs" || curr == "-j") && it_next != it_end)
+            result.num_of_threads = std::max(1ul, std::strtoul(*it_next, nullptr, 10));
+        else if (curr == "--node-id" && it_next != it_end)
+            result.node_id = static_cast<std::uint32_t>(std::strtoul(*it_next, nullptr, 10));
+        else if ((curr == "--help" || curr == "-h"))
+            result.help = true;
+    }
+    return result;
+};
+
+/* Splits one CSV line, quoted values may contain commas and "" escapes but not new lines.
+ * Empty unquoted values are returned as nullopt (NULL) */
+std::vector<std::optional<std::string>> split_csv_line(std::string_view line) {
+    std::vector<std::optional<std::string>> result;
+    std::string value;
+    bool quoted = false, in_quotes = false;
+    for (auto i = 0u; i < line.size(); i++) {
+        char c = line[i];
+        if (in_quotes) {
+            if (c == '"' && i + 1 < line.size() && line[i+1] == '"') { value.push_back('"'); i++; }
+            else if (c == '"') in_quotes = false;
+            else value.push_back(c);
+        } else if (c == '"') {
+            quoted = in_quotes = true;
+        } else if (c == ',') {
+            result.push_back(quoted || !value.empty() ? std::optional{std::move(value)} : std::nullopt);
+            value.clear(); quoted = false;
+        } else if (c != '\r') {
+            value.push_back(c);
+        }
+    }
+    result.push_back(quoted || !value.empty() ? std::optional{std::move(value)} : std::nullopt);
+    return result;
+}
+
+struct Record {
+    std::size_t line_no;
+    std::string text;
+};
+
+/* Parses and validates a single record, on failure returns nullopt and fills error */
+template <model::CModel M>
+std::optional<M> parse_record(const Record &r, InputFormat format, std::span<const std::string> csv_header, std::string &error) {
+    M m;
+    try {
+        if (format == InputFormat::ndjson) {
+            from_json(nlohmann::json::parse(r.text), m);
+        } else {
+            auto values = split_csv_line(r.text);
+            if (values.size() != csv_header.size()) {
+                error = fmt::format("Expected {} columns, got {}", csv_header.size(), values.size());
+                return std::nullopt;
+            }
+            for (auto i = 0u; i < values.size(); i++) {
+                if (values[i].has_value() && !m.try_set_field_value(csv_header[i], std::move(*values[i]))) {
+                    error = fmt::format("Invalid value for field {}", csv_header[i]);
+                    return std::nullopt;
+                }
+            }
+        }
+    } catch (const nlohmann::json::parse_error &perror) {
+        error = perror.what();
+        return std::nullopt;
+    }
+
+    if (auto errs = m.get_unsatisfied_constraints().transform(model::cnstr::get_description); !errs.empty()) {
+        error = nlohmann::json(errs).dump();
+        return std::nullopt;
+    }
+    return m;
+}
+
+/* Column-wise buffers bound once to a prepared multi-row INSERT, soci executes it as a bulk operation */
+template <model::CModel M>
+class BulkInsertStatement {
+    template <std::size_t I>
+    using member_t = refl::trait::get_t<I, refl::member_list<M>>;
+
+    template <std::size_t ...Is>
+    static auto make_columns(std::index_sequence<Is...>)
+        -> std::tuple<std::vector<typename member_t<Is>::value_type::value_type>...>;
+
+    using columns_t = decltype(make_columns(std::make_index_sequence<M::num_of_fields()>{}));
+
+    columns_t m_columns;
+    std::array<std::vector<soci::indicator>, M::num_of_fields()> m_indicators;
+    soci::statement m_stmt;
+
+    template <std::size_t ...Is>
+    soci::statement prepare(soci::session &db, std::string_view table_name, std::index_sequence<Is...>) {
+        std::vector<std::string> placeholders;
+        for (const char * name : M::field_names()) placeholders.push_back(fmt::format(":{}", name));
+        auto sql = fmt::format("INSERT INTO {} ({}) VALUES ({})", table_name,
+                               fmt::join(M::field_names(), ","), fmt::join(placeholders, ","));
+        return ((db.prepare << sql), ..., soci::use(std::get<Is>(m_columns), m_indicators[Is]));
+    }
+
+    template <std::size_t ...Is>
+    void append(const M &m, std::index_sequence<Is...>) {
+        ((std::invoke([&](const auto &opt_value) {
+            using value_type = typename std::tuple_element_t<Is, columns_t>::value_type;
+            std::get<Is>(m_columns).push_back(opt_value.value_or(value_type{}));
+            m_indicators[Is].push_back(opt_value.has_value() ? soci::i_ok : soci::i_null);
+        }, member_t<Is>{}(m).opt_value)), ...);
+    }
+
+public:
+    BulkInsertStatement(soci::session &db, std::string_view table_name)
+        : m_stmt(prepare(db, table_name, std::make_index_sequence<M::num_of_fields()>{})) {}
+
+    void append(const M &m) {
+        append(m, std::make_index_sequence<M::num_of_fields()>{});
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return m_indicators[0].size();
+    }
+
+    void execute() {
+        if (size() == 0) return;
+        m_stmt.execute(true);
+    }
+
+    void clear() {
+        std::apply([](auto &...cs) { (cs.clear(), ...); }, m_columns);
+        for (auto &is : m_indicators) is.clear();
+    }
+};
+
+/* Fields the routes set on insert, an explicit NULL would override the column's default.
+ * Runs on the loading thread, workers would each claim one of IdGenerator::max_threads slots */
+void set_defaults(model::User &user, const IdGenerator &) {
+    if (!user.join_date.opt_value.has_value()) user.join_date.opt_value = iso_date_now();
+    if (!user.permission_group.opt_value.has_value()) user.permission_group.opt_value = static_cast<int32_t>(UserGroup::user);
+}
+
+void set_defaults(model::Photo &photo, const IdGenerator &ids) {
+    if (!photo.id.opt_value.has_value()) photo.id.opt_value = static_cast<long long>(ids.next()); // as POST /photos does
+    if (!photo.upload_time.opt_value.has_value()) photo.upload_time.opt_value = iso_date_time_now();
+}
+
+struct Stats {
+    std::size_t loaded = 0;
+    std::size_t rejected = 0;
+};
+
+template <model::CModel M>
+Stats load(soci::session &db, std::string_view table_name, std::istream &in, const CmdLineArgs &args) {
+    Stats stats;
+    std::vector<std::string> csv_header;
+    std::size_t line_no = 0;
+    std::string line;
+
+    if (args.format == InputFormat::csv && std::getline(in, line)) {
+        line_no++;
+        for (auto &name : split_csv_line(line)) csv_header.push_back(name.value_or(""));
+    }
+
+    BulkInsertStatement<M> insert_stmt(db, table_name);
+    const IdGenerator ids(args.node_id.value_or(0)); /* for photos without an id */
+    std::vector<Record> records; records.reserve(args.batch_size);
+    std::vector<std::optional<M>> parsed(args.batch_size);
+    std::vector<std::string> errors(args.batch_size);
+    const auto start = std::chrono::steady_clock::now();
+
+    auto flush = [&]() {
+        const std::size_t n = records.size();
+        const std::size_t chunk = (n + args.num_of_threads - 1) / args.num_of_threads;
+        std::vector<std::jthread> workers;
+        for (std::size_t first = 0; first < n; first += chunk) {
+            workers.emplace_back([&, first]() {
+                for (std::size_t i = first; i < std::min(first + chunk, n); i++) {
+                    errors[i].clear();
+                    parsed[i].reset();
+                    if (auto m = parse_record<M>(records[i], args.format, csv_header, errors[i]))
+                        parsed[i].emplace(std::move(*m));
+                }
+            });
+        }
+        workers.clear(); // joins
+
+        std::vector<M> batch; batch.reserve(n);
+        std::vector<std::size_t> batch_lines; batch_lines.reserve(n);
+        for (std::size_t i = 0; i < n; i++) {
+            if (parsed[i].has_value()) {
+                set_defaults(*parsed[i], ids);
+                batch.push_back(std::move(*parsed[i]));
+                batch_lines.push_back(records[i].line_no);
+            } else {
+                fmt::print(stderr, "{}line {}:{} {}\n", COLOR_RED, records[i].line_no, COLOR_DEF, errors[i]);
+                stats.rejected++;
+            }
+        }
+
+        /* Rows already in the db or repeated in the batch would roll back the whole batch */
+        std::vector<std::vector<const char *>> duplicates(batch.size());
+        if constexpr (std::is_same_v<M, model::User>) {
+            try {
+                duplicates = actions::check_uniquenes_in_db(db, table_name, std::span<const M>(batch));
+            } catch (const soci::soci_error &) {} // rows are then inserted one by one below
+        }
+        for (std::size_t i = 0; i < batch.size(); i++) {
+            if (duplicates[i].empty()) {
+                insert_stmt.append(batch[i]);
+            } else {
+                fmt::print(stderr, "{}line {}:{} {} already exist in db\n", COLOR_RED, batch_lines[i], COLOR_DEF,
+                           fmt::join(duplicates[i], ", "));
+                stats.rejected++;
+            }
+        }
+
+        try {
+            soci::transaction tr(db);
+            insert_stmt.execute();
+            tr.commit();
+            stats.loaded += insert_stmt.size();
+        } catch (const soci::soci_error &e) {
+            /* one bad row must not cost the whole batch, find it by inserting rows one per transaction */
+            fmt::print(stderr, "{}lines {}-{}:{} batch rejected, inserting row by row: {}\n", COLOR_RED,
+                       records.front().line_no, records.back().line_no, COLOR_DEF, e.get_error_message());
+            for (std::size_t i = 0; i < batch.size(); i++) {
+                if (!duplicates[i].empty()) continue;
+                insert_stmt.clear();
+                insert_stmt.append(batch[i]);
+                try {
+                    soci::transaction tr(db);
+                    insert_stmt.execute();
+                    tr.commit();
+                    stats.loaded++;
+                } catch (const soci::soci_error &row_error) {
+                    fmt::print(stderr, "{}line {}:{} {}\n", COLOR_RED, batch_lines[i], COLOR_DEF, row_error.get_error_message());
+                    stats.rejected++;
+                }
+            }
+        }
+        insert_stmt.clear();
+        records.clear();
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fmt::print(stderr, "{} rows loaded, {:.0f} rows/s\n", stats.loaded, stats.loaded / elapsed.count());
+    };
+
+    while (std::getline(in, line)) {
+        line_no++;
+        if (line.empty()) continue;
+        records.push_back({line_no, std::move(line)});
+        if (records.size() == args.batch_size) flush();
+    }
+    if (!records.empty()) flush();
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fmt::print("{}Loaded {}{}{} rows into {} ({} rejected) in {:.2f}s, {:.0f} rows/s{}\n", COLOR_GRN, COLOR_YEL, stats.loaded, COLOR_GRN,
+               table_name, stats.rejected, elapsed.count(), stats.loaded / elapsed.count(), COLOR_DEF);
+    return stats;
+}
+
+} // ns rs::bulkload
+
+int main(int argc, char * argv[])
+{
+    auto argv_span = std::span(argv, argc);
+    auto args = rs::bulkload::parse_cmdline_args(argv_span);
+
+    if (args.help || !args.table.has_value()) {
+        fmt::print("USAGE {} -d <path_to_db> -t <users|photos> [-i <input>]\n", *argv_span.begin());
+        fmt::print("{}", rs::bulkload::CmdLineArgs::help_string);
+        std::exit(0);
+    }
+
+    std::ifstream input_file;
+    if (args.input.has_value()) {
+        input_file.open(*args.input);
+        if (!input_file) {
+            fmt::print(stderr, "Can not open {}\n", *args.input);
+            return 1;
+        }
+    }
+    std::istream &in = args.input.has_value() ? input_file : std::cin;
+
+    soci::session db(soci::sqlite3, rs::db_connection_string(args.db_config.value_or("db.sqlite")));
+
+    std::string_view table{*args.table};
+    rs::bulkload::Stats stats;
+    if (table == "users") {
+        stats = rs::bulkload::load<rs::model::User>(db, table, in, args);
+    } else if (table == "photos") {
+        if (!args.node_id.has_value() || *args.node_id > rs::IdGenerator::max_node_id) {
+            fmt::print(stderr, "--node-id (0-{}) is required for photos, use one no server on the db is started with\n",
+                       rs::IdGenerator::max_node_id);
+            return 1;
+        }
+        stats = rs::bulkload::load<rs::model::Photo>(db, table, in, args);
+    } else {
+        fmt::print(stderr, "Unknown table {}, expected users or photos\n", table);
+        return 1;
+    }
+
+    return stats.rejected == 0 ? 0 : 2;
+}
@@ -0,0 +1,156 @@
+#ifndef RS_COMPRESSION_HPP
+#define RS_COMPRESSION_HPP
+
+#include <zlib.h>
+#ifdef RS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <restinio/all.hpp>
+
+#include "utils.hpp"
+
+namespace rs::compression {
+
+/* Content codings in order of preference when the client accepts several equally */
+enum class Encoding { zstd, gzip, deflate, identity };
+
+constexpr const char * encoding_name(Encoding e) {
+    switch (e) {
+        case Encoding::zstd: return "zstd";
+        case Encoding::gzip: return "gzip";
+        case Encoding::deflate: return "deflate";
+        default: return "identity";
+    }
+}
+
+constexpr std::array supported_encodings {
+#ifdef RS_HAVE_ZSTD
+    Encoding::zstd,
+#endif
+    Encoding::gzip, Encoding::deflate
+};
+
+/* Compression of a route's responses. level is passed to zlib (1-9) and zstd (1-19),
+ * smaller bodies are not worth the CPU and sent as they are */
+struct Options {
+    int level = 6;
+    std::size_t min_size = 1024;
+};
+
+constexpr Options disabled {0, std::numeric_limits<std::size_t>::max()};
+
+namespace detail {
+
+/* deflate stream kept by every thread for each format and reset between bodies */
+struct ZlibStream {
+    z_stream zs {};
+    int level = -1;
+
+    ~ZlibStream() {
+        if (level >= 0) ::deflateEnd(&zs);
+    }
+
+    /* window_bits 15 is the zlib format ("deflate" coding), 15 + 16 gzip */
+    z_stream *get(int window_bits, int new_level) {
+        if (level < 0) {
+            if (::deflateInit2(&zs, new_level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return nullptr;
+        } else {
+            ::deflateReset(&zs);
+            if (new_level != level && ::deflateParams(&zs, new_level, Z_DEFAULT_STRATEGY) != Z_OK)
+                return nullptr;
+        }
+        level = new_level;
+        return &zs;
+    }
+};
+
+inline std::optional<std::string> zlib_compress(std::string_view data, int window_bits, int level) {
+    thread_local ZlibStream gzip_stream, deflate_stream;
+    z_stream *zs = (window_bits > 15 ? gzip_stream : deflate_stream).get(window_bits, std::clamp(level, 1, 9));
+    if (!zs) return std::nullopt;
+
+    std::string out(::deflateBound(zs, static_cast<uLong>(data.size())), '\0');
+    zs->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs->avail_in = static_cast<uInt>(data.size());
+    zs->next_out = reinterpret_cast<Bytef*>(out.data());
+    zs->avail_out = static_cast<uInt>(out.size());
+    if (::deflate(zs, Z_FINISH) != Z_STREAM_END)
+        return std::nullopt;
+    out.resize(zs->total_out);
+    return out;
+}
+
+#ifdef RS_HAVE_ZSTD
+inline std::optional<std::string> zstd_compress(std::string_view data, int level) {
+    thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> ctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+    if (!ctx) return std::nullopt;
+    std::string out(ZSTD_compressBound(data.size()), '\0');
+    const auto n = ZSTD_compressCCtx(ctx.get(), out.data(), out.size(), data.data(), data.size(), std::clamp(level, 1, 19));
+    if (ZSTD_isError(n)) return std::nullopt;
+    out.resize(n);
+    return out;
+}
+#endif
+
+} // ns detail
+
+/* Body in encoding, nullopt if the compressor fails. Compressor contexts are reused by the calling thread */
+std::optional<std::string> compress(std::string_view data, Encoding encoding, int level) {
+    switch (encoding) {
+        case Encoding::gzip: return detail::zlib_compress(data, 15 + 16, level);
+        case Encoding::deflate: return detail::zlib_compress(data, 15, level);
+#ifdef RS_HAVE_ZSTD
+        case Encoding::zstd: return detail::zstd_compress(data, level);
+#endif
+        default: return std::string{data};
+    }
+}
+
+/* gzip stream of data, nullopt if zlib fails */
+std::optional<std::string> gzip(std::string_view data, int level = Z_BEST_COMPRESSION) {
+    return compress(data, Encoding::gzip, level);
+}
+
+/* q value of coding in Accept-Encoding header value in thousandths, "*" stands for codings not listed */
+int quality(std::string_view header, std::string_view coding) {
+    std::optional<int> exact, wildcard;
+    for_each_weighted_item(header, [&](std::string_view name, int q) {
+        if (iequals(name, coding)) exact = q;
+        else if (name == "*") wildcard = q;
+    });
+    return exact.value_or(wildcard.value_or(0));
+}
+
+/* Whether Accept-Encoding of the request allows coding, honoring q=0 and "*" */
+bool accepts(const restinio::request_handle_t &req, std::string_view coding) {
+    const auto header = req->header().opt_value_of(restinio::http_field::accept_encoding);
+    return header && quality(*header, coding) > 0;
+}
+
+/* Supported coding the client prefers, identity without Accept-Encoding */
+Encoding negotiate(const restinio::request_handle_t &req) {
+    const auto header = req->header().opt_value_of(restinio::http_field::accept_encoding);
+    if (!header) return Encoding::identity;
+    Encoding best = Encoding::identity;
+    int best_q = 0;
+    for (auto e : supported_encodings)
+        if (const int q = quality(*header, encoding_name(e)); q > best_q) {
+            best = e;
+            best_q = q;
+        }
+    return best;
+}
+
+} // ns rs::compression
+
+#endif // RS_COMPRESSION_HPP
@@ -0,0 +1,128 @@
+#ifndef RS_CONNECTIONS_HPP
+#define RS_CONNECTIONS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <variant>
+
+#include <nlohmann/json.hpp>
+#include <restinio/all.hpp>
+
+namespace rs {
+
+/* Lifecycle of client connections, set from the command line (see CmdLineArgs) */
+struct ConnectionSettings {
+    bool keep_alive_on_error = true;
+    std::chrono::seconds idle_timeout {60};  // waiting for and reading the next request
+    std::chrono::seconds write_timeout {30}; // sending a response
+    std::size_t max_requests = 0;            // per connection, 0 is unlimited
+    std::size_t max_connections = std::numeric_limits<std::size_t>::max();
+    std::size_t concurrent_accepts = 1;
+};
+
+void to_json(nlohmann::json &j, const ConnectionSettings &s) {
+    j["keep_alive_on_error"] = s.keep_alive_on_error;
+    j["idle_timeout_s"] = s.idle_timeout.count();
+    j["write_timeout_s"] = s.write_timeout.count();
+    j["max_requests"] = s.max_requests;
+    j["max_connections"] = s.max_connections;
+    j["concurrent_accepts"] = s.concurrent_accepts;
+}
+
+/* Counts requests of every connection to close it after settings.max_requests or an error response
+ * when keep_alive_on_error is off, and keeps connection metrics. Responses learn about it through
+ * apply(), restinio reports accepted and closed connections through state_changed(). */
+class ConnectionTracker {
+public:
+    struct Metrics {
+        std::uint64_t accepted;
+        std::uint64_t closed;
+        std::uint64_t active;
+        std::uint64_t requests;
+        std::uint64_t closed_after_max_requests;
+        std::uint64_t closed_on_error;
+    };
+
+private:
+    ConnectionSettings m_settings;
+    std::mutex m_mutex;
+    std::unordered_map<restinio::connection_id_t, std::size_t> m_requests; // responses sent per open connection
+
+    std::atomic<std::uint64_t> m_accepted = 0;
+    std::atomic<std::uint64_t> m_closed = 0;
+    std::atomic<std::uint64_t> m_total_requests = 0;
+    std::atomic<std::uint64_t> m_closed_after_max_requests = 0;
+    std::atomic<std::uint64_t> m_closed_on_error = 0;
+
+public:
+    ConnectionTracker() = default;
+    ConnectionTracker(const ConnectionTracker&) = delete;
+    ConnectionTracker &operator=(const ConnectionTracker&) = delete;
+
+    /* Must not be called while the server runs */
+    void configure(ConnectionSettings settings) { m_settings = settings; }
+
+    [[nodiscard]] const ConnectionSettings &settings() const { return m_settings; }
+
+    /* restinio connection state listener */
+    void state_changed(const restinio::connection_state::notice_t &notice) noexcept {
+        if (std::holds_alternative<restinio::connection_state::accepted_t>(notice.cause())) {
+            m_accepted++;
+        } else if (std::holds_alternative<restinio::connection_state::closed_t>(notice.cause())) {
+            m_closed++;
+            std::lock_guard lock(m_mutex);
+            m_requests.erase(notice.connection_id());
+        }
+    }
+
+    /* Closes the connection with this response if it is the last one allowed */
+    template <typename Builder>
+    Builder &apply(const restinio::request_handle_t &req, Builder &resp, restinio::http_status_line_t status) {
+        m_total_requests++;
+        if (!m_settings.keep_alive_on_error && status.status_code().raw_code() >= 400) {
+            m_closed_on_error++;
+            resp.connection_close();
+        } else if (m_settings.max_requests != 0) {
+            std::lock_guard lock(m_mutex);
+            if (++m_requests[req->connection_id()] >= m_settings.max_requests) {
+                m_closed_after_max_requests++;
+                resp.connection_close();
+            }
+        }
+        return resp;
+    }
+
+    [[nodiscard]] Metrics metrics() const {
+        const std::uint64_t accepted = m_accepted, closed = m_closed;
+        return {accepted, closed, accepted - std::min(accepted, closed), m_total_requests,
+                m_closed_after_max_requests, m_closed_on_error};
+    }
+};
+
+void to_json(nlohmann::json &j, const ConnectionTracker::Metrics &m) {
+    j["accepted"] = m.accepted;
+    j["closed"] = m.closed;
+    j["active"] = m.active;
+    j["requests"] = m.requests;
+    j["closed_after_max_requests"] = m.closed_after_max_requests;
+    j["closed_on_error"] = m.closed_on_error;
+}
+
+/* Tracker shared by every response, restinio holds it as connection state listener */
+inline const std::shared_ptr<ConnectionTracker> &connection_tracker() {
+    static auto instance = std::make_shared<ConnectionTracker>();
+    return instance;
+}
+
+inline ConnectionTracker &connections() {
+    return *connection_tracker();
+}
+
+} // ns rs
+
+#endif // RS_CONNECTIONS_HPP
@@ -0,0 +1,111 @@
+#ifndef RS_CORS_HPP
+#define RS_CORS_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/format.h>
+#include <restinio/all.hpp>
+
+#include "connections.hpp"
+
+namespace rs {
+
+/* Which cross-origin requests browsers may send, see Router. Credentials are allowed only for origins
+ * listed by name, "*" lets any other origin make requests without them */
+struct CorsPolicy {
+    std::vector<std::string> allowed_origins {"*"};
+    bool allow_credentials = false;
+    std::vector<std::string> allowed_methods {"GET", "HEAD", "POST", "PUT", "PATCH", "DELETE"};
+    std::vector<std::string> allowed_headers {"Authorization", "Content-Type", "Idempotency-Key", "Upload-Offset",
+                                              "If-Match", "If-None-Match", "Accept-Encoding"};
+    std::vector<std::string> exposed_headers {"ETag", "Idempotent-Replayed", "Upload-Offset"};
+    std::chrono::seconds max_age = std::chrono::hours(24);
+};
+
+/* CORS headers of responses and answers to preflight requests. Header values are serialized once
+ * from the policy, only Access-Control-Allow-Origin depends on the request: it is the request's
+ * Origin only when that origin is listed, "*" (never with credentials) for others if "*" is listed. */
+class Cors {
+    CorsPolicy m_policy;
+    bool m_any_origin = true;
+    bool m_echo_origin = false; // some origins are listed by name, responses vary by Origin
+    std::string m_allow_methods;
+    std::string m_allow_headers;
+    std::string m_expose_headers;
+    std::string m_max_age;
+
+public:
+    explicit Cors(CorsPolicy policy = {}) { configure(std::move(policy)); }
+
+    /* Must not be called while the server runs */
+    void configure(CorsPolicy policy) {
+        m_policy = std::move(policy);
+        m_any_origin = std::ranges::find(m_policy.allowed_origins, "*") != m_policy.allowed_origins.end();
+        m_echo_origin = std::ranges::any_of(m_policy.allowed_origins, [](const auto &o) { return o != "*"; });
+        m_allow_methods = fmt::format("{}, OPTIONS", fmt::join(m_policy.allowed_methods, ", "));
+        m_allow_headers = fmt::format("{}", fmt::join(m_policy.allowed_headers, ", "));
+        m_expose_headers = fmt::format("{}", fmt::join(m_policy.exposed_headers, ", "));
+        m_max_age = std::to_string(m_policy.max_age.count());
+    }
+
+    [[nodiscard]] const CorsPolicy &policy() const { return m_policy; }
+
+    /* Access-Control-Allow-Origin for the request, nullopt if its origin is not allowed */
+    [[nodiscard]] std::optional<std::string> allow_origin(const restinio::request_handle_t &req) const {
+        if (m_echo_origin) {
+            const auto origin = req->header().opt_value_of(restinio::http_field::origin);
+            if (origin && *origin != "*" && std::ranges::find(m_policy.allowed_origins, *origin) != m_policy.allowed_origins.end())
+                return std::string{*origin};
+        }
+        return m_any_origin ? std::optional<std::string>{"*"} : std::nullopt;
+    }
+
+    /* Browsers reject credentials with "*" */
+    [[nodiscard]] bool allow_credentials(std::string_view allowed_origin) const {
+        return m_policy.allow_credentials && allowed_origin != "*";
+    }
+
+    template <typename Builder>
+    Builder &apply(const restinio::request_handle_t &req, Builder &resp) const {
+        if (m_echo_origin) resp.append_header(restinio::http_field::vary, "Origin");
+        const auto origin = allow_origin(req);
+        if (!origin) return resp;
+        resp.append_header(restinio::http_field::access_control_allow_origin, *origin);
+        if (allow_credentials(*origin))
+            resp.append_header(restinio::http_field::access_control_allow_credentials, "true");
+        if (!m_expose_headers.empty())
+            resp.append_header(restinio::http_field::access_control_expose_headers, m_expose_headers);
+        return resp;
+    }
+
+    /* Answers OPTIONS request, browsers cache the answer for max_age */
+    restinio::request_handling_status_t preflight(const restinio::request_handle_t &req) const {
+        auto resp = req->create_response(restinio::status_no_content());
+        resp.append_header(restinio::http_field::allow, m_allow_methods);
+        if (m_echo_origin) resp.append_header(restinio::http_field::vary, "Origin");
+        if (const auto origin = allow_origin(req)) {
+            resp.append_header(restinio::http_field::access_control_allow_origin, *origin)
+                .append_header(restinio::http_field::access_control_allow_methods, m_allow_methods)
+                .append_header(restinio::http_field::access_control_allow_headers, m_allow_headers)
+                .append_header(restinio::http_field::access_control_max_age, m_max_age);
+            if (allow_credentials(*origin))
+                resp.append_header(restinio::http_field::access_control_allow_credentials, "true");
+        }
+        return connections().apply(req, resp, restinio::status_no_content()).done();
+    }
+};
+
+/* Policy shared by every response, configured through Router before the server starts */
+inline Cors &cors() {
+    static Cors instance;
+    return instance;
+}
+
+} // ns rs
+
+#endif // RS_CORS_HPP
@@ -65,6 +65,41 @@ struct NotFoundError final : Error {
     [[nodiscard]] inline restinio::http_status_line_t status() const override { return restinio::status_not_found(); }
 };
 
+struct ConflictError final : Error {
+    using Error::Error;
+    [[nodiscard]] constexpr std::string_view id() const override { return "ConflictError"; }
+    [[nodiscard]] constexpr std::string_view msg() const override { return "Request conflicts with current state of the resource"; }
+    [[nodiscard]] inline restinio::http_status_line_t status() const override { return restinio::status_conflict(); }
+};
+
+struct PreconditionFailedError final : Error {
+    using Error::Error;
+    [[nodiscard]] constexpr std::string_view id() const override { return "PreconditionFailedError"; }
+    [[nodiscard]] constexpr std::string_view msg() const override { return "Resource does not match the precondition"; }
+    [[nodiscard]] inline restinio::http_status_line_t status() const override { return restinio::status_precondition_failed(); }
+};
+
+struct PayloadTooLargeError final : Error {
+    using Error::Error;
+    [[nodiscard]] constexpr std::string_view id() const override { return "PayloadTooLargeError"; }
+    [[nodiscard]] constexpr std::string_view msg() const override { return "Request body too large"; }
+    [[nodiscard]] inline restinio::http_status_line_t status() const override { return restinio::status_payload_too_large(); }
+};
+
+struct TooManyRequestsError final : Error {
+    using Error::Error;
+    [[nodiscard]] constexpr std::string_view id() const override { return "TooManyRequestsError"; }
+    [[nodiscard]] constexpr std::string_view msg() const override { return "Too many requests"; }
+    [[nodiscard]] inline restinio::http_status_line_t status() const override { return restinio::status_too_many_requests(); }
+};
+
+struct ServiceUnavailableError final : Error {
+    using Error::Error;
+    [[nodiscard]] constexpr std::string_view id() const override { return "ServiceUnavailableError"; }
+    [[nodiscard]] constexpr std::string_view msg() const override { return "Service temporarily unavailable, retry later"; }
+    [[nodiscard]] inline restinio::http_status_line_t status() const override { return restinio::status_service_unavailable(); }
+};
+
 struct DBError final : Error {
     using Error::Error;
     [[nodiscard]] constexpr std::string_view id() const override { return "DBError"; }
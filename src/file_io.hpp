@@ -0,0 +1,415 @@
+#ifndef RS_FILE_IO_HPP
+#define RS_FILE_IO_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef RS_HAVE_LIBURING
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+
+#include <fmt/format.h>
+#include <restinio/all.hpp>
+
+#include "errors.hpp"
+#include "utils.hpp"
+
+namespace rs {
+
+/* Asynchronous file writes and removals for request handlers. Completion callbacks are posted
+ * to the server's io_context, so handlers continue on a restinio worker thread instead of blocking one.
+ * Built with liburing it submits to io_uring, one ring per submitting thread whose eventfd is watched
+ * by the io_context. A small thread pool doing the same synchronously is used when io_uring is
+ * not available (older kernel, seccomp, no liburing) or a thread's ring can not be set up. */
+class FileIoService {
+public:
+    using callback_t = std::function<void(std::error_code)>;
+    static constexpr unsigned ring_entries = 64;
+
+private:
+    restinio::asio_ns::io_context &m_io_context;
+
+    /* Thread pool fallback */
+    std::mutex m_mutex;
+    std::condition_variable_any m_cv;
+    std::deque<std::function<void()>> m_tasks;
+    std::vector<std::jthread> m_workers;
+
+    void post_completion(callback_t on_done, std::error_code ec) {
+        restinio::asio_ns::post(m_io_context, [on_done = std::move(on_done), ec] { on_done(ec); });
+    }
+
+    void run_in_pool(std::function<void()> task) {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_tasks.push_back(std::move(task));
+        }
+        m_cv.notify_one();
+    }
+
+    void work(std::stop_token stoken) {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(m_mutex);
+                if (!m_cv.wait(lock, stoken, [this] { return !m_tasks.empty(); }))
+                    return;
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::atomic<std::uint64_t> m_tmp_counter = 0;
+
+    /* Concurrent writes of the same file (identical uploads) must not share the temporary file */
+    std::string tmp_path(const std::string &dir, const std::string &file_name) {
+        return fmt::format("{}/.{}.{}.part", dir, file_name, m_tmp_counter++);
+    }
+
+    static std::error_code write_file_sync(const std::string &tmp_path, const std::string &dest_path, std::string_view contents) {
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return {errno, std::system_category()};
+        std::error_code ec;
+        for (std::size_t written = 0; written < contents.size() && !ec; ) {
+            auto n = ::write(fd, contents.data() + written, contents.size() - written);
+            if (n < 0) ec = {errno, std::system_category()};
+            else written += static_cast<std::size_t>(n);
+        }
+        if (::close(fd) != 0 && !ec) ec = {errno, std::system_category()};
+        if (!ec) std::filesystem::rename(tmp_path, dest_path, ec);
+        if (ec) ::unlink(tmp_path.c_str());
+        return ec;
+    }
+
+    static std::error_code write_at_sync(const std::string &path, std::size_t offset, std::string_view contents) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0) return {errno, std::system_category()};
+        std::error_code ec;
+        for (std::size_t written = 0; written < contents.size() && !ec; ) {
+            auto n = ::pwrite(fd, contents.data() + written, contents.size() - written, static_cast<off_t>(offset + written));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) ec = n < 0 ? std::error_code{errno, std::system_category()} : std::make_error_code(std::errc::io_error);
+            else written += static_cast<std::size_t>(n);
+        }
+        if (::close(fd) != 0 && !ec) ec = {errno, std::system_category()};
+        return ec;
+    }
+
+#ifdef RS_HAVE_LIBURING
+    struct Ring;
+
+    /* Unlinks of one remove() call, the last completion reports */
+    struct Batch {
+        std::mutex mutex; // aborted unlinks finish outside of the ring's completion handler
+        std::size_t remaining = 0;
+        std::error_code error;
+        callback_t on_done;
+    };
+
+    /* Operation in flight, steps are submitted one after another as the previous completes */
+    struct Op {
+        enum class Step { open, write, close, rename, cleanup, unlink };
+        Ring *ring;
+        Step step;
+        std::string path;       // tmp path when writing
+        std::string dest_path;  // rename target
+        std::string_view contents;
+        std::size_t offset = 0;
+        bool in_place = false;  // write_at: existing file, no tmp file and rename
+        std::size_t written = 0;
+        int fd = -1;
+        std::error_code error;
+        callback_t on_done;
+        std::shared_ptr<Batch> batch;
+    };
+
+    struct Ring {
+        io_uring ring;
+        int event_fd;
+        restinio::asio_ns::posix::stream_descriptor events;
+        std::uint64_t event_count = 0;
+        std::mutex sq_mutex; // completions submit follow-up steps from other threads
+
+        Ring(restinio::asio_ns::io_context &io_context, int fd) : event_fd(fd), events(io_context, fd) {}
+    };
+
+    bool m_uring_supported = false;
+    std::mutex m_rings_mutex;
+    std::vector<std::unique_ptr<Ring>> m_rings;
+
+    static bool probe_uring() {
+        io_uring ring;
+        if (io_uring_queue_init(2, &ring, 0) != 0) return false;
+        io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+        bool supported = probe != nullptr;
+        for (int op : {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_RENAMEAT, IORING_OP_UNLINKAT})
+            supported = supported && io_uring_opcode_supported(probe, op);
+        if (probe) io_uring_free_probe(probe);
+        io_uring_queue_exit(&ring);
+        return supported;
+    }
+
+    /* Ring of the calling thread, created on first use. nullptr if it can not be set up,
+     * completions would never be signalled without the eventfd, the thread uses the pool instead */
+    Ring* thread_ring() {
+        thread_local std::unordered_map<const FileIoService*, Ring*> rings;
+        if (auto it = rings.find(this); it != rings.end())
+            return it->second;
+
+        Ring *result = nullptr;
+        if (int fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK); fd >= 0) {
+            auto ring = std::make_unique<Ring>(m_io_context, fd); // closes fd
+            if (io_uring_queue_init(ring_entries, &ring->ring, 0) == 0) {
+                if (io_uring_register_eventfd(&ring->ring, fd) == 0) {
+                    wait_for_completions(*ring);
+                    std::scoped_lock lock(m_rings_mutex);
+                    m_rings.push_back(std::move(ring));
+                    result = m_rings.back().get();
+                } else {
+                    io_uring_queue_exit(&ring->ring);
+                }
+            }
+        }
+        rings.emplace(this, result);
+        return result;
+    }
+
+    /* Must be called with sq_mutex held, submission is left to the caller so steps are batched.
+     * Returns false if the submission queue stays full */
+    static bool prepare(Op *op) {
+        io_uring_sqe *sqe = io_uring_get_sqe(&op->ring->ring);
+        if (!sqe) /* full, flush and retry */ {
+            io_uring_submit(&op->ring->ring);
+            sqe = io_uring_get_sqe(&op->ring->ring);
+        }
+        if (!sqe) return false;
+        switch (op->step) {
+            case Op::Step::open:
+                io_uring_prep_openat(sqe, AT_FDCWD, op->path.c_str(),
+                                     op->in_place ? O_WRONLY | O_CLOEXEC : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                break;
+            case Op::Step::write:
+                io_uring_prep_write(sqe, op->fd, op->contents.data() + op->written,
+                                    static_cast<unsigned>(op->contents.size() - op->written), op->offset + op->written);
+                break;
+            case Op::Step::close:
+                io_uring_prep_close(sqe, op->fd);
+                break;
+            case Op::Step::rename:
+                io_uring_prep_renameat(sqe, AT_FDCWD, op->path.c_str(), AT_FDCWD, op->dest_path.c_str(), 0);
+                break;
+            case Op::Step::cleanup:
+            case Op::Step::unlink:
+                io_uring_prep_unlinkat(sqe, AT_FDCWD, op->path.c_str(), 0);
+                break;
+        }
+        io_uring_sqe_set_data(sqe, op);
+        return true;
+    }
+
+    void submit(Ring &ring, std::span<Op *> ops) {
+        std::vector<Op *> failed;
+        {
+            std::scoped_lock lock(ring.sq_mutex);
+            for (Op *op : ops)
+                if (!prepare(op)) failed.push_back(op);
+            io_uring_submit(&ring.ring);
+        }
+        for (Op *op : failed) abort(op, std::make_error_code(std::errc::resource_unavailable_try_again));
+    }
+
+    /* Finishes op whose next step could not be queued, leaving no open file or partial file behind */
+    void abort(Op *op, std::error_code ec) {
+        if (op->fd >= 0) ::close(op->fd);
+        if (!op->in_place && op->step != Op::Step::open && op->step != Op::Step::unlink) ::unlink(op->path.c_str());
+        if (!op->error) op->error = ec;
+        restinio::asio_ns::post(m_io_context, [op] { finish(op); });
+    }
+
+    /* Advances op after its step completed with res, returns false once op is finished */
+    static bool advance(Op *op, int res) {
+        const std::error_code ec = res < 0 ? std::error_code(-res, std::system_category()) : std::error_code{};
+        switch (op->step) {
+            case Op::Step::open:
+                if (ec) { op->error = ec; return false; }
+                op->fd = res;
+                op->step = op->contents.empty() ? Op::Step::close : Op::Step::write;
+                return true;
+            case Op::Step::write:
+                if (ec || res == 0) { op->error = ec ? ec : std::make_error_code(std::errc::io_error); op->step = Op::Step::close; return true; }
+                op->written += static_cast<std::size_t>(res);
+                if (op->written == op->contents.size()) op->step = Op::Step::close;
+                return true;
+            case Op::Step::close:
+                op->fd = -1;
+                if (!op->error && ec) op->error = ec;
+                if (op->in_place) return false;
+                op->step = op->error ? Op::Step::cleanup /* leave no partial file behind */ : Op::Step::rename;
+                return true;
+            case Op::Step::rename:
+                op->error = ec;
+                return false;
+            case Op::Step::cleanup:
+                return false;
+            case Op::Step::unlink:
+                if (ec != std::errc::no_such_file_or_directory) op->error = ec;
+                return false;
+        }
+        return false;
+    }
+
+    void wait_for_completions(Ring &ring) {
+        ring.events.async_read_some(restinio::asio_ns::buffer(&ring.event_count, sizeof(ring.event_count)),
+            [this, &ring](const restinio::asio_ns::error_code &ec, std::size_t) {
+                if (ec == restinio::asio_ns::error::operation_aborted) return;
+                std::vector<Op *> next;
+                io_uring_cqe *cqe;
+                while (io_uring_peek_cqe(&ring.ring, &cqe) == 0) {
+                    auto *op = static_cast<Op *>(io_uring_cqe_get_data(cqe));
+                    const int res = cqe->res;
+                    io_uring_cqe_seen(&ring.ring, cqe);
+                    if (advance(op, res)) {
+                        next.push_back(op);
+                    } else {
+                        finish(op);
+                    }
+                }
+                if (!next.empty()) submit(ring, next);
+                wait_for_completions(ring);
+        });
+    }
+
+    /* Runs on the io_context already, callback is invoked directly */
+    static void finish(Op *op) {
+        std::unique_ptr<Op> owned(op);
+        if (!op->batch) {
+            op->on_done(op->error);
+            return;
+        }
+        auto &batch = *op->batch;
+        std::unique_lock lock(batch.mutex);
+        if (op->error && !batch.error) batch.error = op->error;
+        if (--batch.remaining != 0) return;
+        lock.unlock();
+        batch.on_done(batch.error);
+    }
+#endif
+
+public:
+    explicit FileIoService(restinio::asio_ns::io_context &io_context, unsigned fallback_threads = 2)
+        : m_io_context(io_context) {
+#ifdef RS_HAVE_LIBURING
+        m_uring_supported = probe_uring();
+        if (m_uring_supported) fallback_threads = 1; // for threads whose ring could not be set up
+#endif
+        for (unsigned i = 0; i < fallback_threads; i++)
+            m_workers.emplace_back([this](std::stop_token stoken) { work(stoken); });
+    }
+
+    FileIoService(const FileIoService&) = delete;
+    FileIoService& operator=(const FileIoService&) = delete;
+
+    ~FileIoService() {
+        for (auto &worker : m_workers) worker.request_stop();
+        m_workers.clear();
+#ifdef RS_HAVE_LIBURING
+        for (auto &ring : m_rings) {
+            ring->events.close();
+            io_uring_queue_exit(&ring->ring);
+        }
+#endif
+    }
+
+    [[nodiscard]] const char * backend() const {
+#ifdef RS_HAVE_LIBURING
+        if (m_uring_supported) return "io_uring";
+#endif
+        return "thread pool";
+    }
+
+    /* Like store_file_to_disk contents go to a hidden .part file in dir which is renamed once written.
+     * contents must stay valid until on_done is called */
+    void write_file(const std::string &dir, const std::string &file_name, std::string_view contents, callback_t on_done) {
+        auto tmp = tmp_path(dir, file_name), dest = fmt::format("{}/{}", dir, file_name);
+#ifdef RS_HAVE_LIBURING
+        if (Ring *ring = m_uring_supported ? thread_ring() : nullptr) {
+            Op *op = new Op{.ring = ring, .step = Op::Step::open, .path = std::move(tmp), .dest_path = std::move(dest),
+                            .contents = contents, .on_done = std::move(on_done)};
+            submit(*ring, std::span<Op *>(&op, 1));
+            return;
+        }
+#endif
+        run_in_pool([this, tmp = std::move(tmp), dest = std::move(dest), contents, on_done = std::move(on_done)]() mutable {
+            post_completion(std::move(on_done), write_file_sync(tmp, dest, contents));
+        });
+    }
+
+    /* Writes contents into existing file at offset, in place. A failed write may leave part of contents
+     * behind, callers write it again at the same offset. contents must stay valid until on_done is called */
+    void write_at(const std::string &path, std::size_t offset, std::string_view contents, callback_t on_done) {
+#ifdef RS_HAVE_LIBURING
+        if (Ring *ring = m_uring_supported ? thread_ring() : nullptr) {
+            Op *op = new Op{.ring = ring, .step = Op::Step::open, .path = path, .contents = contents,
+                            .offset = offset, .in_place = true, .on_done = std::move(on_done)};
+            submit(*ring, std::span<Op *>(&op, 1));
+            return;
+        }
+#endif
+        run_in_pool([this, path, offset, contents, on_done = std::move(on_done)]() mutable {
+            post_completion(std::move(on_done), write_at_sync(path, offset, contents));
+        });
+    }
+
+    /* Removes files, missing ones are not an error. All unlinks are submitted in one batch */
+    void remove(std::vector<std::string> paths, callback_t on_done) {
+        if (paths.empty()) {
+            post_completion(std::move(on_done), {});
+            return;
+        }
+#ifdef RS_HAVE_LIBURING
+        if (Ring *ring = m_uring_supported ? thread_ring() : nullptr) {
+            auto batch = std::make_shared<Batch>();
+            batch->remaining = paths.size();
+            batch->on_done = std::move(on_done);
+            std::vector<Op *> ops;
+            for (auto &path : paths) {
+                ops.push_back(new Op{.ring = ring, .step = Op::Step::unlink, .path = std::move(path), .batch = batch});
+            }
+            submit(*ring, ops);
+            return;
+        }
+#endif
+        run_in_pool([this, paths = std::move(paths), on_done = std::move(on_done)]() mutable {
+            std::error_code result;
+            for (const auto &path : paths) {
+                std::error_code ec;
+                std::filesystem::remove(path, ec);
+                if (ec && !result) result = ec;
+            }
+            post_completion(std::move(on_done), result);
+        });
+    }
+};
+
+} // ns rs
+
+#endif // RS_FILE_IO_HPP
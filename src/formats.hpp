@@ -0,0 +1,178 @@
+#ifndef RS_FORMATS_HPP
+#define RS_FORMATS_HPP
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <nlohmann/json.hpp>
+#include <restinio/all.hpp>
+#include <restinio/helpers/multipart_body.hpp>
+#include <restinio/helpers/http_field_parsers/content-disposition.hpp>
+
+#include "utils.hpp"
+
+/* Body formats of api requests and responses: JSON, MessagePack and CBOR.
+ * Responses are negotiated by Accept, request bodies are read by their Content-Type. */
+namespace rs::formats {
+
+enum class Format { json, msgpack, cbor };
+
+constexpr const char * content_type(Format f, bool problem = false) {
+    switch (f) {
+        case Format::msgpack: return problem ? "application/problem+msgpack" : "application/msgpack";
+        case Format::cbor: return problem ? "application/problem+cbor" : "application/cbor";
+        default: return problem ? "application/problem+json" : "application/json";
+    }
+}
+
+constexpr const char * name(Format f) {
+    switch (f) {
+        case Format::msgpack: return "msgpack";
+        case Format::cbor: return "cbor";
+        default: return "json";
+    }
+}
+
+/* Format of a media type, nullopt if it is none of them */
+std::optional<Format> from_media_type(std::string_view media_type) {
+    if (iequals(media_type, "application/json") || iequals(media_type, "application/problem+json"))
+        return Format::json;
+    if (iequals(media_type, "application/msgpack") || iequals(media_type, "application/x-msgpack")
+            || iequals(media_type, "application/vnd.msgpack") || iequals(media_type, "application/problem+msgpack"))
+        return Format::msgpack;
+    if (iequals(media_type, "application/cbor") || iequals(media_type, "application/problem+cbor"))
+        return Format::cbor;
+    return std::nullopt;
+}
+
+/* Response format the client prefers, JSON unless a binary one is accepted with a higher q than it */
+Format negotiate(const restinio::request_handle_t &req) {
+    const auto accept = req->header().opt_value_of(restinio::http_field::accept);
+    if (!accept) return Format::json;
+    Format best = Format::json;
+    int best_q = 0;
+    for_each_weighted_item(*accept, [&](std::string_view media_type, int q) {
+        if (auto f = from_media_type(media_type); f && q > best_q) {
+            best = *f;
+            best_q = q;
+        }
+    });
+    return best;
+}
+
+/* Format of a body by its Content-Type header value, JSON when it is missing or another type */
+Format content_type_format(std::optional<std::string_view> header) {
+    if (!header) return Format::json;
+    auto media_type = header->substr(0, header->find(';'));
+    while (!media_type.empty() && media_type.back() == ' ') media_type.remove_suffix(1);
+    return from_media_type(media_type).value_or(Format::json);
+}
+
+/* Format of the request body by its Content-Type */
+Format request_format(const restinio::request_handle_t &req) {
+    return content_type_format(req->header().opt_value_of(restinio::http_field::content_type));
+}
+
+/* Throws nlohmann::json::parse_error on malformed body */
+nlohmann::json parse(std::string_view body, Format f) {
+    switch (f) {
+        case Format::msgpack: return nlohmann::json::from_msgpack(body);
+        case Format::cbor: return nlohmann::json::from_cbor(body);
+        default: return nlohmann::json::parse(body);
+    }
+}
+
+std::string serialize(const nlohmann::json &j, Format f) {
+    switch (f) {
+        case Format::msgpack: {
+            std::string out;
+            nlohmann::json::to_msgpack(j, nlohmann::detail::output_adapter<char>(out));
+            return out;
+        }
+        case Format::cbor: {
+            std::string out;
+            nlohmann::json::to_cbor(j, nlohmann::detail::output_adapter<char>(out));
+            return out;
+        }
+        default: return j.dump();
+    }
+}
+
+} // ns rs::formats
+
+/* Request bodies the api handler does not parse itself (batches, multipart forms) */
+namespace rs {
+
+/* File part of a multipart form, contents refer to the request body */
+struct MFile {
+    std::string file_name;
+    std::string file_extension;
+    std::string_view file_contents;
+};
+
+struct MultipartForm {
+    std::optional<nlohmann::json> json;
+    std::optional<MFile> file;
+};
+
+/* Single pass over multipart/form-data body, extracting "json" and "file" fields without copying the file.
+ * The json field may be MessagePack or CBOR as told by its own Content-Type */
+MultipartForm parse_multiform(const restinio::request_handle_t & req)
+{
+    using namespace restinio::multipart_body;
+    namespace hfp = restinio::http_field_parsers;
+    MultipartForm form;
+    enumerate_parts(
+        *req, [&](const parsed_part_t &part) {
+            const auto disposition = part.fields.opt_value_of(restinio::http_field::content_disposition);
+            if (!disposition) return handling_result_t::continue_enumeration;
+            const auto parsed = hfp::content_disposition_value_t::try_parse(*disposition);
+            if (!parsed || parsed->value != "form-data") return handling_result_t::continue_enumeration;
+
+            const auto name = hfp::find_first(parsed->parameters, "name");
+            if (!name) return handling_result_t::continue_enumeration;
+
+            if (*name == "json" && !form.json.has_value()) {
+                try {
+                    form.json = formats::parse(part.body, formats::content_type_format(part.fields.opt_value_of(restinio::http_field::content_type)));
+                } catch (const nlohmann::json::parse_error &perror) {
+                    throw rs::JsonParseError(perror.what());
+                }
+            } else if (*name == "file" && !form.file.has_value() && !part.body.empty()) {
+                if (const auto filename = hfp::find_first(parsed->parameters, "filename")) {
+                    form.file = MFile {
+                        .file_name = std::string{*filename},
+                        .file_extension = std::filesystem::path(*filename).extension(),
+                        .file_contents = part.body
+                    };
+                }
+            }
+
+            return form.json.has_value() && form.file.has_value()
+                   ? handling_result_t::stop_enumeration
+                   : handling_result_t::continue_enumeration;
+    });
+
+    throw_if<InvalidParamsError>(!form.json.has_value(), "json field is required");
+    throw_if<InvalidParamsError>(!form.file.has_value(), "File is required");
+    return form;
+}
+
+/* Parses request body in the format of its Content-Type, which must be an array with 1 to max_size elements */
+nlohmann::json parse_json_array_body(const restinio::request_handle_t & req, std::size_t max_size)
+{
+    nlohmann::json json;
+    try {
+        json = formats::parse(req->body(), formats::request_format(req));
+    } catch (const nlohmann::json::parse_error &perror) {
+        throw rs::JsonParseError(perror.what());
+    }
+    throw_if<InvalidParamsError>(!json.is_array() || json.empty(), "Body must be a non-empty array");
+    throw_if<InvalidParamsError>(json.size() > max_size, fmt::format("At most {} items are allowed per request", max_size));
+    return json;
+}
+} // ns rs
+
+#endif // RS_FORMATS_HPP
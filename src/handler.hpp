@@ -1,10 +1,16 @@
 #ifndef RS_HANDLER_HPP
 #define RS_HANDLER_HPP
 
+#include <functional>
 #include <jwt/jwt.hpp>
+#include "compression.hpp"
+#include "connections.hpp"
+#include "cors.hpp"
 #include "errors.hpp"
+#include "formats.hpp"
 #include "utils.hpp"
 #include "model/model.hpp"
+#include "model/binary.hpp"
 #include "models.hpp"
 
 #include <restinio/all.hpp>
@@ -34,7 +40,7 @@ static inline RequestParamsModel extract_request_params_model(const auto &req) {
                 if (src.empty()) {
                     return RequestParamsModel{};
                 } else {
-                    return RequestParamsModel(nlohmann::json::parse(src));
+                    return RequestParamsModel(formats::parse(src, formats::request_format(req)));
                 }
             } catch (const nlohmann::json::parse_error &perror) {
                 throw rs::JsonParseError(perror.what());
@@ -45,96 +51,219 @@ static inline RequestParamsModel extract_request_params_model(const auto &req) {
 
 namespace bearer_auth = restinio::http_field_parsers::bearer_auth;
 
+/* Bearer token of the Authorization header, empty without it */
+model::AuthToken request_auth_token(const restinio::request_handle_t &req) {
+    model::AuthToken auth_tok;
+    const auto auth_params = bearer_auth::try_extract_params(*req, restinio::http_field::authorization);
+    if (auth_params) auth_tok.auth_token.opt_value = auth_params->token;
+    return auth_tok;
+}
+
+/* Api response before it is sent, IdempotencyStore keeps it to be sent again.
+ * The body is serialized when sent, in the format negotiated with the request */
+struct ApiResponse {
+    restinio::http_status_line_t status;
+    nlohmann::json body;
+    bool problem = false; // problem details of an error
+    std::function<std::string(formats::Format)> encode {}; // serializes instead of body, see models_response
+    std::string etag {}; // strong ETag including quotes, see versions.hpp
+};
+
+/* Sends api responses of one request. Handlers responding asynchronously get it as argument,
+ * IdempotencyStore passes one which records the response before sending it */
+using reply_t = std::function<void(const ApiResponse&)>;
+
+/* Successful api response with json */
+ApiResponse json_response(const nlohmann::json &resp_json) {
+    return {restinio::status_ok(), resp_json};
+}
+
+/* Successful api response with a model or models, binary formats are encoded from them directly, see model::binary */
+template <typename T>
+ApiResponse encoded_response(T &&value, std::string etag = {}) {
+    auto shared = std::make_shared<const std::remove_cvref_t<T>>(std::forward<T>(value));
+    return {restinio::status_ok(), nullptr, false, [shared](formats::Format f) {
+        switch (f) {
+            case formats::Format::msgpack: return model::binary::encode<model::binary::MsgpackWriter>(*shared);
+            case formats::Format::cbor: return model::binary::encode<model::binary::CborWriter>(*shared);
+            default: return nlohmann::json(*shared).dump();
+        }
+    }, std::move(etag)};
+}
+
+template <model::CModel M>
+ApiResponse models_response(std::vector<M> &&models) {
+    return encoded_response(std::move(models));
+}
+
+/* Single row with its ETag, see actions::get_model_etag_from_db */
+template <model::CModel M>
+ApiResponse model_response(M &&m, std::string etag) {
+    return encoded_response(std::move(m), std::move(etag));
+}
+
+/* The client already has the representation with etag, nothing is serialized */
+ApiResponse not_modified_response(std::string etag) {
+    return {restinio::status_not_modified(), nullptr, false, {}, std::move(etag)};
+}
+
+/* Exception thrown by an api handler as problem+json */
+ApiResponse exception_response(std::exception_ptr eptr) {
+    try {
+        std::rethrow_exception(eptr);
+    } catch(const rs::Error &e) {
+        return {e.status(), e.json(), true};
+    } catch (const soci::soci_error &e) {
+        // TODO: Put this custom messages - It Yields Unknown DB error for Unique Constraint violation 
+        // constexpr auto msg_from_category = [](soci::soci_error::error_category category) {
+        //     switch (category) {
+        //         case soci::soci_error::connection_error:
+        //             return "Connection error";
+        //         case soci::soci_error::invalid_statement:
+        //             return "Invalid statement";
+        //         case soci::soci_error::no_privilege:
+        //             return "Invalid privilege";
+        //         case soci::soci_error::no_data:
+        //             return "No data";
+        //         case soci::soci_error::constraint_violation:
+        //             return "Constraint violation";
+        //         case soci::soci_error::unknown_transaction_state:
+        //             return "Unknown transaction state";
+        //         case soci::soci_error::system_error:
+        //             return "System Error";
+        //         default: /* soci::soci_error::unknown: */
+        //             return "Unknown DB error";
+        //     }
+        // };
+        // // Maybe log somewhere: e.get_error_message(); or e.what();
+        // const char * msg = msg_from_category(e.get_error_category());
+        return {restinio::status_internal_server_error(), rs::DBError(/*TODO:msg*/e.get_error_message()).json(), true};
+    } catch (const std::exception &e) {
+        return {restinio::status_internal_server_error(), rs::OtherError(e.what()).json(), true};
+    } catch (...) {
+        return {restinio::status_internal_server_error(), rs::OtherError().json(), true};
+    }
+}
+
+/* Strong ETags must differ between representations, so the negotiated format and content coding are
+ * appended to the row version tag (see version_etag), etag_version ignores them */
+std::string representation_etag(const restinio::request_handle_t &req, std::string_view etag) {
+    if (etag.size() < 2 || etag.back() != '"') return std::string{etag};
+    return fmt::format("{}-{}-{}\"", etag.substr(0, etag.size() - 1), formats::name(formats::negotiate(req)),
+                       compression::encoding_name(compression::negotiate(req)));
+}
+
+/* Response builder with body serialized as negotiated by Accept and compressed as negotiated
+ * by Accept-Encoding when it is large enough. A replayed resp is negotiated again, 304 has no body */
+auto make_api_response(const restinio::request_handle_t &req, const ApiResponse &resp,
+                       const compression::Options &compression = {}) {
+    auto builder = req->create_response(resp.status);
+    builder.append_header(restinio::http_field::vary, "Accept");
+    if (!resp.etag.empty())
+        builder.append_header(restinio::http_field::etag, representation_etag(req, resp.etag))
+               .append_header(restinio::http_field::cache_control, "no-cache");
+    rs::cors().apply(req, builder);
+    rs::connections().apply(req, builder, resp.status);
+    if (resp.status.status_code() == restinio::status_code::not_modified)
+        return builder;
+
+    const auto format = formats::negotiate(req);
+    auto body = resp.encode ? resp.encode(format) : formats::serialize(resp.body, format);
+    builder.append_header(restinio::http_field::content_type, formats::content_type(format, resp.problem));
+    if (body.size() < compression.min_size) {
+        builder.set_body(std::move(body));
+        return builder;
+    }
+
+    builder.append_header(restinio::http_field::vary, "Accept-Encoding");
+    const auto encoding = compression::negotiate(req);
+    std::optional<std::string> compressed;
+    if (encoding != compression::Encoding::identity)
+        compressed = compression::compress(body, encoding, compression.level);
+    if (compressed && compressed->size() < body.size()) {
+        builder.append_header(restinio::http_field::content_encoding, compression::encoding_name(encoding));
+        builder.set_body(std::move(*compressed));
+    } else {
+        builder.set_body(std::move(body));
+    }
+    return builder;
+}
+
+restinio::request_handling_status_t send_api_response(const restinio::request_handle_t &req, const ApiResponse &resp,
+                                                      const compression::Options &compression = {}) {
+    return make_api_response(req, resp, compression).done();
+}
+
+/* Sends json as successful api response */
+restinio::request_handling_status_t respond_with_json(const restinio::request_handle_t &req, const nlohmann::json &resp_json) {
+    return send_api_response(req, json_response(resp_json));
+}
+
+/* Sends exception thrown by an api handler as problem+json */
+restinio::request_handling_status_t respond_with_exception(const restinio::request_handle_t &req, std::exception_ptr eptr) {
+    return send_api_response(req, exception_response(eptr));
+}
+
+template <typename T> constexpr bool is_model_vector_v = false;
+template <model::CModel M> constexpr bool is_model_vector_v<std::vector<M>> = true;
+
+/* Wraps api handler func(params model, auth token, route params...) which returns json response,
+ * a vector of models encoded directly in binary formats or an ApiResponse.
+ * Handlers reading request headers take the request after the auth token, func(params model, auth token, request, route params...).
+ * Handlers responding asynchronously take reply after the auth token, func(params model, auth token, reply, route params...),
+ * return nothing and call reply exactly once, with json_response or exception_response */
 template <class Func, model::CModel RequestParamsModel>
 class Handler {
     Func m_handler;
+    compression::Options m_compression;
 public:
     using request_params_model_t = RequestParamsModel;
 
-    explicit Handler(Func &&func) : m_handler(std::move(func)) { }
+    explicit Handler(Func &&func, compression::Options compression = {}) : m_handler(std::move(func)), m_compression(compression) { }
     ~Handler() = default;
 
-        template <typename... RouteParams>
-        restinio::request_handling_status_t operator()(const restinio::request_handle_t &req, RouteParams&& ...routeparams) const {
+    template <typename... RouteParams>
+    void handle(const reply_t &reply, const restinio::request_handle_t &req, RouteParams&& ...routeparams) const {
         try {
-            nlohmann::json resp_json;
             nlohmann::json json_req = rs::extract_request_params_model<RequestParamsModel>(req);
             RequestParamsModel pars(std::move(json_req));
 
-            // Extract auth params:
-            model::AuthToken auth_tok;
-            const auto auth_params = bearer_auth::try_extract_params(*req, restinio::http_field::authorization); 
-            if (auth_params) auth_tok.auth_token.opt_value = auth_params->token;
-            resp_json = m_handler(std::move(pars), std::move(auth_tok), std::forward<RouteParams>(routeparams)...);
-
-        return req->create_response(restinio::status_ok())
-                   .append_header(restinio::http_field::content_type, "application/json")
-                   .append_header(restinio::http_field::access_control_allow_origin, "*")
-                   .append_header(restinio::http_field::access_control_allow_credentials, "true")
-                   .set_body(resp_json.dump())
-                   .done();
-
-        } catch(const rs::Error &e) {
-             return req->create_response(e.status())
-                        .append_header(restinio::http_field::content_type, "application/problem+json")
-                        .append_header(restinio::http_field::access_control_allow_origin, "*")
-                        .append_header(restinio::http_field::access_control_allow_credentials, "true")
-                        .set_body(e.json().dump())
-                        .done();
-        } catch (const soci::soci_error &e) {
-            // TODO: Put this custom messages - It Yields Unknown DB error for Unique Constraint violation 
-            // constexpr auto msg_from_category = [](soci::soci_error::error_category category) {
-            //     switch (category) {
-            //         case soci::soci_error::connection_error:
-            //             return "Connection error";
-            //         case soci::soci_error::invalid_statement:
-            //             return "Invalid statement";
-            //         case soci::soci_error::no_privilege:
-            //             return "Invalid privilege";
-            //         case soci::soci_error::no_data:
-            //             return "No data";
-            //         case soci::soci_error::constraint_violation:
-            //             return "Constraint violation";
-            //         case soci::soci_error::unknown_transaction_state:
-            //             return "Unknown transaction state";
-            //         case soci::soci_error::system_error:
-            //             return "System Error";
-            //         default: /* soci::soci_error::unknown: */
-            //             return "Unknown DB error";
-            //     }
-            // };
-            // // Maybe log somewhere: e.get_error_message(); or e.what();
-            // const char * msg = msg_from_category(e.get_error_category());
-             return req->create_response(restinio::status_internal_server_error())
-                    .append_header(restinio::http_field::access_control_allow_origin, "*")
-                    .append_header(restinio::http_field::access_control_allow_credentials, "true")
-                    .append_header(restinio::http_field::content_type, "application/problem+json")
-                    .set_body(rs::DBError(/*TODO:msg*/e.get_error_message()).json().dump())
-                    .done();
-        } catch (const std::exception &e) {
-             return req->create_response(restinio::status_internal_server_error())
-                        .append_header(restinio::http_field::content_type, "application/problem+json")
-                        .append_header(restinio::http_field::access_control_allow_origin, "*")
-                        .append_header(restinio::http_field::access_control_allow_credentials, "true")
-                        .set_body(rs::OtherError(e.what()).json().dump())
-                        .done();
+            model::AuthToken auth_tok = request_auth_token(req);
+
+            auto respond = [&](auto &&result) {
+                if constexpr (std::is_same_v<std::remove_cvref_t<decltype(result)>, ApiResponse>)
+                    reply(result);
+                else if constexpr (is_model_vector_v<std::remove_cvref_t<decltype(result)>>)
+                    reply(models_response(std::move(result)));
+                else
+                    reply(json_response(result));
+            };
+            if constexpr (std::is_invocable_v<const Func&, RequestParamsModel&&, model::AuthToken&&, const reply_t&, RouteParams&&...>) {
+                m_handler(std::move(pars), std::move(auth_tok), reply, std::forward<RouteParams>(routeparams)...);
+            } else if constexpr (std::is_invocable_v<const Func&, RequestParamsModel&&, model::AuthToken&&, const restinio::request_handle_t&, RouteParams&&...>) {
+                respond(m_handler(std::move(pars), std::move(auth_tok), req, std::forward<RouteParams>(routeparams)...));
+            } else {
+                respond(m_handler(std::move(pars), std::move(auth_tok), std::forward<RouteParams>(routeparams)...));
+            }
         } catch (...) {
-            return req->create_response(restinio::status_internal_server_error())
-                    .append_header(restinio::http_field::content_type, "application/problem+json")
-                    .append_header(restinio::http_field::access_control_allow_origin, "*")
-                    .append_header(restinio::http_field::access_control_allow_credentials, "true")
-                    .set_body(rs::OtherError().json().dump())
-                    .done();
-       }
+            reply(exception_response(std::current_exception()));
+        }
+    }
+
+    template <typename... RouteParams>
+    restinio::request_handling_status_t operator()(const restinio::request_handle_t &req, RouteParams&& ...routeparams) const {
+        this->handle([req, compression = m_compression](const ApiResponse &resp) { send_api_response(req, resp, compression); },
+                     req, std::forward<RouteParams>(routeparams)...);
+        return restinio::request_accepted();
     }
 };
 
 template <class Func>
-auto make_api_handler(Func &&f)
+auto make_api_handler(Func &&f, compression::Options compression = {})
 {
     using traits = rs::function_traits<Func>;
     using arg_type = typename traits:: template arg<0>::type;
-    return Handler<Func, std::remove_cvref_t<arg_type>>(std::forward<Func>(f));
+    return Handler<Func, std::remove_cvref_t<arg_type>>(std::forward<Func>(f), compression);
 }
 
 } // ns rs
@@ -0,0 +1,99 @@
+#ifndef RS_ID_GENERATOR_HPP
+#define RS_ID_GENERATOR_HPP
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+#include <fmt/format.h>
+
+#include "errors.hpp"
+#include "utils.hpp"
+
+namespace rs {
+
+/* Unique, roughly time ordered 63 bit ids (positive in a signed 64 bit column):
+ *   41 bits milliseconds since epoch | 8 bits node id | 6 bits thread slot | 8 bits sequence
+ * Every thread generating ids claims one of 64 slots on its first id and counts in its own sequence,
+ * so next() touches no shared state after that. A thread generating more than 256 ids within a millisecond
+ * continues in the next one, a clock going backwards is waited out the same way. Servers sharing
+ * a database must use different node ids. */
+class IdGenerator {
+public:
+    static constexpr unsigned sequence_bits = 8;
+    static constexpr unsigned slot_bits = 6;
+    static constexpr unsigned node_bits = 8;
+    static constexpr std::uint32_t max_node_id = (1u << node_bits) - 1;
+    static constexpr std::size_t max_threads = 1u << slot_bits;
+    static constexpr std::chrono::sys_days epoch = std::chrono::year{2024} / 1 / 1;
+
+private:
+    static constexpr std::uint32_t max_sequence = (1u << sequence_bits) - 1;
+
+    /* Free slots as bits, and the last millisecond used in every slot so a thread
+     * reusing the slot of a finished one can not repeat its ids */
+    static inline std::atomic<std::uint64_t> s_free_slots {~std::uint64_t{0}};
+    static inline std::array<std::atomic<std::uint64_t>, max_threads> s_slot_last_ms {};
+
+    struct ThreadState {
+        unsigned slot;
+        std::uint64_t last_ms;
+        std::uint32_t sequence = max_sequence; // first id of a reused slot starts after its last millisecond
+
+        ThreadState() : slot(claim_slot()), last_ms(s_slot_last_ms[slot].load(std::memory_order_acquire)) {}
+        ~ThreadState() {
+            s_slot_last_ms[slot].store(last_ms, std::memory_order_release);
+            s_free_slots.fetch_or(std::uint64_t{1} << slot, std::memory_order_release);
+        }
+        ThreadState(const ThreadState&) = delete;
+        ThreadState &operator=(const ThreadState&) = delete;
+    };
+
+    std::uint64_t m_node_id;
+
+    static unsigned claim_slot() {
+        auto free = s_free_slots.load(std::memory_order_acquire);
+        while (true) {
+            throw_if<OtherError>(free == 0, fmt::format("More than {} threads generate ids", max_threads));
+            const auto slot = static_cast<unsigned>(std::countr_zero(free));
+            if (s_free_slots.compare_exchange_weak(free, free & ~(std::uint64_t{1} << slot), std::memory_order_acquire))
+                return slot;
+        }
+    }
+
+    static ThreadState &thread_state() {
+        thread_local ThreadState state;
+        return state;
+    }
+
+    static std::uint64_t now_ms() {
+        const auto since_epoch = std::chrono::system_clock::now() - std::chrono::sys_time<std::chrono::milliseconds>(epoch);
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count());
+    }
+
+public:
+    explicit IdGenerator(std::uint32_t node_id = 0) : m_node_id(node_id) {
+        throw_if<InvalidParamsError>(node_id > max_node_id, fmt::format("Node id must be at most {}", max_node_id));
+    }
+
+    [[nodiscard]] std::uint64_t next() const {
+        auto &s = thread_state();
+        if (const auto now = now_ms(); now > s.last_ms) {
+            s.last_ms = now;
+            s.sequence = 0;
+        } else if (++s.sequence > max_sequence) {
+            s.last_ms++;
+            s.sequence = 0;
+        }
+        return s.last_ms << (node_bits + slot_bits + sequence_bits)
+             | m_node_id << (slot_bits + sequence_bits)
+             | std::uint64_t{s.slot} << sequence_bits
+             | s.sequence;
+    }
+};
+
+} // ns rs
+
+#endif // RS_ID_GENERATOR_HPP
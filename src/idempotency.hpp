@@ -0,0 +1,129 @@
+#ifndef RS_IDEMPOTENCY_HPP
+#define RS_IDEMPOTENCY_HPP
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/format.h>
+#include <restinio/all.hpp>
+
+#include "errors.hpp"
+#include "handler.hpp"
+
+namespace rs {
+
+/* Responses of POST requests sent with an Idempotency-Key header. A retry with the same key gets
+ * the original response replayed instead of running the handler again, a retry arriving while the
+ * first request is still being handled waits for its response. Keys are scoped by route, request path
+ * and Authorization header, so a key sent to /uploads/a/finish is not replayed for /uploads/b/finish.
+ * Server errors are not kept so they can be retried, completed keys are forgotten after ttl or when
+ * more than capacity of them are kept, oldest first. */
+class IdempotencyStore {
+public:
+    static constexpr std::size_t max_key_length = 255;
+
+private:
+    using clock_t = std::chrono::steady_clock;
+
+    struct Entry {
+        std::size_t fingerprint;
+        std::optional<ApiResponse> response;            // nullopt while in flight
+        std::vector<restinio::request_handle_t> waiting;  // retries of the in-flight request
+        clock_t::time_point completed_at;
+    };
+
+    std::size_t m_capacity;
+    std::chrono::seconds m_ttl;
+    std::mutex m_mutex;
+    std::unordered_map<std::string, Entry> m_entries;
+    std::deque<std::pair<std::string, clock_t::time_point>> m_completed; // in completion order
+
+    static restinio::request_handling_status_t replay(const restinio::request_handle_t &req, const ApiResponse &resp) {
+        return make_api_response(req, resp).append_header("Idempotent-Replayed", "true").done();
+    }
+
+    /* Forgets expired and excess completed keys, must be called with m_mutex held */
+    void evict() {
+        const auto deadline = clock_t::now() - m_ttl;
+        while (!m_completed.empty() && (m_completed.size() > m_capacity || m_completed.front().second < deadline)) {
+            auto &[key, completed_at] = m_completed.front();
+            /* the key may have been forgotten and completed again since */
+            if (auto it = m_entries.find(key); it != m_entries.end() && it->second.response && it->second.completed_at == completed_at)
+                m_entries.erase(it);
+            m_completed.pop_front();
+        }
+    }
+
+    void complete(const restinio::request_handle_t &req, const std::string &key, const ApiResponse &resp) {
+        std::vector<restinio::request_handle_t> waiting;
+        {
+            std::lock_guard lock(m_mutex);
+            auto it = m_entries.find(key);
+            if (it != m_entries.end()) {
+                waiting = std::move(it->second.waiting);
+                if (resp.status.status_code().raw_code() >= 500) {
+                    m_entries.erase(it);
+                } else {
+                    it->second.response = resp;
+                    it->second.completed_at = clock_t::now();
+                    m_completed.emplace_back(key, it->second.completed_at);
+                    evict();
+                }
+            }
+        }
+        send_api_response(req, resp);
+        for (const auto &w : waiting)
+            replay(w, resp);
+    }
+
+public:
+    explicit IdempotencyStore(std::size_t capacity = 10000, std::chrono::seconds ttl = std::chrono::hours(24))
+        : m_capacity(capacity), m_ttl(ttl) {}
+
+    IdempotencyStore(const IdempotencyStore&) = delete;
+    IdempotencyStore &operator=(const IdempotencyStore&) = delete;
+
+    /* Calls handler(reply) unless the request is a retry, handler must call reply exactly once */
+    restinio::request_handling_status_t run(const restinio::request_handle_t &req, std::string_view scope,
+                                            const std::function<void(const reply_t&)> &handler)
+    {
+        const auto header = req->header().opt_value_of("Idempotency-Key");
+        if (!header) {
+            handler([req](const ApiResponse &resp) { send_api_response(req, resp); });
+            return restinio::request_accepted();
+        }
+        if (header->empty() || header->size() > max_key_length)
+            return send_api_response(req, exception_response(std::make_exception_ptr(
+                    InvalidParamsError(fmt::format("Idempotency-Key must be 1 to {} characters long", max_key_length)))));
+
+        const auto auth = req->header().opt_value_of(restinio::http_field::authorization);
+        auto key = fmt::format("{}\n{}\n{}\n{}", scope, req->header().path(), auth.value_or(""), *header);
+        const auto fingerprint = std::hash<std::string_view>{}(req->body());
+        {
+            std::lock_guard lock(m_mutex);
+            evict();
+            auto [it, inserted] = m_entries.try_emplace(key, Entry{.fingerprint = fingerprint});
+            if (!inserted) {
+                if (it->second.fingerprint != fingerprint)
+                    return send_api_response(req, exception_response(std::make_exception_ptr(
+                            ConflictError("Idempotency-Key was already used for a different request"))));
+                if (it->second.response)
+                    return replay(req, *it->second.response);
+                it->second.waiting.push_back(req);
+                return restinio::request_accepted();
+            }
+        }
+        handler([this, req, key = std::move(key)](const ApiResponse &resp) { complete(req, key, resp); });
+        return restinio::request_accepted();
+    }
+};
+
+} // ns rs
+
+#endif // RS_IDEMPOTENCY_HPP
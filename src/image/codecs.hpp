@@ -0,0 +1,434 @@
+#ifndef RS_IMAGE_CODECS_HPP
+#define RS_IMAGE_CODECS_HPP
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+
+#include <jpeglib.h>
+#include <png.h>
+#ifdef RS_HAVE_WEBP
+#include <webp/encode.h>
+#endif
+
+#include "image/image.hpp"
+
+namespace rs::image {
+
+enum class Format { jpeg, png, gif, bmp, webp, unknown };
+
+/* Detected from file contents, the extension is chosen by the client and can not be trusted */
+Format sniff_format(std::span<const std::uint8_t> head) {
+    auto starts_with = [&](std::initializer_list<std::uint8_t> magic) {
+        return head.size() >= magic.size() && std::equal(magic.begin(), magic.end(), head.begin());
+    };
+    if (starts_with({0xFF, 0xD8, 0xFF})) return Format::jpeg;
+    if (starts_with({0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'})) return Format::png;
+    if (starts_with({'G', 'I', 'F', '8'})) return Format::gif;
+    if (starts_with({'B', 'M'})) return Format::bmp;
+    if (head.size() >= 12 && starts_with({'R', 'I', 'F', 'F'}) && std::equal(head.begin() + 8, head.begin() + 12, "WEBP"))
+        return Format::webp;
+    return Format::unknown;
+}
+
+/* Images above this are rejected before decoding (decompression bombs) */
+constexpr std::uint64_t max_pixels = 100'000'000;
+
+constexpr bool valid_size(std::uint64_t width, std::uint64_t height) {
+    return width > 0 && height > 0 && width * height <= max_pixels;
+}
+
+using file_ptr = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
+
+std::optional<std::vector<std::uint8_t>> read_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) return std::nullopt;
+    std::vector<std::uint8_t> data(static_cast<std::size_t>(in.tellg()));
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(data.size())))
+        return std::nullopt;
+    return data;
+}
+
+/* JPEG (libjpeg) */
+
+struct JpegErrorManager {
+    jpeg_error_mgr pub;
+    std::jmp_buf jump;
+};
+
+[[noreturn]] void jpeg_error_exit(j_common_ptr cinfo) {
+    std::longjmp(reinterpret_cast<JpegErrorManager*>(cinfo->err)->jump, 1);
+}
+
+void jpeg_silence(j_common_ptr) {}
+
+/* libjpeg converts only grayscale and YCbCr to RGB, CMYK and YCCK (Adobe) JPEGs are left to convert.
+ * A header libjpeg can not read counts as decodable, so the image fails instead of going to convert */
+bool jpeg_rgb_decodable(std::span<const std::uint8_t> data) {
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.pub.output_message = jpeg_silence;
+
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return true;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data.data(), data.size());
+    jpeg_read_header(&cinfo, TRUE);
+    const bool rgb = cinfo.jpeg_color_space != JCS_CMYK && cinfo.jpeg_color_space != JCS_YCCK;
+    jpeg_destroy_decompress(&cinfo);
+    return rgb;
+}
+
+/* Decodes with DCT domain downscaling (1/2, 1/4, 1/8) as long as the result is not smaller than hint */
+std::optional<Image> decode_jpeg(std::span<const std::uint8_t> data, Size hint) {
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.pub.output_message = jpeg_silence;
+    Image image;
+
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return std::nullopt;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data.data(), data.size());
+    jpeg_read_header(&cinfo, TRUE);
+    if (!valid_size(cinfo.image_width, cinfo.image_height)) {
+        jpeg_destroy_decompress(&cinfo);
+        return std::nullopt;
+    }
+
+    const Size target = fit_within({cinfo.image_width, cinfo.image_height}, hint);
+    unsigned denom = 8;
+    while (denom > 1 && (cinfo.image_width / denom < target.width || cinfo.image_height / denom < target.height))
+        denom /= 2;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.dct_method = JDCT_ISLOW;
+
+    jpeg_start_decompress(&cinfo);
+    image = Image({cinfo.output_width, cinfo.output_height});
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = image.row(cinfo.output_scanline);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return image;
+}
+
+bool encode_jpeg(const Image &image, std::FILE * out, int quality) {
+    jpeg_compress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.pub.output_message = jpeg_silence;
+
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, out);
+    cinfo.image_width = image.size.width;
+    cinfo.image_height = image.size.height;
+    cinfo.input_components = Image::channels;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.optimize_coding = TRUE;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = const_cast<JSAMPROW>(image.row(cinfo.next_scanline));
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return true;
+}
+
+/* WebP (libwebp), only available when built with it */
+#ifdef RS_HAVE_WEBP
+bool encode_webp(const Image &image, std::FILE * out, int quality) {
+    std::uint8_t * data = nullptr;
+    const std::size_t size = WebPEncodeRGB(image.pixels.data(), static_cast<int>(image.size.width), static_cast<int>(image.size.height),
+                                           static_cast<int>(image.row_len()), static_cast<float>(quality), &data);
+    const bool written = size > 0 && std::fwrite(data, 1, size, out) == size;
+    WebPFree(data);
+    return written;
+}
+#endif
+
+constexpr bool can_encode(Format format) {
+#ifdef RS_HAVE_WEBP
+    if (format == Format::webp) return true;
+#endif
+    return format == Format::jpeg;
+}
+
+bool encode(const Image &image, std::FILE * out, Format format, int quality) {
+#ifdef RS_HAVE_WEBP
+    if (format == Format::webp) return encode_webp(image, out, quality);
+#endif
+    return format == Format::jpeg && encode_jpeg(image, out, quality);
+}
+
+/* PNG (libpng simplified API), transparency is composed onto white like ImageMagick does for JPEG output */
+std::optional<Image> decode_png(std::span<const std::uint8_t> data) {
+    png_image png;
+    std::memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&png, data.data(), data.size()))
+        return std::nullopt;
+    if (!valid_size(png.width, png.height)) {
+        png_image_free(&png);
+        return std::nullopt;
+    }
+
+    png.format = PNG_FORMAT_RGB;
+    Image image({png.width, png.height});
+    const png_color white {255, 255, 255};
+    if (!png_image_finish_read(&png, &white, image.pixels.data(), 0, nullptr)) {
+        png_image_free(&png);
+        return std::nullopt;
+    }
+    return image;
+}
+
+/* GIF, first frame only */
+
+/* Variable length LZW as used by GIF, stops after expected pixels or end of information code */
+std::vector<std::uint8_t> lzw_decode(std::span<const std::uint8_t> data, unsigned min_code_size, std::size_t expected) {
+    constexpr unsigned max_codes = 4096;
+    std::vector<std::uint8_t> out; out.reserve(expected);
+    if (min_code_size < 2 || min_code_size > 8) return out;
+
+    std::array<std::uint16_t, max_codes> prefix;
+    std::array<std::uint8_t, max_codes> suffix;
+    std::array<std::uint8_t, max_codes> stack;
+    const unsigned clear = 1u << min_code_size, eoi = clear + 1;
+    for (unsigned i = 0; i < clear; i++) suffix[i] = static_cast<std::uint8_t>(i);
+
+    unsigned code_size = min_code_size + 1, next = eoi + 1;
+    int prev = -1;
+    std::uint8_t first = 0;
+    std::uint32_t bits = 0; unsigned nbits = 0;
+    std::size_t pos = 0;
+
+    while (out.size() < expected) {
+        while (nbits < code_size && pos < data.size()) {
+            bits |= std::uint32_t(data[pos++]) << nbits;
+            nbits += 8;
+        }
+        if (nbits < code_size) break;
+        unsigned code = bits & ((1u << code_size) - 1);
+        bits >>= code_size; nbits -= code_size;
+
+        if (code == clear) {
+            code_size = min_code_size + 1; next = eoi + 1; prev = -1;
+            continue;
+        }
+        if (code == eoi) break;
+        if (prev == -1) {
+            if (code >= clear) break;
+            out.push_back(first = suffix[code]);
+            prev = static_cast<int>(code);
+            continue;
+        }
+
+        const unsigned in_code = code;
+        unsigned sp = 0;
+        if (code >= next) {
+            if (code > next) break; // corrupt stream
+            stack[sp++] = first;
+            code = static_cast<unsigned>(prev);
+        }
+        while (code >= clear) {
+            stack[sp++] = suffix[code];
+            code = prefix[code];
+        }
+        stack[sp++] = first = suffix[code];
+        while (sp > 0) out.push_back(stack[--sp]);
+
+        if (next < max_codes) {
+            prefix[next] = static_cast<std::uint16_t>(prev);
+            suffix[next] = first;
+            if (++next == (1u << code_size) && code_size < 12) code_size++;
+        }
+        prev = static_cast<int>(in_code);
+    }
+    out.resize(expected, 0);
+    return out;
+}
+
+std::optional<Image> decode_gif(std::span<const std::uint8_t> data) {
+    std::size_t pos = 6;
+    auto need = [&](std::size_t n) { return pos + n <= data.size(); };
+    auto u16 = [&](std::size_t at) { return std::uint16_t(data[at] | (data[at + 1] << 8)); };
+    auto read_table = [&](unsigned flags, std::span<const std::uint8_t> &table) {
+        if (!(flags & 0x80)) return true;
+        const std::size_t len = 3u * (1u << ((flags & 0x07) + 1));
+        if (!need(len)) return false;
+        table = data.subspan(pos, len);
+        pos += len;
+        return true;
+    };
+    auto skip_sub_blocks = [&]() {
+        while (need(1) && data[pos] != 0) pos += data[pos] + 1;
+        pos++;
+    };
+
+    if (!need(7)) return std::nullopt;
+    const Size canvas {u16(6), u16(8)};
+    const unsigned screen_flags = data[10];
+    pos = 13;
+    std::span<const std::uint8_t> global_table;
+    if (!valid_size(canvas.width, canvas.height) || !read_table(screen_flags, global_table))
+        return std::nullopt;
+
+    int transparent = -1;
+    while (need(1)) {
+        const std::uint8_t block = data[pos++];
+        if (block == 0x21) /* extension */ {
+            if (!need(1)) return std::nullopt;
+            const std::uint8_t label = data[pos++];
+            if (label == 0xF9 && need(5) && data[pos] == 4 && (data[pos + 1] & 0x01))
+                transparent = data[pos + 4];
+            skip_sub_blocks();
+        } else if (block == 0x2C) /* image descriptor */ {
+            if (!need(9)) return std::nullopt;
+            const std::uint32_t left = u16(pos), top = u16(pos + 2), width = u16(pos + 4), height = u16(pos + 6);
+            const unsigned flags = data[pos + 8];
+            pos += 9;
+            /* the frame must lie within the canvas, its size is what the indices are allocated for */
+            if (!valid_size(width, height) || left + width > canvas.width || top + height > canvas.height)
+                return std::nullopt;
+            std::span<const std::uint8_t> table = global_table;
+            if (!read_table(flags, table) || table.empty() || !need(1)) return std::nullopt;
+
+            const unsigned min_code_size = data[pos++];
+            std::vector<std::uint8_t> lzw;
+            while (need(1) && data[pos] != 0) {
+                const std::size_t len = data[pos++];
+                if (!need(len)) return std::nullopt;
+                lzw.insert(lzw.end(), data.begin() + pos, data.begin() + pos + len);
+                pos += len;
+            }
+            const auto indices = lzw_decode(lzw, min_code_size, std::size_t(width) * height);
+
+            Image image(canvas);
+            std::fill(image.pixels.begin(), image.pixels.end(), 255);
+            const bool interlaced = flags & 0x40;
+            std::uint32_t src_row = 0;
+            for (auto [start, step] : interlaced ? std::vector<std::pair<unsigned,unsigned>>{{0,8},{4,8},{2,4},{1,2}}
+                                                 : std::vector<std::pair<unsigned,unsigned>>{{0,1}}) {
+                for (std::uint32_t y = start; y < height; y += step, src_row++) {
+                    for (std::uint32_t x = 0; x < width; x++) {
+                        const unsigned index = indices[std::size_t(src_row) * width + x];
+                        if (static_cast<int>(index) == transparent || index * 3 + 2 >= table.size()) continue;
+                        std::memcpy(image.row(top + y) + (left + x) * Image::channels, &table[index * 3], 3);
+                    }
+                }
+            }
+            return image;
+        } else {
+            break; // trailer or garbage
+        }
+    }
+    return std::nullopt;
+}
+
+/* BMP, uncompressed 1, 4, 8, 24 and 32 bits per pixel. Others (RLE, bitfields) yield nullopt */
+std::optional<Image> decode_bmp(std::span<const std::uint8_t> data) {
+    auto u16 = [&](std::size_t at) { return std::uint32_t(data[at] | (data[at + 1] << 8)); };
+    auto u32 = [&](std::size_t at) { return u16(at) | (u16(at + 2) << 16); };
+    if (data.size() < 54) return std::nullopt;
+
+    const std::uint32_t offset = u32(10), dib_size = u32(14);
+    const auto width = static_cast<std::int32_t>(u32(18)), height = static_cast<std::int32_t>(u32(22));
+    const std::uint32_t bpp = u16(28), compression = u32(30);
+    if (dib_size < 40 || compression != 0 || width <= 0 || height == 0) return std::nullopt;
+    if (bpp != 1 && bpp != 4 && bpp != 8 && bpp != 24 && bpp != 32) return std::nullopt;
+
+    const bool top_down = height < 0;
+    const Size size {static_cast<std::uint32_t>(width), static_cast<std::uint32_t>(top_down ? -std::int64_t(height) : height)};
+    const std::size_t stride = (std::size_t(bpp) * size.width + 31) / 32 * 4;
+    if (!valid_size(size.width, size.height) || offset + stride * size.height > data.size()) return std::nullopt;
+
+    std::span<const std::uint8_t> palette;
+    if (bpp <= 8) {
+        const std::size_t colors = u32(46) ? u32(46) : (1u << bpp);
+        const std::size_t palette_pos = 14 + dib_size;
+        if (colors > 256 || palette_pos + colors * 4 > offset) return std::nullopt;
+        palette = data.subspan(palette_pos, colors * 4);
+    }
+
+    Image image(size);
+    for (std::uint32_t y = 0; y < size.height; y++) {
+        const std::uint8_t * in = data.data() + offset + stride * (top_down ? y : size.height - 1 - y);
+        std::uint8_t * out = image.row(y);
+        for (std::uint32_t x = 0; x < size.width; x++, out += Image::channels) {
+            const std::uint8_t * bgr;
+            if (bpp >= 24) {
+                bgr = in + x * (bpp / 8);
+            } else {
+                const std::size_t bit = std::size_t(x) * bpp;
+                const unsigned index = (in[bit / 8] >> (8 - bpp - bit % 8)) & ((1u << bpp) - 1);
+                if (index * 4 >= palette.size()) return std::nullopt;
+                bgr = &palette[index * 4];
+            }
+            out[0] = bgr[2]; out[1] = bgr[1]; out[2] = bgr[0];
+        }
+    }
+    return image;
+}
+
+/* Whether decode handles the format variant of data. When it does, nullopt from decode means
+ * the image is corrupt or too large, otherwise the variant is simply not implemented */
+bool natively_decodable(std::span<const std::uint8_t> data) {
+    switch (sniff_format(data)) {
+        case Format::jpeg: return jpeg_rgb_decodable(data);
+        case Format::png:
+        case Format::gif:  return true;
+        case Format::bmp: {
+            if (data.size() < 54) return true; // truncated
+            const std::uint32_t bpp = data[28] | (data[29] << 8);
+            const std::uint32_t compression = data[30] | (data[31] << 8) | (data[32] << 16) | (std::uint32_t(data[33]) << 24);
+            return compression == 0 && (bpp == 1 || bpp == 4 || bpp == 8 || bpp == 24 || bpp == 32);
+        }
+        default:           return false;
+    }
+}
+
+/* Hint is the size the image will be scaled to, decoders may use it to decode less data */
+std::optional<Image> decode(std::span<const std::uint8_t> data, Size hint) {
+    switch (sniff_format(data)) {
+        case Format::jpeg: return decode_jpeg(data, hint);
+        case Format::png:  return decode_png(data);
+        case Format::gif:  return decode_gif(data);
+        case Format::bmp:  return decode_bmp(data);
+        default:           return std::nullopt;
+    }
+}
+
+} // ns rs::image
+
+#endif // RS_IMAGE_CODECS_HPP
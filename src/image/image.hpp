@@ -0,0 +1,42 @@
+#ifndef RS_IMAGE_HPP
+#define RS_IMAGE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace rs::image {
+
+struct Size {
+    std::uint32_t width;
+    std::uint32_t height;
+};
+
+/* 8-bit RGB, rows stored top to bottom without padding */
+struct Image {
+    static constexpr std::size_t channels = 3;
+
+    Size size {0, 0};
+    std::vector<std::uint8_t> pixels;
+
+    Image() = default;
+    explicit Image(Size s) : size(s), pixels(std::size_t(s.width) * s.height * channels) {}
+
+    [[nodiscard]] std::size_t row_len() const { return std::size_t(size.width) * channels; }
+    [[nodiscard]] std::uint8_t * row(std::uint32_t y) { return pixels.data() + y * row_len(); }
+    [[nodiscard]] const std::uint8_t * row(std::uint32_t y) const { return pixels.data() + y * row_len(); }
+};
+
+/* Largest size with the same aspect ratio that fits into box, same as ImageMagick's WxH geometry */
+constexpr Size fit_within(Size src, Size box) {
+    const double scale = std::min(double(box.width) / src.width, double(box.height) / src.height);
+    return {
+        std::max<std::uint32_t>(1, static_cast<std::uint32_t>(std::lround(src.width * scale))),
+        std::max<std::uint32_t>(1, static_cast<std::uint32_t>(std::lround(src.height * scale)))
+    };
+}
+
+} // ns rs::image
+
+#endif // RS_IMAGE_HPP
@@ -0,0 +1,217 @@
+#ifndef RS_IMAGE_RESIZE_HPP
+#define RS_IMAGE_RESIZE_HPP
+
+#include <condition_variable>
+#include <experimental/simd>
+#include <functional>
+#include <mutex>
+#include <numbers>
+#include <stop_token>
+#include <thread>
+
+#include "image/image.hpp"
+
+namespace rs::image {
+
+namespace stdx = std::experimental;
+
+/* Lanczos3 weights of every output sample, flattened with stride max_taps */
+struct Contributions {
+    std::vector<std::uint32_t> first;
+    std::vector<std::uint32_t> count;
+    std::vector<float> weights;
+    std::size_t max_taps;
+};
+
+constexpr double lanczos3(double x) {
+    if (x == 0.0) return 1.0;
+    if (x <= -3.0 || x >= 3.0) return 0.0;
+    const double px = std::numbers::pi * x;
+    return 3.0 * std::sin(px) * std::sin(px / 3.0) / (px * px);
+}
+
+Contributions compute_contributions(std::uint32_t src_size, std::uint32_t dst_size) {
+    const double scale = double(src_size) / dst_size;
+    const double filter_scale = std::max(scale, 1.0); // widen the kernel when downscaling
+    const double support = 3.0 * filter_scale;
+
+    Contributions c;
+    c.max_taps = static_cast<std::size_t>(std::ceil(support)) * 2 + 1;
+    c.first.resize(dst_size); c.count.resize(dst_size);
+    c.weights.assign(dst_size * c.max_taps, 0.0f);
+
+    for (std::uint32_t i = 0; i < dst_size; i++) {
+        const double center = (i + 0.5) * scale;
+        const auto lo = static_cast<std::uint32_t>(std::max(0.0, std::floor(center - support + 0.5)));
+        const auto hi = static_cast<std::uint32_t>(std::min<double>(src_size, std::floor(center + support + 0.5)));
+        const std::uint32_t count = std::min<std::size_t>(hi - lo, c.max_taps);
+
+        float * w = c.weights.data() + i * c.max_taps;
+        double total = 0.0;
+        for (std::uint32_t k = 0; k < count; k++)
+            total += (w[k] = static_cast<float>(lanczos3((lo + k + 0.5 - center) / filter_scale)));
+        for (std::uint32_t k = 0; k < count && total != 0.0; k++)
+            w[k] = static_cast<float>(w[k] / total);
+
+        c.first[i] = lo;
+        c.count[i] = count;
+    }
+    return c;
+}
+
+/* Helper threads started once (e.g. per thumbnail worker) and shared by every pass of every image.
+ * run() is called by one thread at a time, tasks must not throw */
+class ForkJoinPool {
+    std::mutex m_mutex;
+    std::condition_variable_any m_start_cv;
+    std::condition_variable m_done_cv;
+    std::function<void(unsigned)> m_task;
+    std::uint64_t m_generation = 0;
+    unsigned m_pending = 0;
+    std::vector<std::jthread> m_helpers; // last, joined before the rest is destroyed
+
+    void help(std::stop_token stoken, unsigned index) {
+        std::uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock lock(m_mutex);
+                if (!m_start_cv.wait(lock, stoken, [&] { return m_generation != seen; }))
+                    return;
+                seen = m_generation;
+            }
+            m_task(index);
+            std::scoped_lock lock(m_mutex);
+            if (--m_pending == 0) m_done_cv.notify_one();
+        }
+    }
+
+public:
+    /* threads includes the one calling run() */
+    explicit ForkJoinPool(unsigned threads = 1) {
+        for (unsigned i = 1; i < threads; i++)
+            m_helpers.emplace_back([this, i](std::stop_token stoken) { help(stoken, i); });
+    }
+    ForkJoinPool(const ForkJoinPool&) = delete;
+    ForkJoinPool& operator=(const ForkJoinPool&) = delete;
+
+    [[nodiscard]] unsigned size() const { return static_cast<unsigned>(m_helpers.size()) + 1; }
+
+    /* Runs task(i) for every i in [0, size()), 0 on the calling thread, and waits for all of them */
+    void run(std::function<void(unsigned)> task) {
+        if (m_helpers.empty()) return task(0);
+        {
+            std::scoped_lock lock(m_mutex);
+            m_task = std::move(task);
+            m_pending = static_cast<unsigned>(m_helpers.size());
+            m_generation++;
+        }
+        m_start_cv.notify_all();
+        m_task(0);
+        std::unique_lock lock(m_mutex);
+        m_done_cv.wait(lock, [this] { return m_pending == 0; });
+    }
+};
+
+/* Runs f(begin, end) over [0, n) split into contiguous blocks, one block per thread of pool */
+template <typename F>
+void parallel_for(std::size_t n, ForkJoinPool &pool, F &&f) {
+    const std::size_t threads = std::clamp<std::size_t>(pool.size(), 1, std::max<std::size_t>(n / 16, 1));
+    const std::size_t block = (n + threads - 1) / threads;
+    pool.run([&](unsigned t) {
+        const std::size_t begin = t * block, end = std::min(n, begin + block);
+        if (t < threads && begin < end) f(begin, end);
+    });
+}
+
+/* Resamples along the columns: every output row is a weighted sum of whole input rows,
+ * so the inner loop runs over contiguous memory and is vectorized with stdx::native_simd */
+template <typename Src>
+void resize_rows(const Src * src, std::size_t row_len, std::uint32_t src_rows,
+                 float * dst, std::uint32_t dst_rows, ForkJoinPool &pool) {
+    using vfloat = stdx::native_simd<float>;
+    const auto c = compute_contributions(src_rows, dst_rows);
+
+    parallel_for(dst_rows, pool, [&](std::size_t begin, std::size_t end) {
+        for (std::size_t r = begin; r < end; r++) {
+            const Src * in = src + c.first[r] * row_len;
+            const float * w = c.weights.data() + r * c.max_taps;
+            const std::uint32_t taps = c.count[r];
+            float * out = dst + r * row_len;
+
+            std::size_t x = 0;
+            for (; x + vfloat::size() <= row_len; x += vfloat::size()) {
+                vfloat acc = 0.0f;
+                for (std::uint32_t k = 0; k < taps; k++)
+                    acc += vfloat(in + k * row_len + x, stdx::element_aligned) * w[k];
+                acc.copy_to(out + x, stdx::element_aligned);
+            }
+            for (; x < row_len; x++) {
+                float acc = 0.0f;
+                for (std::uint32_t k = 0; k < taps; k++)
+                    acc += static_cast<float>(in[k * row_len + x]) * w[k];
+                out[x] = acc;
+            }
+        }
+    });
+}
+
+/* Swaps rows and columns of a pixel grid in cache sized tiles, converting samples to Dst */
+template <typename Dst>
+void transpose_pixels(const float * src, std::uint32_t rows, std::uint32_t cols, Dst * dst, ForkJoinPool &pool) {
+    constexpr std::uint32_t tile = 16;
+    constexpr auto ch = Image::channels;
+    auto convert = [](float v) {
+        if constexpr (std::is_same_v<Dst, std::uint8_t>)
+            return static_cast<std::uint8_t>(std::clamp(v + 0.5f, 0.0f, 255.0f));
+        else
+            return v;
+    };
+
+    parallel_for((rows + tile - 1) / tile, pool, [&](std::size_t begin, std::size_t end) {
+        const std::uint32_t r_end = std::min<std::size_t>(rows, end * tile);
+        for (std::uint32_t r0 = begin * tile; r0 < r_end; r0 += tile) {
+            for (std::uint32_t c0 = 0; c0 < cols; c0 += tile) {
+                const std::uint32_t tile_rows = std::min(tile, r_end - r0), tile_cols = std::min(tile, cols - c0);
+                for (std::uint32_t r = 0; r < tile_rows; r++) {
+                    const float * in = src + (std::size_t(r0 + r) * cols + c0) * ch;
+                    Dst * out = dst + (std::size_t(c0) * rows + r0 + r) * ch;
+                    for (std::uint32_t c = 0; c < tile_cols; c++, in += ch, out += std::size_t(rows) * ch) {
+                        out[0] = convert(in[0]); out[1] = convert(in[1]); out[2] = convert(in[2]);
+                    }
+                }
+            }
+        }
+    });
+}
+
+/* Separable Lanczos3 resize. Both passes use the same row kernel,
+ * the horizontal one runs on the transposed intermediate image */
+Image resize(const Image &src, Size dst_size, ForkJoinPool &pool) {
+    const auto [sw, sh] = src.size;
+    const auto [dw, dh] = dst_size;
+    constexpr auto ch = Image::channels;
+
+    std::vector<float> vertical(std::size_t(dh) * sw * ch);
+    resize_rows(src.pixels.data(), std::size_t(sw) * ch, sh, vertical.data(), dh, pool);
+
+    std::vector<float> transposed(vertical.size());
+    transpose_pixels(vertical.data(), dh, sw, transposed.data(), pool);
+    vertical = {};
+
+    std::vector<float> horizontal(std::size_t(dw) * dh * ch);
+    resize_rows(transposed.data(), std::size_t(dh) * ch, sw, horizontal.data(), dw, pool);
+
+    Image dst(dst_size);
+    transpose_pixels(horizontal.data(), dw, dh, dst.pixels.data(), pool);
+    return dst;
+}
+
+/* Same as above with threads started for this image only */
+Image resize(const Image &src, Size dst_size, unsigned threads = 1) {
+    ForkJoinPool pool(threads);
+    return resize(src, dst_size, pool);
+}
+
+} // ns rs::image
+
+#endif // RS_IMAGE_RESIZE_HPP
@@ -0,0 +1,50 @@
+#ifndef RS_IMAGE_THUMBNAIL_HPP
+#define RS_IMAGE_THUMBNAIL_HPP
+
+#include <filesystem>
+
+#include "image/codecs.hpp"
+#include "image/resize.hpp"
+
+namespace rs::image {
+
+enum class ThumbnailResult { done, unsupported, failed };
+
+/* Decodes src, fits it into box and writes it to dst_path as format (see can_encode), resizing on pool.
+ * Unsupported means the format variant is not handled natively and an external tool may still succeed.
+ * Corrupt and oversized images fail, they must not be handed to an external tool */
+ThumbnailResult make_thumbnail(const std::string &src_path, const std::string &dst_path,
+                               Size box, ForkJoinPool &pool, Format format = Format::jpeg, int quality = 85) {
+    const auto data = read_file(src_path);
+    if (!data.has_value()) return ThumbnailResult::failed;
+    if (!natively_decodable(*data)) return ThumbnailResult::unsupported;
+
+    auto decoded = decode(*data, box);
+    if (!decoded.has_value()) return ThumbnailResult::failed;
+
+    const Size size = fit_within(decoded->size, box);
+    const Image thumbnail = resize(*decoded, size, pool);
+    decoded.reset();
+
+    const std::string tmp_path = dst_path + ".part";
+    file_ptr out(std::fopen(tmp_path.c_str(), "wb"), &std::fclose);
+    if (!out) return ThumbnailResult::failed;
+    const bool encoded = encode(thumbnail, out.get(), format, quality);
+    if (std::fclose(out.release()) != 0 || !encoded) {
+        std::filesystem::remove(tmp_path);
+        return ThumbnailResult::failed;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, dst_path, ec);
+    return ec ? ThumbnailResult::failed : ThumbnailResult::done;
+}
+
+ThumbnailResult make_thumbnail(const std::string &src_path, const std::string &dst_path,
+                               Size box, unsigned threads = 1, Format format = Format::jpeg, int quality = 85) {
+    ForkJoinPool pool(threads);
+    return make_thumbnail(src_path, dst_path, box, pool, format, quality);
+}
+
+} // ns rs::image
+
+#endif // RS_IMAGE_THUMBNAIL_HPP
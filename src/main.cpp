@@ -6,11 +6,25 @@
 #include <span>
 #include "router.hpp"
 #include "routes.hpp"
+#include "thumbnails.hpp"
+#include "blobs.hpp"
+#include "thumbnail_pack.hpp"
+#include "file_io.hpp"
 #include "utils.hpp"
 #include "3rd_party/color.hpp"
 
 using namespace restinio;
 
+/* Connection count limit for --max-connections, listener for connection metrics */
+struct server_traits_t : restinio::traits_t<
+        restinio::asio_timer_manager_t,
+        restinio::null_logger_t,
+        restinio::router::easy_parser_router_t>
+{
+    static constexpr bool use_connection_count_limiter = true;
+    using connection_state_listener_t = rs::ConnectionTracker;
+};
+
 int main(int argc, char * argv[])
 {
     namespace epr = restinio::router::easy_parser_router;
@@ -26,47 +40,77 @@ int main(int argc, char * argv[])
     auto server_address = args.address.value_or("localhost");
     auto server_port = args.port.value_or(3000u);
     auto db_config = args.db_config.value_or("db.sqlite");
+    auto max_body_size = args.max_body_size.value_or(32 * 1024 * 1024);
+    auto thumbnail_cache_size = args.thumbnail_cache_size.value_or(512 * 1024 * 1024);
+    rs::IdGenerator ids(args.node_id.value_or(0));
+
+    rs::ConnectionSettings connection_settings;
+    connection_settings.keep_alive_on_error = !args.close_on_error;
+    connection_settings.idle_timeout = std::chrono::seconds(args.idle_timeout.value_or(60));
+    connection_settings.write_timeout = std::chrono::seconds(args.write_timeout.value_or(30));
+    connection_settings.max_requests = args.max_requests_per_connection.value_or(0);
+    connection_settings.max_connections = args.max_connections.value_or(connection_settings.max_connections);
+    connection_settings.concurrent_accepts = args.concurrent_accepts.value_or(1);
+    rs::connections().configure(connection_settings);
 
     constexpr std::size_t pool_size = 16;
 
     soci::connection_pool db_pool(pool_size);
     for (size_t i = 0; i != pool_size; ++i) {
         soci::session& sql = db_pool.at(i);
-        sql.open(soci::sqlite3, fmt::format("dbname={}" ,db_config));
+        sql.open(soci::sqlite3, rs::db_connection_string(db_config));
     }
+    /* Readers do not block the writer and each other, the mode is stored in the db file */
+    db_pool.at(0) << "PRAGMA journal_mode = WAL";
 
-    auto router = rs::Router(std::make_unique<restinio::router::easy_parser_router_t>());
-    rs::register_routes(router, db_pool);
-
-    router.epr->non_matched_request_handler(
-        [](auto req) {
-            return req->create_response(restinio::status_not_found()).connection_close()
-                       .append_header( restinio::http_field::content_type, "application/json" )
-                       .append_header(restinio::http_field::access_control_allow_origin, "*")
-                       .append_header(restinio::http_field::access_control_allow_credentials, "true")
-                       .set_body(rs::NotFoundError("Route not found").json().dump())
-                       .done();
-    });
+    std::filesystem::create_directories(rs::storage::thumbnails_dir);
+    rs::ThumbnailPack thumbnail_pack(rs::storage::thumbnail_packs_dir, db_pool);
 
-    fmt::print("{}Server running on {}{}:{}{}\n", 
-                  COLOR_GRN, COLOR_YEL, server_address, server_port, COLOR_DEF);
+    /* Shared with restinio so file I/O completions run on its worker threads */
+    restinio::asio_ns::io_context io_context;
+    rs::FileIoService file_io(io_context);
 
-    using traits_t =
-        restinio::traits_t<
-            restinio::asio_timer_manager_t,
-            restinio::null_logger_t,
-            restinio::router::easy_parser_router_t>;
+    rs::CorsPolicy cors_policy;
+    if (args.cors_origins.has_value()) {
+        cors_policy.allowed_origins = rs::split(*args.cors_origins, ',');
+        cors_policy.allow_credentials = true; // only for the origins listed by name
+    }
+    auto router = rs::Router(std::make_unique<restinio::router::easy_parser_router_t>(), std::move(cors_policy));
+    constexpr unsigned thumbnail_workers = 2;
+    constexpr std::size_t thumbnail_queue_capacity = 64;
+    const unsigned threads_per_thumbnail = std::max(1u, std::thread::hardware_concurrency() / thumbnail_workers);
+    rs::ThumbnailQueue thumbnails(thumbnail_workers, thumbnail_queue_capacity, threads_per_thumbnail);
+    rs::ThumbnailCache thumbnail_cache(thumbnail_cache_size, router.static_files_cache);
+
+    rs::UploadSessions uploads;
+    rs::IdempotencyStore idempotency;
+    rs::Purger purger(db_pool, thumbnail_cache, thumbnail_pack, router.static_files_cache);
+    rs::register_routes(router, db_pool, thumbnails, thumbnail_cache, thumbnail_pack, file_io, uploads, idempotency, purger, ids);
 
-    router.api_get(std::make_tuple("/help_json"), 
-        [&router](rs::model::Empty&&, rs::model::AuthToken&&) -> nlohmann::json {
-            return router.registered_routes_info;
+    fmt::print("{}Server running on {}{}:{}{} (file I/O: {})\n", 
+                  COLOR_GRN, COLOR_YEL, server_address, server_port, COLOR_DEF, file_io.backend());
+
+    router.api_get(std::make_tuple("/metrics"),
+        [](rs::model::Empty&&, rs::model::AuthToken&&) -> nlohmann::json {
+            return {{"connections", rs::connections().metrics()}, {"connection_settings", rs::connections().settings()}};
     });
 
-    rs::register_api_reference_route(router, "/help");
+    router.fixed_get(std::make_tuple("/help_json"), "help_json");
+    router.fixed_get(std::make_tuple("/help"), "help");
+
+    /* rendered once, after every route is registered */
+    router.static_responses.add("help_json", "application/json", nlohmann::json(router.registered_routes_info).dump());
+    router.static_responses.add("help", "text/html", rs::api_reference_html(router.registered_routes_info));
 
-    restinio::run(restinio::on_thread_pool<traits_t>(pool_size) // Thread pool size is 16 threads.
+    restinio::run(io_context, restinio::on_thread_pool<server_traits_t>(pool_size) // Thread pool size is 16 threads.
                  .address(server_address)
                  .port(server_port)
+                 .incoming_http_msg_limits(restinio::incoming_http_msg_limits_t{}.max_body_size(max_body_size))
+                 .read_next_http_message_timelimit(connection_settings.idle_timeout)
+                 .write_http_response_timelimit(connection_settings.write_timeout)
+                 .max_parallel_connections(connection_settings.max_connections)
+                 .concurrent_accepts_count(connection_settings.concurrent_accepts)
+                 .connection_state_listener(rs::connection_tracker())
                  .request_handler(std::move(router.epr)));
 
     return 0;
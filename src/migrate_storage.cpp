@@ -0,0 +1,211 @@
+#include <soci/soci.h>
+#include <soci/sqlite3/soci-sqlite3.h>
+
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <span>
+#include <thread>
+
+#include "models.hpp"
+#include "utils.hpp"
+#include "storage.hpp"
+#include "3rd_party/color.hpp"
+
+/* Moves files from the flat pre-sharding layout into the sharded one (see storage.hpp) while the server runs.
+ * Every file is hard linked to its new path before the old name is removed, so it is always reachable
+ * through the server's legacy fallback. A photo deleted in between can leave its new link behind,
+ * those are found by checking the database after each batch and removed. */
+namespace rs::migrate_storage {
+
+namespace fs = std::filesystem;
+
+struct CmdLineArgs {
+    std::optional<const char *> db_config;
+    std::size_t files_per_second = 0;
+    std::size_t batch_size = 1000;
+    bool dry_run {false};
+    bool help {false};
+
+    static constexpr const char * help_string =
+          "--db -d\t\t\tPath to db to be used\n"
+          "--rate -r\t\tMax files moved per second (default unlimited)\n"
+          "--batch -b\t\tFiles moved between database checks (default 1000)\n"
+          "--dry-run\t\tOnly count files to be moved\n"
+          "-h --help\t\tShow help menu\n";
+};
+
+CmdLineArgs parse_cmdline_args(std::span<char *> args)
+{
+    CmdLineArgs result{};
+    auto it_end = std::cend(args);
+
+    for (auto it = std::cbegin(args); it != it_end; it++) {
+        auto it_next = std::next(it);
+        std::string_view curr{*it};
+        if ((curr == "--db" || curr == "-d") && it_next != it_end)
+            result.db_config = *it_next;
+        else if ((curr == "--rate" || curr == "-r") && it_next != it_end)
+            result.files_per_second = std::strtoul(*it_next, nullptr, 10);
+        else if ((curr == "--batch" || curr == "-b") && it_next != it_end)
+            result.batch_size = std::max(1ul, std::strtoul(*it_next, nullptr, 10));
+        else if (curr == "--dry-run")
+            result.dry_run = true;
+        else if ((curr == "--help" || curr == "-h"))
+            result.help = true;
+    }
+    return result;
+};
+
+/* File found at a legacy path, owner is the photo id or blob hash it belongs to */
+struct LegacyFile {
+    storage::Location location;
+    std::string table;
+    std::string owner_condition;
+};
+
+/* <id><rest>, rest starting with '.' or '_' */
+std::optional<std::uint64_t> parse_id(std::string_view name) {
+    std::uint64_t id = 0;
+    auto [ptr, ec] = std::from_chars(name.data(), name.data() + name.size(), id);
+    if (ec != std::errc{} || ptr == name.data() || ptr == name.data() + name.size() || (*ptr != '.' && *ptr != '_'))
+        return std::nullopt;
+    return id;
+}
+
+/* <sha256 hex><ext> */
+std::optional<std::string_view> parse_hash(std::string_view name) {
+    constexpr std::size_t hash_len = 64;
+    if (name.size() <= hash_len || name[hash_len] != '.') return std::nullopt;
+    auto hash = name.substr(0, hash_len);
+    if (hash.find_first_not_of("0123456789abcdef") != std::string_view::npos) return std::nullopt;
+    return hash;
+}
+
+std::optional<LegacyFile> classify(std::string_view dir, const std::string &name) {
+    if (name.starts_with('.') || name.ends_with(".part")) /* being written */
+        return std::nullopt;
+    const std::string_view d{dir};
+    if (d == storage::photos_dir) {
+        auto id = parse_id(name);
+        auto dot = name.find('.');
+        if (!id || dot == std::string::npos || !model::cnstr::ValidImageExtension::is_satisfied(name.substr(dot)))
+            return std::nullopt;
+        return LegacyFile{storage::photo(*id, name.substr(dot)), "photos", fmt::format("id = {}", *id)};
+    }
+    if (d == storage::thumbnails_dir) {
+        /* thumbnail rendered at upload and on-demand variants share the layout */
+        auto id = parse_id(name);
+        if (!id) return std::nullopt;
+        return LegacyFile{storage::variant(*id, name), "photos", fmt::format("id = {}", *id)};
+    }
+    auto hash = parse_hash(name);
+    if (!hash) return std::nullopt;
+    auto condition = fmt::format("hash = '{}'", *hash);
+    if (d == storage::blobs_dir)
+        return LegacyFile{storage::blob(*hash, name.substr(hash->size())), "blobs", std::move(condition)};
+    return LegacyFile{storage::blob_thumbnail(*hash), "blobs", std::move(condition)};
+}
+
+struct Stats {
+    std::size_t moved = 0;
+    std::size_t orphaned = 0;
+    std::size_t failed = 0;
+};
+
+enum class MoveResult { moved, vanished, failed };
+
+/* Links file at its sharded path, then drops the legacy name */
+MoveResult move(const storage::Location &loc) {
+    std::error_code ec;
+    storage::prepare(loc);
+    fs::create_hard_link(loc.legacy_path(), loc.path(), ec);
+    if (ec == std::errc::no_such_file_or_directory) /* deleted by the server */
+        return MoveResult::vanished;
+    if (ec && ec != std::errc::file_exists) /* written to the sharded path already otherwise */
+        return MoveResult::failed;
+    fs::remove(loc.legacy_path(), ec);
+    return ec ? MoveResult::failed : MoveResult::moved;
+}
+
+/* Removes new links of files whose photo or blob was deleted while they were being moved */
+void remove_orphans(soci::session &db, std::span<const LegacyFile> moved, Stats &stats) {
+    for (const auto &file : moved) {
+        int exists = 0;
+        db << fmt::format("SELECT EXISTS(SELECT 1 FROM {} WHERE {})", file.table, file.owner_condition), soci::into(exists);
+        if (exists) continue;
+        storage::remove(file.location);
+        stats.orphaned++;
+    }
+}
+
+Stats migrate(soci::session &db, const CmdLineArgs &args) {
+    Stats stats;
+    std::vector<LegacyFile> batch;
+    std::size_t seen = 0;
+    const auto start = std::chrono::steady_clock::now();
+
+    auto flush = [&]() {
+        remove_orphans(db, batch, stats);
+        batch.clear();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fmt::print(stderr, "{} files moved, {:.0f} files/s\n", stats.moved, stats.moved / elapsed.count());
+    };
+
+    for (const char * dir : {storage::photos_dir, storage::thumbnails_dir, storage::blobs_dir, storage::blob_thumbnails_dir}) {
+        std::error_code ec;
+        /* names are collected first, creating shard directories while iterating is not safe */
+        std::vector<std::string> names;
+        for (const auto &entry : fs::directory_iterator(dir, ec))
+            if (entry.is_regular_file(ec)) names.push_back(entry.path().filename().string());
+
+        for (const auto &name : names) {
+            auto file = classify(dir, name);
+            if (!file) continue;
+            seen++;
+            if (args.dry_run) continue;
+
+            if (args.files_per_second > 0) {
+                const auto due = start + std::chrono::duration<double>(static_cast<double>(seen) / args.files_per_second);
+                std::this_thread::sleep_until(due);
+            }
+            const auto result = move(file->location);
+            if (result == MoveResult::vanished) continue;
+            if (result == MoveResult::failed) {
+                fmt::print(stderr, "{}{}:{} could not be moved\n", COLOR_RED, file->location.legacy_path(), COLOR_DEF);
+                stats.failed++;
+                continue;
+            }
+            stats.moved++;
+            batch.push_back(std::move(*file));
+            if (batch.size() == args.batch_size) flush();
+        }
+    }
+    if (!batch.empty()) flush();
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (args.dry_run)
+        fmt::print("{}{}{}{} files to be moved{}\n", COLOR_GRN, COLOR_YEL, seen, COLOR_GRN, COLOR_DEF);
+    else
+        fmt::print("{}Moved {}{}{} files ({} orphaned removed, {} failed) in {:.2f}s{}\n", COLOR_GRN, COLOR_YEL, stats.moved, COLOR_GRN,
+                   stats.orphaned, stats.failed, elapsed.count(), COLOR_DEF);
+    return stats;
+}
+
+} // ns rs::migrate_storage
+
+int main(int argc, char * argv[])
+{
+    auto argv_span = std::span(argv, argc);
+    auto args = rs::migrate_storage::parse_cmdline_args(argv_span);
+
+    if (args.help) {
+        fmt::print("USAGE {} -d <path_to_db> [-r <files_per_second>]\nRun from the server's working directory\n", *argv_span.begin());
+        fmt::print("{}", rs::migrate_storage::CmdLineArgs::help_string);
+        std::exit(0);
+    }
+
+    soci::session db(soci::sqlite3, rs::db_connection_string(args.db_config.value_or("db.sqlite")));
+    auto stats = rs::migrate_storage::migrate(db, args);
+    return stats.failed == 0 ? 0 : 2;
+}
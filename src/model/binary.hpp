@@ -0,0 +1,157 @@
+#ifndef RS_MODEL_BINARY_HPP
+#define RS_MODEL_BINARY_HPP
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "model/model.hpp"
+
+/* MessagePack and CBOR encoders of models, writing fields straight from reflection
+ * without building a nlohmann::json first. Output decodes to what to_json gives. */
+namespace rs::model::binary {
+
+namespace detail {
+
+template <typename T>
+void put_big_endian(std::string &out, T value) {
+    if constexpr (std::endian::native == std::endian::little) {
+        if constexpr (sizeof(T) == 2) value = static_cast<T>(__builtin_bswap16(static_cast<std::uint16_t>(value)));
+        else if constexpr (sizeof(T) == 4) value = static_cast<T>(__builtin_bswap32(static_cast<std::uint32_t>(value)));
+        else if constexpr (sizeof(T) == 8) value = static_cast<T>(__builtin_bswap64(static_cast<std::uint64_t>(value)));
+    }
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+}
+
+} // ns detail
+
+class MsgpackWriter {
+    std::string m_out;
+
+    /* length of str, array or map in the smallest of the three sizes after the fix form */
+    void length(std::size_t n, std::uint8_t b8, std::uint8_t b16, std::uint8_t b32) {
+        if (b8 != 0 && n <= 0xff) { m_out.push_back(static_cast<char>(b8)); m_out.push_back(static_cast<char>(n)); }
+        else if (n <= 0xffff) { m_out.push_back(static_cast<char>(b16)); detail::put_big_endian(m_out, static_cast<std::uint16_t>(n)); }
+        else { m_out.push_back(static_cast<char>(b32)); detail::put_big_endian(m_out, static_cast<std::uint32_t>(n)); }
+    }
+
+public:
+    void null() { m_out.push_back(static_cast<char>(0xc0)); }
+    void boolean(bool b) { m_out.push_back(static_cast<char>(b ? 0xc3 : 0xc2)); }
+
+    void integer(std::int64_t i) {
+        if (i >= 0) {
+            const auto u = static_cast<std::uint64_t>(i);
+            if (u < 0x80) m_out.push_back(static_cast<char>(u));
+            else if (u <= 0xff) { m_out.push_back(static_cast<char>(0xcc)); m_out.push_back(static_cast<char>(u)); }
+            else if (u <= 0xffff) { m_out.push_back(static_cast<char>(0xcd)); detail::put_big_endian(m_out, static_cast<std::uint16_t>(u)); }
+            else if (u <= 0xffffffff) { m_out.push_back(static_cast<char>(0xce)); detail::put_big_endian(m_out, static_cast<std::uint32_t>(u)); }
+            else { m_out.push_back(static_cast<char>(0xcf)); detail::put_big_endian(m_out, u); }
+        } else {
+            if (i >= -32) m_out.push_back(static_cast<char>(i));
+            else if (i >= INT8_MIN) { m_out.push_back(static_cast<char>(0xd0)); m_out.push_back(static_cast<char>(i)); }
+            else if (i >= INT16_MIN) { m_out.push_back(static_cast<char>(0xd1)); detail::put_big_endian(m_out, static_cast<std::int16_t>(i)); }
+            else if (i >= INT32_MIN) { m_out.push_back(static_cast<char>(0xd2)); detail::put_big_endian(m_out, static_cast<std::int32_t>(i)); }
+            else { m_out.push_back(static_cast<char>(0xd3)); detail::put_big_endian(m_out, i); }
+        }
+    }
+
+    void number(double d) { m_out.push_back(static_cast<char>(0xcb)); detail::put_big_endian(m_out, std::bit_cast<std::uint64_t>(d)); }
+
+    void string(std::string_view s) {
+        if (s.size() < 32) m_out.push_back(static_cast<char>(0xa0 | s.size()));
+        else length(s.size(), 0xd9, 0xda, 0xdb);
+        m_out.append(s);
+    }
+
+    void array(std::size_t n) {
+        if (n < 16) m_out.push_back(static_cast<char>(0x90 | n));
+        else length(n, 0, 0xdc, 0xdd);
+    }
+
+    void map(std::size_t n) {
+        if (n < 16) m_out.push_back(static_cast<char>(0x80 | n));
+        else length(n, 0, 0xde, 0xdf);
+    }
+
+    std::string take() { return std::move(m_out); }
+};
+
+class CborWriter {
+    std::string m_out;
+
+    void head(std::uint8_t major, std::uint64_t n) {
+        const auto mt = static_cast<char>(major << 5);
+        if (n < 24) m_out.push_back(static_cast<char>(mt | n));
+        else if (n <= 0xff) { m_out.push_back(static_cast<char>(mt | 24)); m_out.push_back(static_cast<char>(n)); }
+        else if (n <= 0xffff) { m_out.push_back(static_cast<char>(mt | 25)); detail::put_big_endian(m_out, static_cast<std::uint16_t>(n)); }
+        else if (n <= 0xffffffff) { m_out.push_back(static_cast<char>(mt | 26)); detail::put_big_endian(m_out, static_cast<std::uint32_t>(n)); }
+        else { m_out.push_back(static_cast<char>(mt | 27)); detail::put_big_endian(m_out, n); }
+    }
+
+public:
+    void null() { m_out.push_back(static_cast<char>(0xf6)); }
+    void boolean(bool b) { m_out.push_back(static_cast<char>(b ? 0xf5 : 0xf4)); }
+
+    void integer(std::int64_t i) {
+        if (i >= 0) head(0, static_cast<std::uint64_t>(i));
+        else head(1, static_cast<std::uint64_t>(-(i + 1)));
+    }
+
+    void number(double d) { m_out.push_back(static_cast<char>(0xfb)); detail::put_big_endian(m_out, std::bit_cast<std::uint64_t>(d)); }
+    void string(std::string_view s) { head(3, s.size()); m_out.append(s); }
+    void array(std::size_t n) { head(4, n); }
+    void map(std::size_t n) { head(5, n); }
+
+    std::string take() { return std::move(m_out); }
+};
+
+template <typename Writer, typename T>
+void write_value(Writer &w, const T &value) {
+    if constexpr (std::is_same_v<T, bool>) w.boolean(value);
+    else if constexpr (std::is_integral_v<T>) w.integer(static_cast<std::int64_t>(value));
+    else if constexpr (std::is_floating_point_v<T>) w.number(static_cast<double>(value));
+    else w.string(std::string_view{value});
+}
+
+/* Map of the fields having a value, like to_json */
+template <typename Writer>
+void write(Writer &w, CModel auto const &model) {
+    std::size_t n = 0;
+    refl::util::for_each(refl::reflect(model).members, [&](auto member) {
+        if constexpr (refl::trait::is_field<decltype(member)>())
+            n += member(model).opt_value.has_value();
+    });
+    w.map(n);
+    refl::util::for_each(refl::reflect(model).members, [&](auto member) {
+        if constexpr (refl::trait::is_field<decltype(member)>()) {
+            if (member(model).opt_value.has_value()) {
+                w.string(member.name.c_str());
+                write_value(w, *(member(model).opt_value));
+            }
+        }
+    });
+}
+
+template <typename Writer, CModel M>
+void write(Writer &w, const std::vector<M> &models) {
+    w.array(models.size());
+    for (const auto &m : models) write(w, m);
+}
+
+template <typename Writer, typename T>
+std::string encode(const T &value) {
+    Writer w;
+    write(w, value);
+    return w.take();
+}
+
+} // ns rs::model::binary
+
+#endif // RS_MODEL_BINARY_HPP
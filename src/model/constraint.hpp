@@ -63,7 +63,7 @@ struct ValidEmail {
     ValidEmail() = delete;
 
     static bool is_satisfied(const std::string& s) {
-        const std::regex pattern
+        static const std::regex pattern
                 ("(?:[a-z0-9!#$%&'*+/=?^_`{|}~-]+(?:\\.[a-z0-9!#$%&'*+/=?^_`{|}~-]+)*|\"(?:[\\x01-\\x08\\x0b\\x0c\\"
                  "x0e-\\x1f\\x21\\x23-\\x5b\\x5d-\\x7f]|\\\\[\\x01-\\x09\\x0b\\x0c\\x0e-\\x7f])*\")@(?:(?:[a-z0-9]"
                  "(?:[a-z0-9-]*[a-z0-9])?\\.)+[a-z0-9](?:[a-z0-9-]*[a-z0-9])?|\\[(?:(?:25[0-5]|2[0-4][0-9]|[01]?"
@@ -80,7 +80,7 @@ struct ValidPassword {
     ValidPassword() = delete;
 
     static bool is_satisfied(const std::string& s) {
-        const std::regex pattern
+        static const std::regex pattern
                 (R"(^(?=.*[a-z])(?=.*[A-Z])(?=.*\d)[a-zA-Z\d]{8,}$)");
         return std::regex_match(s, pattern);
     }
@@ -94,7 +94,7 @@ struct ValidImageExtension {
     ValidImageExtension() = delete;
 
     static bool is_satisfied(const std::string& s) {
-        const std::regex pattern
+        static const std::regex pattern
                 //(R"(([^\s]*(\.(?i)(jpe?g|png|gif|bmp))$))");
                 (R"(\.(jpe?g|png|gif|bmp))");
         return std::regex_match(s, pattern);
@@ -110,7 +110,7 @@ struct ValidCategory {
     ValidCategory() = delete;
 
     static bool is_satisfied(const std::string& s) {
-        const std::regex pattern
+        static const std::regex pattern
                 (R"((Nature|Landscape|Animal|Fashion|Technology|Architecture|Macro|Sport|Other))");
         return std::regex_match(s, pattern);
     }
@@ -123,7 +123,7 @@ struct ISOdate {
     ISOdate() = delete;
 
     static bool is_satisfied(const std::string& s) {
-        const std::regex pattern
+        static const std::regex pattern
                 (R"(([12]\d{3}-(0[1-9]|1[0-2])-(0[1-9]|[12]\d|3[01])))");
         return std::regex_match(s, pattern);
     }
@@ -186,6 +186,23 @@ struct Model {
         });
     }
 
+    /* Resets every field whose bit is not set in mask, in a single pass */
+    template <typename Mask>
+    constexpr void retain_values(const Mask &mask) {
+        auto& model = static_cast<Derived&>(*this);
+        refl::util::for_each(refl::member_list<Derived>{}, [&](auto member, unsigned curr_index) {
+            if (!mask.test(curr_index))
+                member(model).opt_value.reset();
+        });
+    }
+
+    constexpr void erase_values() {
+        auto& model = static_cast<Derived&>(*this);
+        refl::util::for_each(refl::member_list<Derived>{}, [&](auto member) {
+            member(model).opt_value.reset();
+        });
+    }
+
     template <typename T>
     bool try_set_field_value(std::string_view field_name, T &&value) {
         auto& model = static_cast<Derived&>(*this);
@@ -3,6 +3,7 @@
 
 #include "model/model.hpp"
 #include "model/field.hpp"
+#include "permission.hpp"
 
 namespace rs::model {
 
@@ -23,7 +24,7 @@ struct User final : Model<User> {
 
 /* Models for Database */
 struct Photo final : Model<Photo> {
-    Field<int32_t, cnstr::Unique> id;
+    Field<long long, cnstr::Unique> id; // from IdGenerator, BIGINT column is read as long long by soci
     Field<std::string, cnstr::Required, cnstr::ValidImageExtension> extension;
     Field<std::string, cnstr::Length<1,255>, cnstr::Required> title;
     Field<std::string, cnstr::Length<0,255>, cnstr::Required, cnstr::ValidCategory> category;
@@ -31,6 +32,8 @@ struct Photo final : Model<Photo> {
     Field<int32_t,cnstr::Unique> uploaded_by;
     Field<std::string> upload_time;
     Field<int32_t, cnstr::Required, cnstr::Between<0,1>> is_private;
+    Field<std::string> thumbnail_status; // pending, ready or failed
+    Field<std::string> content_hash; // SHA-256 of the file, see blobs.hpp
 };
 
 /* Request Parameters Models */
@@ -47,6 +50,12 @@ struct RefreshAndAuthTokens final : Model<RefreshAndAuthTokens> {
     Field<std::string> auth_token;
 }; 
 
+/* Resumable upload of a photo file, size in bytes */
+struct UploadSession final : Model<UploadSession> {
+    Field<std::string, cnstr::Required, cnstr::ValidImageExtension> extension;
+    Field<int32_t, cnstr::Required, cnstr::Between<1, 16 * 1024 * 1024>> size;
+};
+
 
 /* Models for Database */
 struct UserCredentials final : Model<UserCredentials> {
@@ -82,7 +91,9 @@ REFL_AUTO(
     field(description),
     field(uploaded_by),
     field(upload_time),
-    field(is_private)
+    field(is_private),
+    field(thumbnail_status),
+    field(content_hash)
 )
 
 /* Request Parameters Models */
@@ -102,10 +113,47 @@ REFL_AUTO(
   field(auth_token)
 )
 
+REFL_AUTO(
+  type(rs::model::UploadSession),
+  field(extension),
+  field(size)
+)
+
 REFL_AUTO(
   type(rs::model::UserCredentials),
   field(username),
   field(password)
 )
 
+/* Compile-time permission policies, used instead of users_permissions and photos_permissions tables */
+#ifdef RS_STATIC_PERMISSIONS
+namespace rs {
+
+template <>
+struct static_permissions<model::User> {
+    static constexpr permissions_matrix_t<model::User> matrix = make_permissions_matrix<model::User>({{
+        /*           instance  id      username password email   firstname lastname born   gender  biography join_date permission_group */
+        /* other */ {"----",   "----", "----",  "----",  "----", "----",   "----",  "----", "----", "----",   "----",   "----"},
+        /* owner */ {"-RUD",   "-R-D", "-R--",  "--U-",  "-RU-", "-RU-",   "-RU-",  "-RU-", "-RU-", "-RU-",   "-RU-",   "-R--"},
+        /* guest */ {"CR--",   "-R--", "CR--",  "C---",  "CR--", "CR--",   "CR--",  "CR--", "CR--", "CR--",   "CR--",   "CR--"},
+        /* user  */ {"-R--",   "-R--", "-R--",  "----",  "-R--", "-R--",   "-R--",  "-R--", "-R--", "-R--",   "-R--",   "-R--"},
+        /* admin */ {"CRUD",   "-R--", "-RU-",  "--U-",  "-RU-", "-RU-",   "-RU-",  "-RU-", "-RU-", "-RU-",   "-R--",   "-RUD"},
+    }});
+};
+
+template <>
+struct static_permissions<model::Photo> {
+    static constexpr permissions_matrix_t<model::Photo> matrix = make_permissions_matrix<model::Photo>({{
+        /*           instance  id      extension title   category description uploaded_by upload_time is_private thumbnail_status content_hash */
+        /* other */ {"----",   "----", "----",   "----", "----",  "----",     "----",     "----",     "----",    "----",          "----"},
+        /* owner */ {"-RUD",   "-R-D", "-R--",   "-RU-", "-RU-",  "-RUD",     "-R--",     "-R--",     "-RU-",    "-R--",          "-R--"},
+        /* guest */ {"-R--",   "-R--", "-R--",   "-R--", "-R--",  "-R--",     "-R--",     "-R--",     "-R--",    "-R--",          "-R--"},
+        /* user  */ {"CRUD",   "CR--", "CR--",   "CR--", "CR--",  "CR--",     "CR--",     "CR--",     "CR--",    "CR--",          "CR--"},
+        /* admin */ {"CRUD",   "CR--", "CR--",   "CR--", "CR--",  "CR--",     "CR--",     "CR--",     "CRU-",    "CR--",          "CR--"},
+    }});
+};
+
+} // ns rs
+#endif // RS_STATIC_PERMISSIONS
+
 #endif // RS_MODELS_HPP
@@ -0,0 +1,80 @@
+#ifndef RS_PERMISSION_HPP
+#define RS_PERMISSION_HPP
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "3rd_party/magic_enum.hpp"
+
+namespace rs {
+enum class UserGroup {
+    other = 0,
+    owner = 1,
+    guest = 2,
+    user = 3,
+    admin = 4
+};
+constexpr unsigned num_of_user_groups = magic_enum::enum_count<UserGroup>();
+constexpr const char * group_name(UserGroup g) {
+    return magic_enum::enum_name(g).data();
+}
+
+constexpr bool have_exact_permissions(uint8_t desired, uint8_t perms) {
+    return (desired ^ perms) == 0;
+}
+
+constexpr bool have_permissions(uint8_t desired, uint8_t perms) {
+    return (desired & perms) == desired;
+}
+
+namespace permission {
+    constexpr uint8_t CREATE = 0b1000;
+    constexpr uint8_t READ = 0b0100;
+    constexpr uint8_t UPDATE = 0b0010;
+    constexpr uint8_t DELETE = 0b0001;
+};
+
+/* Parses "CRUD"-like strings (as printed by permissions_to_string) at compile time */
+consteval uint8_t permissions_from_string(std::string_view s) {
+    uint8_t result = 0;
+    for (char c : s) {
+        switch (c) {
+            case 'C': result |= permission::CREATE; break;
+            case 'R': result |= permission::READ; break;
+            case 'U': result |= permission::UPDATE; break;
+            case 'D': result |= permission::DELETE; break;
+            case '-': break;
+            default: throw "Invalid permission character";
+        }
+    }
+    return result;
+}
+
+/* Row per UserGroup, first column is instance permission followed by one column per field */
+template <typename M>
+using permissions_matrix_t = std::array<std::array<uint8_t, M::num_of_fields()+1>, num_of_user_groups>;
+
+template <typename M>
+consteval permissions_matrix_t<M> make_permissions_matrix(
+        const std::array<std::array<std::string_view, M::num_of_fields()+1>, num_of_user_groups> &strs) {
+    permissions_matrix_t<M> result{};
+    for (auto i=0u; i < num_of_user_groups; i++)
+        for (auto j=0u; j < M::num_of_fields()+1; j++)
+            result[i][j] = permissions_from_string(strs[i][j]);
+    return result;
+}
+
+/* Specialize with `static constexpr permissions_matrix_t<M> matrix` to make AuthorizedModelAccess
+ * use a compile-time permission policy instead of the <table>_permissions table */
+template <typename M>
+struct static_permissions;
+
+template <typename M>
+concept CStaticPermissions = requires {
+    { static_permissions<M>::matrix } -> std::convertible_to<permissions_matrix_t<M>>;
+};
+
+} // ns rs
+
+#endif // RS_PERMISSION_HPP
@@ -0,0 +1,170 @@
+#ifndef RS_PURGER_HPP
+#define RS_PURGER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+#include <soci/soci.h>
+#include <soci/connection-pool.h>
+
+#include "blobs.hpp"
+#include "static_files.hpp"
+#include "storage.hpp"
+#include "thumbnail_pack.hpp"
+#include "thumbnails.hpp"
+
+namespace rs {
+
+/* Removes users and photos marked as deleted (deleted_at column, see actions::mark_model_deleted_by_id)
+ * in the background, so DELETE requests only update a row. Photos of deleted users are marked first,
+ * then photos are removed with their files and blob references, and users once none of their photos are left.
+ * Work is done in batches with a pause in between to spread file system churn, requests wake it up with notify(). */
+class Purger {
+public:
+    static constexpr std::size_t default_batch_size = 100;
+    static constexpr auto batch_pause = std::chrono::milliseconds(50);
+    static constexpr auto idle_interval = std::chrono::seconds(30);
+
+private:
+    soci::connection_pool &m_db_pool;
+    ThumbnailCache &m_thumbnail_cache;
+    ThumbnailPack &m_thumbnail_pack;
+    FileDescriptorCache &m_files_cache;
+    std::size_t m_batch_size;
+
+    std::mutex m_mutex;
+    std::condition_variable_any m_cv;
+    bool m_notified = false;
+    std::jthread m_thread;
+
+    struct DeletedPhoto {
+        std::uint64_t id;
+        std::string extension;
+        std::string content_hash;
+    };
+
+    /* Marks photos of deleted users, returns whether there were any */
+    bool cascade_users(soci::session &db) {
+        soci::statement stmt = (db.prepare << fmt::format(
+            "UPDATE photos SET deleted_at = '{}', version = version + 1 WHERE deleted_at IS NULL AND uploaded_by IN "
+            "(SELECT id FROM users WHERE deleted_at IS NOT NULL)", rs::iso_date_time_now()));
+        stmt.execute(true);
+        return stmt.get_affected_rows() > 0;
+    }
+
+    /* Removes one batch of deleted photos, returns how many */
+    std::size_t purge_photos(soci::session &db) {
+        std::vector<DeletedPhoto> photos;
+        soci::rowset<soci::row> rows = (db.prepare << fmt::format(
+            "SELECT id, extension, COALESCE(content_hash, '') FROM photos WHERE deleted_at IS NOT NULL LIMIT {}", m_batch_size));
+        for (const auto &row : rows) {
+            photos.push_back({
+                static_cast<std::uint64_t>(row.get<long long>(0)),
+                row.get<std::string>(1),
+                row.get<std::string>(2)
+            });
+        }
+        if (photos.empty())
+            return 0;
+
+        std::vector<std::uint64_t> ids; ids.reserve(photos.size());
+        {
+            soci::transaction tr(db);
+            for (const auto &p : photos) {
+                if (!p.content_hash.empty()) /* removes blob files with the last reference, see POST /photos */
+                    blobs::release(db, p.content_hash);
+                ids.push_back(p.id);
+            }
+            db << fmt::format("DELETE FROM photos WHERE id IN ({})", fmt::join(ids, ","));
+            tr.commit();
+        }
+
+        for (const auto &p : photos) {
+            for (const auto &loc : {storage::photo(p.id, p.extension), storage::thumbnail(p.id)}) {
+                m_files_cache.invalidate(loc.path());
+                m_files_cache.invalidate(loc.legacy_path());
+                storage::remove(loc);
+            }
+            m_thumbnail_cache.erase_photo(p.id);
+            m_thumbnail_pack.erase(p.id);
+        }
+        return photos.size();
+    }
+
+    /* Removes one batch of deleted users without photos left, returns how many */
+    std::size_t purge_users(soci::session &db) {
+        std::vector<int> ids;
+        soci::rowset<int> rows = (db.prepare << fmt::format(
+            "SELECT id FROM users WHERE deleted_at IS NOT NULL "
+            "AND NOT EXISTS (SELECT 1 FROM photos WHERE uploaded_by = users.id) LIMIT {}", m_batch_size));
+        for (int id : rows) ids.push_back(id);
+        if (ids.empty())
+            return 0;
+
+        soci::transaction tr(db);
+        db << fmt::format("DELETE FROM auth_tokens WHERE user_id IN ({})", fmt::join(ids, ","));
+        db << fmt::format("DELETE FROM refresh_tokens WHERE user_id IN ({})", fmt::join(ids, ","));
+        db << fmt::format("DELETE FROM users WHERE id IN ({})", fmt::join(ids, ","));
+        tr.commit();
+        return ids.size();
+    }
+
+    /* One batch of work, returns whether there may be more */
+    bool purge_batch() {
+        soci::session db(m_db_pool);
+        const bool cascaded = cascade_users(db);
+        const auto photos = purge_photos(db);
+        const auto users = purge_users(db);
+        return cascaded || photos == m_batch_size || users == m_batch_size;
+    }
+
+    void purge_loop(std::stop_token stoken) {
+        bool more = true; /* rows left by the previous run */
+        while (!stoken.stop_requested()) {
+            {
+                std::unique_lock lock(m_mutex);
+                const std::chrono::milliseconds pause = more ? batch_pause : idle_interval;
+                m_cv.wait_for(lock, stoken, pause, [this] { return m_notified; });
+                if (stoken.stop_requested()) return;
+                m_notified = false;
+            }
+            try {
+                more = purge_batch();
+            } catch (const std::exception &e) {
+                fmt::print(stderr, "Purging deleted rows failed: {}\n", e.what());
+                more = false;
+            }
+        }
+    }
+
+public:
+    Purger(soci::connection_pool &db_pool, ThumbnailCache &thumbnail_cache, ThumbnailPack &thumbnail_pack,
+           FileDescriptorCache &files_cache, std::size_t batch_size = default_batch_size)
+        : m_db_pool(db_pool), m_thumbnail_cache(thumbnail_cache), m_thumbnail_pack(thumbnail_pack),
+          m_files_cache(files_cache), m_batch_size(batch_size)
+    {
+        m_thread = std::jthread([this](std::stop_token stoken) { purge_loop(stoken); });
+    }
+
+    Purger(const Purger&) = delete;
+    Purger &operator=(const Purger&) = delete;
+
+    /* Starts purging without waiting for idle_interval */
+    void notify() {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_notified = true;
+        }
+        m_cv.notify_one();
+    }
+};
+
+} // ns rs
+
+#endif // RS_PURGER_HPP
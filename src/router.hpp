@@ -4,7 +4,11 @@
 #include <restinio/router/easy_parser_router.hpp>
 #include <nlohmann/json.hpp>
 #include <boost/hana.hpp>
+#include "cors.hpp"
 #include "handler.hpp"
+#include "idempotency.hpp"
+#include "static_files.hpp"
+#include "static_responses.hpp"
 namespace hana = boost::hana;
 
 #include "utils.hpp"
@@ -29,20 +33,42 @@ public:
     std::vector<RouteInfo> registered_routes_info;
 
     std::unique_ptr<router_t> epr;
-    explicit Router(std::unique_ptr<router_t> &&router) : epr(std::move(router)) {}
 
-    template<typename MethodMatcher, typename RouteProducer, typename Handler>
-    void add_api_handler(MethodMatcher &&m, RouteProducer&& route, Handler &&handler) {
-        namespace epr = restinio::router::easy_parser_router;
+    /* Cached descriptors of files served by static_get routes */
+    FileDescriptorCache static_files_cache{1024};
+
+    /* Fixed content served by fixed_get routes and the not found handler */
+    StaticResponses static_responses;
+
+    /* Requests matching no route are CORS preflights when their method is OPTIONS, not found otherwise */
+    explicit Router(std::unique_ptr<router_t> &&router, CorsPolicy cors_policy = {}) : epr(std::move(router)) {
+        cors().configure(std::move(cors_policy));
+        static_responses.add("not_found", "application/json", rs::NotFoundError("Route not found").json().dump());
+        epr->non_matched_request_handler([this](const restinio::request_handle_t &req) {
+            if (req->header().method() == restinio::http_method_options())
+                return cors().preflight(req);
+            return static_responses.serve(req, "not_found", restinio::status_not_found());
+        });
+    }
 
-        auto url = hana::fold(route, []<typename F>(std::string &&s, const F &f) {
+    /* Handlers registered on epr refer to the router */
+    Router(const Router&) = delete;
+    Router &operator=(const Router&) = delete;
+
+    template<typename RouteProducer>
+    static std::string route_url(const RouteProducer &route) {
+        return hana::fold(route, []<typename F>(std::string &&s, const F &f) {
                 if constexpr (std::is_convertible_v<F, const char *>) {
                     return s.append(fmt::format("{}", f));
                 } else {
                     return s.append(fmt::format("{}{}{}", '{', rs::type_name<typename F::result_type>, '}'));
                 }
         });
+    }
 
+    template<typename RouteProducer>
+    static auto route_path_to_params(const RouteProducer &route) {
+       namespace epr = restinio::router::easy_parser_router;
        auto cfs = hana::transform(route, []<typename F>(const F& f) {
                if constexpr (std::is_convertible_v<F, const char *>) {
                    return std::string_view{f};
@@ -50,22 +76,67 @@ public:
                    return f;
                }
        });
+       return hana::unpack(cfs, [](auto ...xs) {
+                    return epr::path_to_params(xs...);
+       });
+    }
 
-       auto wrapped_handler = make_api_handler(std::forward<Handler>(handler));
+    template<typename MethodMatcher, typename RouteProducer, typename Handler>
+    void add_api_handler(MethodMatcher &&m, RouteProducer&& route, Handler &&handler, compression::Options compression = {}) {
+       auto wrapped_handler = make_api_handler(std::forward<Handler>(handler), compression);
        using wrapped_handler_t = decltype(wrapped_handler);
 
        registered_routes_info.push_back(
-           RouteInfo { std::move(url), m, wrapped_handler_t::request_params_model_t::get_description() }
+           RouteInfo { route_url(route), m, wrapped_handler_t::request_params_model_t::get_description() }
        );
 
-       this->epr->add_handler(std::forward<MethodMatcher>(m), hana::unpack(cfs, [](auto ...xs) {
-                    return epr::path_to_params(xs...);
-       }), std::move(wrapped_handler));
+       this->epr->add_handler(std::forward<MethodMatcher>(m), route_path_to_params(route), std::move(wrapped_handler));
+    }
+
+    /* GET route serving files with sendfile, resolver maps the request and route parameters to rs::StaticFile,
+     * returns nullopt if requested name is not valid or throws rs::Error if the caller may not read the file */
+    template<typename FoldableRoute, typename Resolver>
+    void static_get(FoldableRoute&& route, Resolver &&resolver) {
+       registered_routes_info.push_back(RouteInfo { route_url(route), restinio::http_method_get(), {} });
+
+       this->epr->add_handler(restinio::http_method_get(), route_path_to_params(route),
+           [this, resolver = std::forward<Resolver>(resolver)](const restinio::request_handle_t &req, auto&& ...params) {
+               std::optional<StaticFile> file;
+               try {
+                   file = resolver(req, params...);
+               } catch (const rs::Error &e) {
+                   return rs::respond_with_error(req, e);
+               } catch (const soci::soci_error &e) {
+                   return rs::respond_with_error(req, rs::DBError(e.get_error_message()));
+               }
+               if (!file)
+                   return rs::respond_with_error(req, rs::NotFoundError("File not found"));
+               return rs::serve_static_file(req, static_files_cache, *file);
+       });
     }
 
+    /* GET route serving static_responses entry name, which must be added before the server starts */
+    template<typename FoldableRoute>
+    void fixed_get(FoldableRoute&& route, std::string name) {
+       registered_routes_info.push_back(RouteInfo { route_url(route), restinio::http_method_get(), {} });
+       this->epr->add_handler(restinio::http_method_get(), route_path_to_params(route),
+           [this, name = std::move(name)](const restinio::request_handle_t &req, auto&& ...) {
+               return static_responses.serve(req, name);
+       });
+    }
+
+    /* GET route with plain restinio handler (request, route parameters...),
+     * for handlers which respond asynchronously and return restinio::request_accepted() */
+    template<typename FoldableRoute, typename Handler>
+    void raw_get(FoldableRoute&& route, Handler &&handler) {
+       registered_routes_info.push_back(RouteInfo { route_url(route), restinio::http_method_get(), {} });
+       this->epr->add_handler(restinio::http_method_get(), route_path_to_params(route), std::forward<Handler>(handler));
+    }
+
+    /* compression of responses is set per route, see compression::Options */
     template<typename FoldableRoute, typename Handler>
-    void api_get(FoldableRoute&& route, Handler &&handler) {
-        this->add_api_handler(restinio::http_method_get(), std::forward<FoldableRoute>(route), std::forward<Handler>(handler));
+    void api_get(FoldableRoute&& route, Handler &&handler, compression::Options compression = {}) {
+        this->add_api_handler(restinio::http_method_get(), std::forward<FoldableRoute>(route), std::forward<Handler>(handler), compression);
     }
 
     template<typename FoldableRoute, typename Handler>
@@ -73,6 +144,23 @@ public:
         this->add_api_handler(restinio::http_method_post(), std::forward<FoldableRoute>(route), std::forward<Handler>(handler));
     }
 
+    /* POST api route replaying responses of retries sent with the same Idempotency-Key, see IdempotencyStore */
+    template<typename FoldableRoute, typename Handler>
+    void idempotent_post(FoldableRoute &&route, IdempotencyStore &store, Handler &&handler) {
+       auto wrapped_handler = make_api_handler(std::forward<Handler>(handler));
+       using wrapped_handler_t = decltype(wrapped_handler);
+       auto url = route_url(route);
+
+       registered_routes_info.push_back(
+           RouteInfo { url, restinio::http_method_post(), wrapped_handler_t::request_params_model_t::get_description() }
+       );
+
+       this->epr->add_handler(restinio::http_method_post(), route_path_to_params(route),
+           [&store, url = std::move(url), wrapped_handler = std::move(wrapped_handler)](const restinio::request_handle_t &req, auto&& ...params) {
+               return store.run(req, url, [&](const reply_t &reply) { wrapped_handler.handle(reply, req, params...); });
+       });
+    }
+
     template<typename FoldableRoute, typename Handler>
     void api_head(FoldableRoute &&route, Handler &&handler) {
         this->add_api_handler(restinio::http_method_head(), std::forward<FoldableRoute>(route), std::forward<Handler>(handler));
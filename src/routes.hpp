@@ -2,37 +2,175 @@
 #define RS_ROUTES_HPP
 
 #include <restinio/router/easy_parser_router.hpp>
+#include <charconv>
 #include <filesystem>
+#include <thread>
 #include "router.hpp"
 #include "handler.hpp"
 #include "models.hpp"
 #include "utils.hpp"
 #include "actions.hpp"
 #include "user.hpp"
+#include "thumbnails.hpp"
+#include "blobs.hpp"
+#include "file_io.hpp"
+#include "uploads.hpp"
+#include "purger.hpp"
+#include "id_generator.hpp"
+#include "versions.hpp"
 
 namespace rs {
 
-inline void register_routes(rs::Router &router, soci::connection_pool &db_pool) 
+/* Splits "<id><extension>" photo file name, nullopt if it does not name a photo */
+inline std::optional<std::pair<std::uint64_t, std::string_view>> parse_photo_file_name(std::string_view name) {
+    std::uint64_t id = 0;
+    auto [ptr, ec] = std::from_chars(name.data(), name.data() + name.size(), id);
+    if (ec != std::errc{} || ptr == name.data()) return std::nullopt;
+    std::string_view extension(ptr, name.data() + name.size() - ptr);
+    if (!model::cnstr::ValidImageExtension::is_satisfied(std::string{extension})) return std::nullopt;
+    return std::pair{id, extension};
+}
+
+/* Content of an uploaded photo file, store puts it at the blob location when the content is new */
+struct UploadedContent {
+    std::string hash;
+    std::string extension;
+    std::size_t size;
+    std::function<void(const rs::storage::Location&)> store;
+};
+
+/* Inserts validated photo referencing uploaded content, shared by POST /photos and finished resumable uploads.
+ * Only new contents are stored and get their thumbnail rendered, duplicates link to the existing blob */
+inline nlohmann::json insert_uploaded_photo(soci::connection_pool &db_pool, rs::ThumbnailQueue &thumbnails, rs::ThumbnailPack &thumbnail_pack,
+                                            rs::model::Photo &&photo, const rs::model::AuthToken &auth_tok,
+                                            rs::ThumbnailQueue::Slot &&thumbnail_slot, const UploadedContent &content)
+{
+    const auto photo_id = static_cast<std::uint64_t>(*photo.id.opt_value);
+    const auto &hash = content.hash;
+    photo.content_hash.opt_value = hash;
+
+    /* renders thumbnail of the blob and packs it for every photo with this content. The worker has no one
+     * to report to, so a failed update (e.g. a locked db) is retried, photos would be pending forever otherwise */
+    auto render_job = [&db_pool, &thumbnail_pack, hash, photo_id](std::string_view blob_extension) {
+        const auto blob_thumbnail = rs::storage::blob_thumbnail(hash);
+        rs::storage::prepare(blob_thumbnail);
+        return rs::ThumbnailQueue::Job {
+            .photo_id = photo_id,
+            .source_path = rs::storage::blob(hash, blob_extension).existing_path(),
+            .thumbnail_path = blob_thumbnail.path(),
+            .on_done = [&db_pool, &thumbnail_pack, hash](const rs::ThumbnailQueue::Job&, bool success) {
+                constexpr int max_attempts = 5;
+                for (int attempt = 1; attempt <= max_attempts; attempt++) {
+                    std::optional<std::vector<std::uint64_t>> ids;
+                    try {
+                        soci::session db(db_pool);
+                        soci::transaction tr(db);
+                        /* the last attempt records a failure, a new upload of the content renders it again */
+                        ids = rs::blobs::record_thumbnail(db, hash, success && attempt < max_attempts);
+                        tr.commit();
+                    } catch (const std::exception &e) {
+                        fmt::print(stderr, "Recording thumbnail of {} failed (attempt {}): {}\n", hash, attempt, e.what());
+                        std::this_thread::sleep_for(std::chrono::milliseconds(200) * attempt);
+                        continue;
+                    }
+                    rs::blobs::store_thumbnail(thumbnail_pack, hash, ids);
+                    return;
+                }
+            }
+        };
+    };
+
+    soci::session db(db_pool);
+    std::optional<rs::ThumbnailQueue::Job> job;
+    soci::transaction tr(db);
+    auto blob = rs::blobs::acquire(db, hash, content.extension, content.size);
+    if (blob.is_new) {
+        const auto blob_file = rs::storage::blob(hash, content.extension);
+        if (!std::filesystem::exists(blob_file.path())) /* last copy was released after the caller's check */
+            content.store(blob_file);
+        job = render_job(content.extension);
+    } else if (blob.thumbnail_status == "failed") {
+        rs::blobs::retry_thumbnail(db, hash);
+        blob.thumbnail_status = "pending";
+        job = render_job(blob.extension);
+    }
+    /* packed thumbnails are referenced once the photo is committed */
+    const bool link_packed = blob.thumbnail_status == "ready" && thumbnail_pack.contains_blob(hash);
+    if (blob.thumbnail_status == "ready" && !link_packed)
+        rs::blobs::link(rs::storage::blob_thumbnail(hash), rs::storage::thumbnail(photo_id));
+    rs::blobs::link(rs::storage::blob(hash, blob.extension), rs::storage::photo(photo_id, content.extension));
+    photo.thumbnail_status.opt_value = blob.thumbnail_status;
+
+    rs::actions::insert_model_into_db(auth_tok, {.owner_field_name = "uploaded_by"}, db, "photos", std::move(photo));
+    tr.commit();
+
+    if (link_packed && !thumbnail_pack.link(photo_id, hash)) /* its last packed duplicate was deleted meanwhile */
+        job = render_job(blob.extension);
+    if (job.has_value()) // duplicates reuse the blob thumbnail, their slot is released unused
+        thumbnails.submit(std::move(thumbnail_slot), std::move(*job));
+    return rs::success_response(std::to_string(photo_id));
+}
+
+/* Id of the logged in user, resumable uploads are not available to guests */
+inline std::uint32_t upload_user_id(soci::connection_pool &db_pool, const rs::model::AuthToken &auth_tok) {
+    PermissionParams pp;
+    soci::session db(db_pool);
+    rs::grant_permission_params_from_auth_token(db, auth_tok, pp);
+    rs::throw_if<rs::UnauthorizedError>(!pp.user_id.has_value(), "Uploads require a logged in user");
+    return static_cast<std::uint32_t>(*pp.user_id);
+}
+
+/* Photo the caller of a static route may read as GET /photos/<id> decides: private ones only by their owner,
+ * deleted ones by nobody. Ids are ordered by time, so files can not rely on them being unguessable */
+inline std::optional<rs::model::Photo> readable_photo(soci::connection_pool &db_pool, const restinio::request_handle_t &req, std::uint64_t id) {
+    soci::session db(db_pool);
+    return rs::actions::get_readable_model_by_id<rs::model::Photo>(rs::request_auth_token(req),
+        {.owner_field_name = "uploaded_by", .private_field_name = "is_private", .deleted_field_name = "deleted_at"},
+        db, "photos", static_cast<std::int64_t>(id), "id,extension,is_private");
+}
+
+/* Private photos must not be kept by shared caches */
+inline const char * photo_cache_control(const rs::model::Photo &photo) {
+    return photo.is_private.opt_value.value_or(0) ? rs::private_cache_control : rs::static_cache_control;
+}
+
+inline void register_routes(rs::Router &router, soci::connection_pool &db_pool,
+                            rs::ThumbnailQueue &thumbnails, rs::ThumbnailCache &thumbnail_cache, rs::ThumbnailPack &thumbnail_pack,
+                            rs::FileIoService &file_io, rs::UploadSessions &uploads, rs::IdempotencyStore &idempotency, rs::Purger &purger,
+                            const rs::IdGenerator &ids)
 {
     namespace epr = restinio::router::easy_parser_router;
 
+    /* Per-route body limits, server wide limit is set by --max-body-size */
+    constexpr std::size_t max_photo_upload_size = 16 * 1024 * 1024;
+    constexpr std::size_t max_batch_body_size = 8 * 1024 * 1024;
+
+    /* Lists are the bulk of the traffic and compress well, worth more CPU than single records */
+    constexpr rs::compression::Options list_compression {.level = 9, .min_size = 512};
 
     router.api_get(std::make_tuple("/users"),
-        [&db_pool](rs::model::Empty&&, rs::model::AuthToken &&auth_tok) -> nlohmann::json {
+        [&db_pool](rs::model::Empty&&, rs::model::AuthToken &&auth_tok) -> std::vector<rs::model::User> {
             soci::session db(db_pool);
-            return rs::actions::get_models_from_db<rs::model::User>(std::move(auth_tok), {.owner_field_name = "id"}, db, "users");
-    });
+            return rs::actions::get_models_from_db<rs::model::User>(std::move(auth_tok), {.owner_field_name = "id", .deleted_field_name = "deleted_at"}, db, "users");
+    }, list_compression);
 
+    /* Polled clients send the ETag back in If-None-Match and get 304 after reading only the row version */
     router.api_get(std::make_tuple("/users/", epr::non_negative_decimal_number_p<std::uint32_t>()),
-        [&db_pool](rs::model::Empty&&, rs::model::AuthToken &&auth_tok, std::uint32_t id) -> nlohmann::json {
+        [&db_pool](rs::model::Empty&&, rs::model::AuthToken &&auth_tok, const restinio::request_handle_t &req, std::uint32_t id) -> rs::ApiResponse {
+            const rs::PermissionParams pp {.owner_field_name = "id", .deleted_field_name = "deleted_at", .version_field_name = "version"};
             soci::session db(db_pool);
-            auto vec = rs::actions::get_models_from_db<rs::model::User>(std::move(auth_tok),
-                           {.owner_field_name = "id"}, db, "users", "*", fmt::format("id = {}", id));
+            soci::transaction tr(db); // the row can not change between reading its version and fields
+            auto etag = rs::actions::get_model_etag_from_db<rs::model::User>(auth_tok, pp, db, "users", id);
+            rs::throw_if<rs::NotFoundError>(!etag.has_value(), "User with that id is not found");
+            if (auto inm = req->header().opt_value_of(restinio::http_field::if_none_match); inm && rs::etag_matches(*inm, rs::representation_etag(req, *etag)))
+                return rs::not_modified_response(std::move(*etag));
+            auto vec = rs::actions::get_models_from_db<rs::model::User>(std::move(auth_tok), pp, db, "users", "*", fmt::format("id = {}", id));
+            tr.commit();
             rs::throw_if<rs::NotFoundError>(vec.empty(), "User with that id is not found");
-            return vec.back();
+            return rs::model_response(std::move(vec.back()), std::move(*etag));
     });
 
-    router.api_post(std::make_tuple("/users"), 
+    router.idempotent_post(std::make_tuple("/users"), idempotency,
         [&db_pool](rs::model::User &&user, rs::model::AuthToken &&auth_tok) -> nlohmann::json {
             auto errs = user.get_unsatisfied_constraints().transform(rs::model::cnstr::get_description);
             rs::throw_if<rs::InvalidParamsError>(!errs.empty(), std::move(errs));
@@ -48,27 +186,72 @@ inline void register_routes(rs::Router &router, soci::connection_pool &db_pool)
             return rs::success_response("Registration sucessfully completed");
     });
 
+    router.epr->http_post(restinio::router::easy_parser_router::path_to_params("/users/batch"),
+        [&db_pool](const restinio::request_handle_t &req) {
+          return std::invoke(make_api_handler(
+               [&](rs::model::Empty&&, rs::model::AuthToken &&auth_tok) -> nlohmann::json {
+                   constexpr std::size_t max_batch_size = 1000;
+                   rs::throw_if_body_too_large(req, max_batch_body_size);
+                   auto json_users = rs::parse_json_array_body(req, max_batch_size);
+                   std::vector<rs::model::User> users; users.reserve(json_users.size());
+                   nlohmann::json err_msg;
+                   for (const auto &j : json_users) {
+                       // Constraints are checked before the move, Field keeps a reference to its own value
+                       rs::model::User user = j.get<rs::model::User>();
+                       auto errs = user.get_unsatisfied_constraints().transform(rs::model::cnstr::get_description);
+                       if (!errs.empty()) err_msg[std::to_string(users.size())] = std::move(errs);
+                       users.push_back(std::move(user));
+                   }
+                   rs::throw_if<rs::InvalidParamsError>(!err_msg.empty(), std::move(err_msg));
+
+                   soci::session db(db_pool);
+                   auto duplicates = rs::actions::check_uniquenes_in_db(db, "users", std::span<const rs::model::User>(users));
+                   for (auto i = 0u; i < duplicates.size(); i++)
+                       for (const auto &d : duplicates[i]) err_msg[std::to_string(i)][d] = "Already exist in db";
+                   rs::throw_if<rs::InvalidParamsError>(!err_msg.empty(), std::move(err_msg));
+
+                   const auto join_date = rs::iso_date_now();
+                   for (auto &user : users) {
+                       user.join_date.opt_value = join_date;
+                       user.permission_group.opt_value = static_cast<int32_t>(UserGroup::user);
+                   }
+                   const auto num_of_users = users.size();
+                   rs::actions::insert_models_into_db(std::move(auth_tok),
+                       {.owner_field_name = "id"}, db, "users", std::move(users));
+                   return rs::success_response(fmt::format("{} users sucessfully registered", num_of_users));
+               }
+           ), req);
+    });
+
+    /* With If-Match the user is updated only if it was not modified since the client read it */
     router.api_put(std::make_tuple("/users/", epr::non_negative_decimal_number_p<std::uint32_t>()),
-        [&db_pool](rs::model::User&& u, rs::model::AuthToken &&auth_tok, std::uint32_t id) -> nlohmann::json {
+        [&db_pool](rs::model::User&& u, rs::model::AuthToken &&auth_tok, const restinio::request_handle_t &req, std::uint32_t id) -> nlohmann::json {
             u.get_unsatisfied_constraints().transform(
                 []<model::cnstr::Cnstr C>() -> void {
                      if constexpr (std::is_same_v<C, model::cnstr::Required>) {}
                      else { throw InvalidParamsError(C::description); }
             });
-            u.id.opt_value = id;
+            u.id.opt_value.reset(); // the id is in the WHERE clause
             soci::session db(db_pool);
-            rs::actions::modify_models_in_db(std::move(auth_tok),
-                {.owner_field_name = "id"}, db, "users", fmt::format("id = {}", id), std::move(u));
+            rs::actions::modify_model_by_id_in_db(std::move(auth_tok),
+                {.owner_field_name = "id", .deleted_field_name = "deleted_at", .version_field_name = "version"}, db, "users", id, std::move(u),
+                rs::if_match_versions(req));
 
            return rs::success_response("User informations updated");
     });
 
+    /* The user is only marked as deleted and logged out, Purger removes the row with all photos of the user */
     router.api_delete(std::make_tuple("/users/", epr::non_negative_decimal_number_p<std::uint32_t>()),
-        [&db_pool](model::Empty&&, rs::model::AuthToken &&auth_tok, std::uint32_t id) -> nlohmann::json {
-            rs::model::User u { .id = {id} }; 
+        [&db_pool, &purger](model::Empty&&, rs::model::AuthToken &&auth_tok, const restinio::request_handle_t &req, std::uint32_t id) -> nlohmann::json {
             soci::session db(db_pool);
-            rs::actions::delete_models_from_db(std::move(auth_tok),
-                {.owner_field_name = "id"}, db, "users", fmt::format("id = {}", id), std::move(u));
+            soci::transaction tr(db);
+            rs::actions::mark_model_deleted_by_id<rs::model::User>(std::move(auth_tok),
+                {.owner_field_name = "id", .deleted_field_name = "deleted_at", .version_field_name = "version"}, db, "users", id,
+                rs::if_match_versions(req));
+            db << fmt::format("DELETE FROM auth_tokens WHERE user_id = {}", id);
+            db << fmt::format("DELETE FROM refresh_tokens WHERE user_id = {}", id);
+            tr.commit();
+            purger.notify();
 
            return rs::success_response(fmt::format("User with id {} deleted", id));
     });
@@ -81,34 +264,49 @@ inline void register_routes(rs::Router &router, soci::connection_pool &db_pool)
     });
 
     router.api_get(std::make_tuple("/photos"),
-        [&db_pool](rs::model::Empty&&, rs::model::AuthToken &&auth_tok) -> nlohmann::json {
+        [&db_pool](rs::model::Empty&&, rs::model::AuthToken &&auth_tok) -> std::vector<rs::model::Photo> {
             soci::session db(db_pool);
-            return rs::actions::get_models_from_db<rs::model::Photo>(std::move(auth_tok), {.owner_field_name = "uploaded_by"}, db, "photos");
-    });
+            return rs::actions::get_models_from_db<rs::model::Photo>(std::move(auth_tok), {.owner_field_name = "uploaded_by", .private_field_name = "is_private", .deleted_field_name = "deleted_at"}, db, "photos");
+    }, list_compression);
 
-    router.api_get(std::make_tuple("/photos/", epr::non_negative_decimal_number_p<std::uint32_t>()),
-        [&db_pool](rs::model::Empty&&, rs::model::AuthToken &&auth_tok, std::uint32_t photo_id) -> nlohmann::json {
+    router.api_get(std::make_tuple("/photos/", epr::non_negative_decimal_number_p<std::uint64_t>()),
+        [&db_pool](rs::model::Empty&&, rs::model::AuthToken &&auth_tok, const restinio::request_handle_t &req, std::uint64_t photo_id) -> rs::ApiResponse {
+            const rs::PermissionParams pp {.owner_field_name = "uploaded_by", .private_field_name = "is_private",
+                                           .deleted_field_name = "deleted_at", .version_field_name = "version"};
             soci::session db(db_pool);
-            return rs::actions::get_models_from_db<rs::model::Photo>(std::move(auth_tok), 
-                    {.owner_field_name = "uploaded_by"}, db, "photos", "*", fmt::format("id = {}", photo_id)).back();
+            soci::transaction tr(db);
+            auto etag = rs::actions::get_model_etag_from_db<rs::model::Photo>(auth_tok, pp, db, "photos", photo_id);
+            rs::throw_if<rs::NotFoundError>(!etag.has_value(), "Photo with that id is not found");
+            if (auto inm = req->header().opt_value_of(restinio::http_field::if_none_match); inm && rs::etag_matches(*inm, rs::representation_etag(req, *etag)))
+                return rs::not_modified_response(std::move(*etag));
+            auto vec = rs::actions::get_models_from_db<rs::model::Photo>(std::move(auth_tok), pp, db, "photos", "*", fmt::format("id = {}", photo_id));
+            tr.commit();
+            rs::throw_if<rs::NotFoundError>(vec.empty(), "Photo with that id is not found");
+            return rs::model_response(std::move(vec.back()), std::move(*etag));
     });
 
     router.api_get(std::make_tuple("/photos_by/", epr::non_negative_decimal_number_p<std::uint32_t>()),
-        [&db_pool](rs::model::Empty&&, rs::model::AuthToken &&auth_tok, std::uint32_t user_id) -> nlohmann::json {
+        [&db_pool](rs::model::Empty&&, rs::model::AuthToken &&auth_tok, std::uint32_t user_id) -> std::vector<rs::model::Photo> {
             soci::session db(db_pool);
             return rs::actions::get_models_from_db<rs::model::Photo>(std::move(auth_tok), 
-                    {.owner_field_name = "uploaded_by"}, db, "photos", "*", fmt::format("uploaded_by = {}", user_id));
-    });
+                    {.owner_field_name = "uploaded_by", .private_field_name = "is_private", .deleted_field_name = "deleted_at"}, db, "photos", "*", fmt::format("uploaded_by = {}", user_id));
+    }, list_compression);
 
+    /* The blob file of a new content is written asynchronously, the photo is inserted once it is on disk.
+     * Retries with the same Idempotency-Key get the response of the first request, see IdempotencyStore */
     router.epr->http_post(restinio::router::easy_parser_router::path_to_params("/photos"),
-        [&db_pool](const restinio::request_handle_t &req) {
-          return std::invoke(make_api_handler(
-               [&](rs::model::Empty&&, rs::model::AuthToken &&auth_tok) -> nlohmann::json {
-                   rs::model::Photo photo = rs::parse_json_field_multiform(req);
-                   auto infile = rs::parse_file_field_multiform(req);
+        [&db_pool, &thumbnails, &thumbnail_pack, &file_io, &idempotency, &ids](const restinio::request_handle_t &req) {
+          return idempotency.run(req, "/photos", [&](const rs::reply_t &reply) { make_api_handler(
+               [&](rs::model::Empty&&, rs::model::AuthToken &&auth_tok, const rs::reply_t &reply) {
+                   rs::throw_if_body_too_large(req, max_photo_upload_size);
+                   auto thumbnail_slot = thumbnails.try_reserve();
+                   rs::throw_if<rs::ServiceUnavailableError>(!thumbnail_slot.has_value(), "Too many photos are being processed");
+                   auto form = rs::parse_multiform(req);
+                   rs::model::Photo photo = *form.json;
+                   const auto &infile = *form.file;
                    photo.upload_time.opt_value = rs::iso_date_time_now();
                    photo.extension.opt_value = infile.file_extension;
-                   photo.id.opt_value = rs::randint();
+                   photo.id.opt_value = static_cast<long long>(ids.next());
                    PermissionParams pp;
                    soci::session db(db_pool);
                    rs::grant_permission_params_from_auth_token(db, auth_tok, pp); 
@@ -116,64 +314,254 @@ inline void register_routes(rs::Router &router, soci::connection_pool &db_pool)
                    auto errs = photo.get_unsatisfied_constraints().transform(rs::model::cnstr::get_description);
                    rs::throw_if<rs::InvalidParamsError>(!errs.empty(), std::move(errs));
 
-                   rs::store_file_to_disk("static/photos/", 
-                           std::to_string(*photo.id.opt_value) + *photo.extension.opt_value, infile.file_contents);
-
-                   auto cmd = fmt::format("convert -thumbnail 800x800 static/photos/{}{} static/photos/thumbnails/{}.jpg", 
-                                                 *photo.id.opt_value, *photo.extension.opt_value, *photo.id.opt_value);
-
+                   const auto extension = *photo.extension.opt_value;
+                   const auto contents = infile.file_contents; // refers to the request body, kept alive by req
+                   const auto hash = rs::blobs::sha256_hex(contents);
+
+                   struct PendingUpload {
+                       rs::model::Photo photo;
+                       rs::model::AuthToken auth_tok;
+                       rs::ThumbnailQueue::Slot thumbnail_slot;
+                   };
+                   auto upload = std::make_shared<PendingUpload>(PendingUpload{std::move(photo), std::move(auth_tok), std::move(*thumbnail_slot)});
+
+                   auto insert = [&db_pool, &thumbnails, &thumbnail_pack, upload, extension, contents, hash]() -> nlohmann::json {
+                       return insert_uploaded_photo(db_pool, thumbnails, thumbnail_pack, std::move(upload->photo), upload->auth_tok,
+                                                    std::move(upload->thumbnail_slot), {
+                           .hash = hash,
+                           .extension = extension,
+                           .size = contents.size(),
+                           .store = [contents](const rs::storage::Location &blob_file) { rs::storage::write(blob_file, contents); }
+                       });
+                   };
+
+                   /* Known contents are not written again. Blob files are removed inside the transaction
+                    * which drops the last reference, so insert() writes it again if that happens after this check */
+                   int known = 0;
+                   db << fmt::format("SELECT EXISTS(SELECT 1 FROM blobs WHERE hash = '{}')", hash), soci::into(known);
+                   if (known) {
+                       reply(rs::json_response(insert()));
+                       return;
+                   }
+
+                   const auto blob_file = rs::storage::blob(hash, extension);
+                   rs::storage::prepare(blob_file);
+                   file_io.write_file(blob_file.dir, blob_file.file_name, contents, [reply, insert](std::error_code ec) {
+                       try {
+                           rs::throw_if<rs::OtherError>(static_cast<bool>(ec), fmt::format("Photo could not be stored: {}", ec.message()));
+                           reply(rs::json_response(insert()));
+                       } catch (...) {
+                           reply(rs::exception_response(std::current_exception()));
+                       }
+                   });
+               }
+           ).handle(reply, req); });
+    });
 
-                   #pragma GCC diagnostic push
-                   #pragma GCC diagnostic ignored "-Wunused-result"
-                     std::system(cmd.c_str());
-                   #pragma GCC diagnostic pop
- 
-                   rs::actions::insert_model_into_db(auth_tok,
-                           {.owner_field_name = "uploaded_by"}, db, "photos", std::move(photo));
+    /* Resumable uploads: POST /uploads creates a session, chunks are sent in order with
+     * PATCH /uploads/<id> and Upload-Offset header, GET /uploads/<id> tells where to resume after a failure
+     * and POST /uploads/<id>/finish inserts the photo described by the json body */
+    router.api_post(std::make_tuple("/uploads"),
+        [&db_pool, &uploads](rs::model::UploadSession &&session, rs::model::AuthToken &&auth_tok) -> nlohmann::json {
+            auto errs = session.get_unsatisfied_constraints().transform(rs::model::cnstr::get_description);
+            rs::throw_if<rs::InvalidParamsError>(!errs.empty(), std::move(errs));
+            const auto user_id = upload_user_id(db_pool, auth_tok);
+            const auto size = static_cast<std::size_t>(*session.size.opt_value);
+            const auto id = uploads.create(user_id, *session.extension.opt_value, size);
+            return {{"upload_id", id}, {"offset", 0}, {"size", size}, {"max_chunk_size", rs::UploadSessions::max_chunk_size}};
+    });
 
-                   return rs::success_response(std::to_string(*photo.id.opt_value));
+    router.epr->add_handler(restinio::http_method_patch(),
+        restinio::router::easy_parser_router::path_to_params("/uploads/", epr::path_fragment_p()),
+        [&db_pool, &uploads, &file_io](const restinio::request_handle_t &req, const std::string &upload_id) {
+          return std::invoke(make_api_handler(
+               [&](rs::model::Empty&&, rs::model::AuthToken &&auth_tok, const rs::reply_t &reply) {
+                   std::size_t offset = 0;
+                   const auto header = req->header().opt_value_of("Upload-Offset");
+                   rs::throw_if<rs::InvalidParamsError>(!header.has_value(), "Upload-Offset header is required");
+                   auto [ptr, ec] = std::from_chars(header->data(), header->data() + header->size(), offset);
+                   rs::throw_if<rs::InvalidParamsError>(ec != std::errc{} || ptr != header->data() + header->size(),
+                                                        "Upload-Offset must be a number");
+                   const auto user_id = upload_user_id(db_pool, auth_tok);
+                   /* the chunk refers to the request body, kept alive by reply */
+                   uploads.append(upload_id, user_id, offset, req->body(), file_io, [reply](std::error_code ec, std::size_t received) {
+                       if (ec)
+                           reply(rs::exception_response(std::make_exception_ptr(rs::OtherError("Chunk could not be stored"))));
+                       else
+                           reply(rs::json_response({{"offset", received}}));
+                   });
                }
            ), req);
     });
 
-    router.api_put(std::make_tuple("/photos/", epr::non_negative_decimal_number_p<std::uint32_t>()),
-        [&db_pool](rs::model::Photo&& p, rs::model::AuthToken &&auth_tok, std::uint32_t id) -> nlohmann::json {
+    router.api_get(std::make_tuple("/uploads/", epr::path_fragment_p()),
+        [&db_pool, &uploads](rs::model::Empty&&, rs::model::AuthToken &&auth_tok, const std::string &upload_id) -> nlohmann::json {
+            const auto status = uploads.status(upload_id, upload_user_id(db_pool, auth_tok));
+            return {{"offset", status.offset}, {"size", status.size}, {"extension", status.extension}};
+    });
+
+    router.api_delete(std::make_tuple("/uploads/", epr::path_fragment_p()),
+        [&db_pool, &uploads](rs::model::Empty&&, rs::model::AuthToken &&auth_tok, const std::string &upload_id) -> nlohmann::json {
+            uploads.cancel(upload_id, upload_user_id(db_pool, auth_tok));
+            return rs::success_response("Upload cancelled");
+    });
+
+    router.idempotent_post(std::make_tuple("/uploads/", epr::path_fragment_p(), "/finish"), idempotency,
+        [&db_pool, &thumbnails, &thumbnail_pack, &uploads, &file_io, &ids]
+        (rs::model::Photo &&photo, rs::model::AuthToken &&auth_tok, const std::string &upload_id) -> nlohmann::json {
+            const auto user_id = upload_user_id(db_pool, auth_tok);
+            auto thumbnail_slot = thumbnails.try_reserve();
+            rs::throw_if<rs::ServiceUnavailableError>(!thumbnail_slot.has_value(), "Too many photos are being processed");
+            /* validated before the session ends, a rejected photo can be corrected and sent again */
+            photo.upload_time.opt_value = rs::iso_date_time_now();
+            photo.extension.opt_value = uploads.status(upload_id, user_id).extension;
+            photo.id.opt_value = static_cast<long long>(ids.next());
+            photo.uploaded_by.opt_value = user_id;
+            auto errs = photo.get_unsatisfied_constraints().transform(rs::model::cnstr::get_description);
+            rs::throw_if<rs::InvalidParamsError>(!errs.empty(), std::move(errs));
+
+            auto finished = uploads.finish(upload_id, user_id);
+            /* staging file is renamed into blob storage when the content is new, removed otherwise */
+            auto remove_staging = [&file_io, path = finished.path]() {
+                file_io.remove({path}, [](std::error_code) {});
+            };
+            try {
+                auto resp = insert_uploaded_photo(db_pool, thumbnails, thumbnail_pack, std::move(photo), auth_tok, std::move(*thumbnail_slot), {
+                    .hash = finished.hash,
+                    .extension = finished.extension,
+                    .size = finished.size,
+                    .store = [&finished](const rs::storage::Location &blob_file) {
+                        rs::storage::prepare(blob_file);
+                        std::filesystem::rename(finished.path, blob_file.path());
+                    }
+                });
+                remove_staging();
+                return resp;
+            } catch (...) {
+                remove_staging();
+                throw;
+            }
+    });
+
+    /* <id>.jpg is the thumbnail rendered at upload, <id>_<size>.<jpg|webp> variants are rendered on first request */
+    router.raw_get(std::make_tuple("/static/photos/thumbnails/", epr::path_fragment_p()),
+        [&db_pool, &thumbnails, &thumbnail_cache, &thumbnail_pack, &files_cache = router.static_files_cache]
+        (const restinio::request_handle_t &req, const std::string &name) {
+            auto requested = parse_photo_file_name(name);
+            auto variant = requested && requested->second == ".jpg" ? std::nullopt : rs::ThumbnailVariant::parse(name);
+            if (!variant && !(requested && requested->second == ".jpg"))
+                return rs::respond_with_error(req, rs::NotFoundError("File not found"));
+
+            try {
+                const auto photo = readable_photo(db_pool, req, variant ? variant->photo_id : requested->first);
+                if (!photo)
+                    return rs::respond_with_error(req, rs::NotFoundError("Photo not found"));
+                const char * cache_control = photo_cache_control(*photo);
+
+                if (!variant) {
+                    const auto etag = fmt::format("\"t{}\"", requested->first);
+                    if (auto not_modified = rs::respond_if_not_modified(req, etag, cache_control))
+                        return *not_modified;
+                    if (auto slice = thumbnail_pack.open(requested->first))
+                        return rs::serve_file_slice(req, *slice, etag, "image/jpeg", cache_control);
+                    const auto loc = rs::storage::thumbnail(requested->first);
+                    return rs::serve_static_file(req, files_cache, {
+                        .path = loc.path(),
+                        .legacy_path = loc.legacy_path(),
+                        .etag = etag,
+                        .content_type = "image/jpeg",
+                        .cache_control = cache_control
+                    });
+                }
+
+                const auto loc = rs::ThumbnailCache::location_of(name);
+                rs::StaticFile file {
+                    .path = loc.path(),
+                    .legacy_path = loc.legacy_path(),
+                    .etag = fmt::format("\"t{}\"", name),
+                    .content_type = variant->content_type(),
+                    .cache_control = cache_control
+                };
+                /* Requests joining a render in progress need no queue slot, only the first one reserves it */
+                const auto lookup = thumbnail_cache.lookup(name, [req, file, &files_cache](rs::ThumbnailCache::Result result) {
+                    switch (result) {
+                        case rs::ThumbnailCache::Result::ready: rs::serve_static_file(req, files_cache, file); break;
+                        case rs::ThumbnailCache::Result::busy:
+                            rs::respond_with_error(req, rs::ServiceUnavailableError("Too many thumbnails are being rendered")); break;
+                        default: rs::respond_with_error(req, rs::OtherError("Thumbnail could not be rendered"));
+                    }
+                });
+                if (lookup == rs::ThumbnailCache::Lookup::cached)
+                    return rs::serve_static_file(req, files_cache, file);
+                if (lookup == rs::ThumbnailCache::Lookup::render) {
+                    auto slot = thumbnails.try_reserve();
+                    if (!slot) {
+                        thumbnail_cache.abandon(name);
+                        return restinio::request_accepted();
+                    }
+                    try {
+                        rs::storage::prepare(loc);
+                        thumbnails.submit(std::move(*slot), {
+                            .photo_id = variant->photo_id,
+                            .source_path = rs::storage::photo(variant->photo_id, *photo->extension.opt_value).existing_path(),
+                            .thumbnail_path = loc.path(),
+                            .box = {variant->size, variant->size},
+                            .format = variant->format,
+                            .on_done = [&thumbnail_cache, name](const rs::ThumbnailQueue::Job&, bool success) {
+                                thumbnail_cache.complete(name, success);
+                            }
+                        });
+                    } catch (...) {
+                        thumbnail_cache.complete(name, false); // waiters, this request included, get the error
+                    }
+                }
+                return restinio::request_accepted();
+            } catch (const rs::Error &e) {
+                return rs::respond_with_error(req, e);
+            } catch (const soci::soci_error &e) {
+                return rs::respond_with_error(req, rs::DBError(e.get_error_message()));
+            }
+    });
+
+    router.static_get(std::make_tuple("/static/photos/", epr::path_fragment_p()),
+        [&db_pool](const restinio::request_handle_t &req, const std::string &name) -> std::optional<rs::StaticFile> {
+            auto photo = parse_photo_file_name(name);
+            if (!photo) return std::nullopt;
+            auto row = readable_photo(db_pool, req, photo->first);
+            if (!row || *row->extension.opt_value != photo->second) return std::nullopt;
+            const auto loc = rs::storage::photo(photo->first, photo->second);
+            return rs::StaticFile {
+                .path = loc.path(),
+                .legacy_path = loc.legacy_path(),
+                .etag = fmt::format("\"p{}{}\"", photo->first, photo->second),
+                .content_type = rs::image_content_type(photo->second),
+                .cache_control = photo_cache_control(*row)
+            };
+    });
+
+    router.api_put(std::make_tuple("/photos/", epr::non_negative_decimal_number_p<std::uint64_t>()),
+        [&db_pool](rs::model::Photo&& p, rs::model::AuthToken &&auth_tok, const restinio::request_handle_t &req, std::uint64_t id) -> nlohmann::json {
             p.get_unsatisfied_constraints().transform(
                 []<model::cnstr::Cnstr C>() -> void {
                      if constexpr (std::is_same_v<C, model::cnstr::Required>) {}
                      else { throw InvalidParamsError(C::description); }
             });
-            p.id.opt_value = id;
-
             soci::session db(db_pool);
-            auto vec = rs::actions::get_models_from_db<rs::model::Photo>(std::move(auth_tok), 
-                    {.owner_field_name = "uploaded_by"}, db, "photos", "uploaded_by", fmt::format("id = {}", id));
-
-            throw_if<InvalidParamsError>(vec.empty(), "Photo with that id does not exist");
-            p.uploaded_by.opt_value = vec.back().uploaded_by.opt_value;
-
-            rs::actions::modify_models_in_db(std::move(auth_tok),
-                {.owner_field_name = "uploaded_by"}, db, "photos", fmt::format("id = {}", id), std::move(p));
+            rs::actions::modify_model_by_id_in_db(std::move(auth_tok),
+                {.owner_field_name = "uploaded_by", .deleted_field_name = "deleted_at", .version_field_name = "version"}, db, "photos", id, std::move(p),
+                rs::if_match_versions(req));
 
             return rs::success_response("Photo informations updated");
     });
 
-    router.api_delete(std::make_tuple("/photos/", epr::non_negative_decimal_number_p<std::uint32_t>()),
-        [&db_pool](model::Empty&&, rs::model::AuthToken &&auth_tok, std::uint32_t id) -> nlohmann::json {
-            model::Photo p { .id = {id} }; 
+    /* The photo is only marked as deleted, Purger removes its files and row in the background */
+    router.api_delete(std::make_tuple("/photos/", epr::non_negative_decimal_number_p<std::uint64_t>()),
+        [&db_pool, &purger](model::Empty&&, rs::model::AuthToken &&auth_tok, const restinio::request_handle_t &req, std::uint64_t id) -> nlohmann::json {
             soci::session db(db_pool);
-            auto vec = rs::actions::get_models_from_db<rs::model::Photo>(std::move(auth_tok), 
-                    {.owner_field_name = "uploaded_by"}, db, "photos", "uploaded_by,extension", fmt::format("id = {}", id));
-
-            throw_if<InvalidParamsError>(vec.empty(), "Photo with that id does not exist");
-            model::Photo db_photo = std::move(vec.back());
-            p.uploaded_by.opt_value = db_photo.uploaded_by.opt_value;
-
-            std::filesystem::remove(fmt::format("static/photos/{}{}", id, *db_photo.extension.opt_value));
-            std::filesystem::remove(fmt::format("static/photos/thumbnails/{}.jpg", id));
-
-            rs::actions::delete_models_from_db(std::move(auth_tok),
-                {.owner_field_name = "uploaded_by"}, db, "photos", fmt::format("id = {}", id), std::move(p));
+            rs::actions::mark_model_deleted_by_id<rs::model::Photo>(std::move(auth_tok),
+                {.owner_field_name = "uploaded_by", .deleted_field_name = "deleted_at", .version_field_name = "version"}, db, "photos", id,
+                rs::if_match_versions(req));
+            purger.notify();
 
             return rs::success_response(fmt::format("Photo with id {} deleted", id));
     });
@@ -0,0 +1,248 @@
+#ifndef RS_STATIC_FILES_HPP
+#define RS_STATIC_FILES_HPP
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <restinio/all.hpp>
+#include <restinio/sendfile.hpp>
+
+#include "connections.hpp"
+#include "errors.hpp"
+#include "static_responses.hpp"
+
+namespace rs {
+
+constexpr const char * static_cache_control = "public, max-age=31536000, immutable";
+constexpr const char * private_cache_control = "private, max-age=31536000, immutable"; // not kept by shared caches
+
+/* File to be served by a static route, resolved from the requested path fragment */
+struct StaticFile {
+    std::string path;
+    std::string legacy_path {}; // tried when path does not exist, see storage.hpp
+    std::string etag; // strong ETag including quotes
+    const char * content_type;
+    const char * cache_control = static_cache_control;
+};
+
+/* Bounded LRU cache of open file descriptors for immutable files.
+ * Callers get their own dup() of the cached descriptor, which restinio closes after sending */
+class FileDescriptorCache {
+    struct Entry {
+        int fd;
+        restinio::file_meta_t meta;
+        std::list<std::string>::iterator lru_it;
+    };
+
+    std::size_t m_capacity;
+    std::mutex m_mutex;
+    std::list<std::string> m_lru;
+    std::unordered_map<std::string, Entry> m_entries;
+
+    /* Throws OtherError when the process runs out of descriptors */
+    static int dup_checked(int fd) {
+        int copy = ::dup(fd);
+        if (copy < 0) throw OtherError(fmt::format("Can not duplicate file descriptor: {}", std::strerror(errno)));
+        return copy;
+    }
+
+    void evict_one() {
+        auto it = m_entries.find(m_lru.back());
+        ::close(it->second.fd);
+        m_entries.erase(it);
+        m_lru.pop_back();
+    }
+
+public:
+    explicit FileDescriptorCache(std::size_t capacity) : m_capacity(capacity) {}
+    FileDescriptorCache(const FileDescriptorCache&) = delete;
+    FileDescriptorCache& operator=(const FileDescriptorCache&) = delete;
+
+    ~FileDescriptorCache() {
+        for (auto &[path, e] : m_entries)
+            ::close(e.fd);
+    }
+
+    /* Returns duplicated descriptor and metadata, nullopt if file does not exist.
+     * Throws OtherError if the descriptor can not be duplicated */
+    std::optional<std::pair<int, restinio::file_meta_t>> open(const std::string &path) {
+        std::scoped_lock lock(m_mutex);
+        if (auto it = m_entries.find(path); it != m_entries.end()) {
+            m_lru.splice(m_lru.begin(), m_lru, it->second.lru_it);
+            return std::pair{dup_checked(it->second.fd), it->second.meta};
+        }
+
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return std::nullopt;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            return std::nullopt;
+        }
+        restinio::file_meta_t meta{static_cast<restinio::file_size_t>(st.st_size),
+                                   std::chrono::system_clock::from_time_t(st.st_mtime)};
+
+        int copy = ::dup(fd);
+        if (copy < 0) {
+            ::close(fd);
+            throw OtherError(fmt::format("Can not duplicate file descriptor: {}", std::strerror(errno)));
+        }
+        if (m_entries.size() >= m_capacity) evict_one();
+        m_lru.push_front(path);
+        m_entries.emplace(path, Entry{fd, meta, m_lru.begin()});
+        return std::pair{copy, meta};
+    }
+
+    /* Must be called when a cached file is removed or replaced */
+    void invalidate(const std::string &path) {
+        std::scoped_lock lock(m_mutex);
+        if (auto it = m_entries.find(path); it != m_entries.end()) {
+            ::close(it->second.fd);
+            m_lru.erase(it->second.lru_it);
+            m_entries.erase(it);
+        }
+    }
+};
+
+struct ByteRange {
+    restinio::file_size_t offset;
+    restinio::file_size_t size;
+};
+
+/* Parses single range "bytes=a-b", "bytes=a-" or "bytes=-n". Multiple ranges are not supported
+ * and yield nullopt (whole file is sent), unsatisfiable range yields size 0 */
+std::optional<ByteRange> parse_byte_range(std::string_view value, restinio::file_size_t file_size) {
+    constexpr std::string_view prefix = "bytes=";
+    if (!value.starts_with(prefix) || value.find(',') != std::string_view::npos) return std::nullopt;
+    value.remove_prefix(prefix.size());
+    const auto dash = value.find('-');
+    if (dash == std::string_view::npos) return std::nullopt;
+
+    auto to_number = [](std::string_view s) -> std::optional<restinio::file_size_t> {
+        restinio::file_size_t n = 0;
+        auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+        if (ec != std::errc{} || ptr != s.data() + s.size()) return std::nullopt;
+        return n;
+    };
+
+    const auto first = value.substr(0, dash), last = value.substr(dash + 1);
+    if (first.empty()) /* suffix range */ {
+        auto n = to_number(last);
+        if (!n) return std::nullopt;
+        n = std::min(*n, file_size);
+        return ByteRange{file_size - *n, *n};
+    }
+
+    auto from = to_number(first);
+    if (!from) return std::nullopt;
+    if (*from >= file_size) return ByteRange{0, 0};
+    auto to = last.empty() ? std::optional{file_size - 1} : to_number(last);
+    if (!to || *to < *from) return std::nullopt;
+    return ByteRange{*from, std::min(*to, file_size - 1) - *from + 1};
+}
+
+/* Sends error as problem+json, for handlers that do not go through make_api_handler */
+restinio::request_handling_status_t respond_with_error(const restinio::request_handle_t &req, const rs::Error &error) {
+    auto resp = req->create_response(error.status());
+    resp.append_header(restinio::http_field::content_type, "application/problem+json");
+    return connections().apply(req, resp, error.status())
+               .set_body(error.json().dump())
+               .done();
+}
+
+/* Part of an open file to be sent, whole file for plain static files. fd is owned by the response */
+struct FileSlice {
+    int fd;
+    restinio::file_meta_t meta;
+    restinio::file_size_t offset;
+    restinio::file_size_t size;
+};
+
+/* 304 response if the client already has the representation with etag, see etag_matches */
+std::optional<restinio::request_handling_status_t> respond_if_not_modified(const restinio::request_handle_t &req, const std::string &etag,
+                                                                           const char * cache_control = static_cache_control) {
+    auto inm = req->header().opt_value_of(restinio::http_field::if_none_match);
+    if (!inm || !etag_matches(*inm, etag))
+        return std::nullopt;
+    auto resp = req->create_response(restinio::status_not_modified());
+    resp.append_header(restinio::http_field::etag, etag)
+        .append_header(restinio::http_field::cache_control, cache_control);
+    return connections().apply(req, resp, restinio::status_not_modified()).done();
+}
+
+/* Sends slice with sendfile(), honoring Range header relative to the slice */
+restinio::request_handling_status_t serve_file_slice(const restinio::request_handle_t &req, const FileSlice &slice,
+                                                     const std::string &etag, const char * content_type,
+                                                     const char * cache_control = static_cache_control) {
+    std::optional<ByteRange> range;
+    if (auto range_header = req->header().opt_value_of(restinio::http_field::range))
+        range = parse_byte_range(*range_header, slice.size);
+
+    if (range && range->size == 0) {
+        ::close(slice.fd);
+        auto resp = req->create_response(restinio::status_requested_range_not_satisfiable());
+        resp.append_header(restinio::http_field::content_range, fmt::format("bytes */{}", slice.size));
+        return connections().apply(req, resp, restinio::status_requested_range_not_satisfiable()).done();
+    }
+
+    auto sf = restinio::sendfile(restinio::file_descriptor_holder_t{slice.fd}, slice.meta);
+    const auto status = range ? restinio::status_partial_content() : restinio::status_ok();
+    auto resp = req->create_response(status);
+    connections().apply(req, resp, status);
+    resp.append_header(restinio::http_field::content_type, content_type)
+        .append_header(restinio::http_field::etag, etag)
+        .append_header(restinio::http_field::cache_control, cache_control)
+        .append_header(restinio::http_field::accept_ranges, "bytes");
+
+    if (range) {
+        sf.offset_and_size(slice.offset + range->offset, range->size);
+        resp.append_header(restinio::http_field::content_range,
+                           fmt::format("bytes {}-{}/{}", range->offset, range->offset + range->size - 1, slice.size));
+    } else {
+        sf.offset_and_size(slice.offset, slice.size);
+    }
+
+    return resp.set_body(std::move(sf)).done();
+}
+
+/* Sends file with sendfile(), honoring If-None-Match and Range headers */
+restinio::request_handling_status_t serve_static_file(const restinio::request_handle_t &req, FileDescriptorCache &cache, const StaticFile &file) {
+    if (auto not_modified = respond_if_not_modified(req, file.etag, file.cache_control))
+        return *not_modified;
+
+    std::optional<std::pair<int, restinio::file_meta_t>> opened;
+    try {
+        opened = cache.open(file.path);
+        if (!opened && !file.legacy_path.empty()) {
+            opened = cache.open(file.legacy_path);
+            if (!opened) opened = cache.open(file.path); // moved by migration in between
+        }
+    } catch (const rs::Error &e) {
+        return respond_with_error(req, e);
+    }
+    if (!opened)
+        return respond_with_error(req, rs::NotFoundError("File not found"));
+    auto [fd, meta] = *opened;
+    return serve_file_slice(req, {fd, meta, 0, meta.size()}, file.etag, file.content_type, file.cache_control);
+}
+
+constexpr const char * image_content_type(std::string_view extension) {
+    if (extension == ".png") return "image/png";
+    if (extension == ".gif") return "image/gif";
+    if (extension == ".bmp") return "image/bmp";
+    return "image/jpeg";
+}
+
+} // ns rs
+
+#endif // RS_STATIC_FILES_HPP
@@ -0,0 +1,101 @@
+#ifndef RS_STATIC_RESPONSES_HPP
+#define RS_STATIC_RESPONSES_HPP
+
+#include <zlib.h>
+
+#include <map>
+#include <string>
+#include <string_view>
+
+#include <fmt/format.h>
+#include <restinio/all.hpp>
+
+#include "compression.hpp"
+#include "connections.hpp"
+#include "cors.hpp"
+
+namespace rs {
+
+/* Whether If-None-Match header value (a list of ETags or "*") matches etag, weak comparison */
+bool etag_matches(std::string_view header, std::string_view etag) {
+    auto opaque = [](std::string_view tag) { return tag.starts_with("W/") ? tag.substr(2) : tag; };
+    while (!header.empty()) {
+        const auto comma = header.find(',');
+        auto tag = header.substr(0, comma);
+        header = comma == std::string_view::npos ? std::string_view{} : header.substr(comma + 1);
+        while (!tag.empty() && tag.front() == ' ') tag.remove_prefix(1);
+        while (!tag.empty() && tag.back() == ' ') tag.remove_suffix(1);
+        if (tag == "*" || opaque(tag) == opaque(etag)) return true;
+    }
+    return false;
+}
+
+/* Responses with fixed content (API reference, shared error bodies), rendered once at startup with their
+ * ETag and a gzip copy when it is smaller. Bodies are sent straight from the registry without copying,
+ * so entries must be added before the server starts and never changed while it runs. */
+class StaticResponses {
+    /* compressing tiny bodies does not pay off */
+    static constexpr std::size_t min_gzip_size = 256;
+
+    struct Entry {
+        std::string content_type;
+        std::string body;
+        std::string gzip_body; // empty if not worth it
+        std::string etag;
+    };
+
+    std::map<std::string, Entry, std::less<>> m_entries;
+
+public:
+    StaticResponses() = default;
+    StaticResponses(const StaticResponses&) = delete;
+    StaticResponses &operator=(const StaticResponses&) = delete;
+
+    void add(std::string name, std::string content_type, std::string body) {
+        Entry e{std::move(content_type), std::move(body), {}, {}};
+        const auto crc = ::crc32(::crc32(0, nullptr, 0), reinterpret_cast<const Bytef*>(e.body.data()), static_cast<uInt>(e.body.size()));
+        e.etag = fmt::format("\"s{:08x}{:x}\"", crc, e.body.size());
+        if (e.body.size() >= min_gzip_size)
+            if (auto gz = compression::gzip(e.body); gz && gz->size() < e.body.size())
+                e.gzip_body = std::move(*gz);
+        m_entries.insert_or_assign(std::move(name), std::move(e));
+    }
+
+    [[nodiscard]] bool contains(std::string_view name) const { return m_entries.find(name) != m_entries.end(); }
+
+    /* Sends response name, 304 to a successful one the client already has. Clients revalidate with
+     * If-None-Match as contents change between server versions */
+    restinio::request_handling_status_t serve(const restinio::request_handle_t &req, std::string_view name,
+                                              restinio::http_status_line_t status = restinio::status_ok()) const {
+        const auto &e = m_entries.find(name)->second;
+        const bool cacheable = status.status_code() == restinio::status_code::ok;
+        if (cacheable)
+            if (auto inm = req->header().opt_value_of(restinio::http_field::if_none_match); inm && etag_matches(*inm, e.etag)) {
+                auto resp = req->create_response(restinio::status_not_modified());
+                resp.append_header(restinio::http_field::etag, e.etag)
+                    .append_header(restinio::http_field::cache_control, "no-cache");
+                cors().apply(req, resp);
+                return connections().apply(req, resp, restinio::status_not_modified()).done();
+            }
+
+        const bool gzip = !e.gzip_body.empty() && compression::accepts(req, "gzip");
+        auto resp = req->create_response(status);
+        resp.append_header(restinio::http_field::content_type, e.content_type);
+        cors().apply(req, resp);
+        connections().apply(req, resp, status);
+        if (cacheable)
+            resp.append_header(restinio::http_field::etag, e.etag)
+                .append_header(restinio::http_field::cache_control, "no-cache");
+        if (!e.gzip_body.empty())
+            resp.append_header(restinio::http_field::vary, "Accept-Encoding");
+        if (gzip)
+            resp.append_header(restinio::http_field::content_encoding, "gzip");
+        return resp.set_body(restinio::const_buffer(gzip ? e.gzip_body.data() : e.body.data(),
+                                                    gzip ? e.gzip_body.size() : e.body.size()))
+                   .done();
+    }
+};
+
+} // ns rs
+
+#endif // RS_STATIC_RESPONSES_HPP
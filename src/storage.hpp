@@ -0,0 +1,100 @@
+#ifndef RS_STORAGE_HPP
+#define RS_STORAGE_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+#include <fmt/format.h>
+
+#include "utils.hpp"
+
+/* Location of every file under static/photos. Files are fanned out into two levels of
+ * 256 directories (static/photos/3f/a2/<id><ext>) so no directory grows with the number of photos.
+ * Files written before sharding stay at their flat legacy path until rs-migrate-storage moves them,
+ * readers try the sharded path first and fall back to the legacy one. */
+namespace rs::storage {
+
+constexpr const char * photos_dir = "static/photos";
+constexpr const char * thumbnails_dir = "static/photos/thumbnails";
+constexpr const char * blobs_dir = "static/photos/blobs";
+constexpr const char * blob_thumbnails_dir = "static/photos/thumbnails/blobs";
+constexpr const char * thumbnail_packs_dir = "static/photos/thumbnails/packs";
+/* staging files of resumable uploads, on the blobs file system so finished ones are renamed into place */
+constexpr const char * uploads_dir = "static/photos/uploads";
+
+struct Location {
+    std::string dir;         // sharded directory
+    std::string file_name;
+    std::string legacy_dir;  // flat directory used before sharding
+
+    [[nodiscard]] std::string path() const { return fmt::format("{}/{}", dir, file_name); }
+    [[nodiscard]] std::string legacy_path() const { return fmt::format("{}/{}", legacy_dir, file_name); }
+
+    /* Path the file currently exists at, sharded one if it exists at neither */
+    [[nodiscard]] std::string existing_path() const {
+        std::error_code ec;
+        auto p = path();
+        if (std::filesystem::exists(p, ec)) return p;
+        auto lp = legacy_path();
+        return std::filesystem::exists(lp, ec) ? lp : p;
+    }
+};
+
+/* Ids are mixed first so sequential ids do not end up in the same directory.
+ * Folding keeps the directories of ids below 2^32 written before 64 bit ids */
+std::string shard(std::uint64_t id) {
+    auto h = static_cast<std::uint32_t>(id ^ (id >> 32));
+    h ^= h >> 16; h *= 0x7feb352d;
+    h ^= h >> 15; h *= 0x846ca68b;
+    h ^= h >> 16;
+    return fmt::format("{:02x}/{:02x}", h >> 24, (h >> 16) & 0xff);
+}
+
+/* Content hashes are uniformly distributed already */
+std::string shard(std::string_view hash) {
+    return fmt::format("{}/{}", hash.substr(0, 2), hash.substr(2, 2));
+}
+
+Location photo(std::uint64_t id, std::string_view extension) {
+    return {fmt::format("{}/{}", photos_dir, shard(id)), fmt::format("{}{}", id, extension), photos_dir};
+}
+
+Location thumbnail(std::uint64_t id) {
+    return {fmt::format("{}/{}", thumbnails_dir, shard(id)), fmt::format("{}.jpg", id), thumbnails_dir};
+}
+
+/* On-demand thumbnail variant of a photo, file_name is <id>_<size>.<ext> */
+Location variant(std::uint64_t id, std::string_view file_name) {
+    return {fmt::format("{}/{}", thumbnails_dir, shard(id)), std::string(file_name), thumbnails_dir};
+}
+
+Location blob(std::string_view hash, std::string_view extension) {
+    return {fmt::format("{}/{}", blobs_dir, shard(hash)), fmt::format("{}{}", hash, extension), blobs_dir};
+}
+
+Location blob_thumbnail(std::string_view hash) {
+    return {fmt::format("{}/{}", blob_thumbnails_dir, shard(hash)), fmt::format("{}.jpg", hash), blob_thumbnails_dir};
+}
+
+/* Creates the shard directory, must be called before a file is written to loc.path() */
+void prepare(const Location &loc) {
+    std::filesystem::create_directories(loc.dir);
+}
+
+void write(const Location &loc, std::string_view contents) {
+    prepare(loc);
+    store_file_to_disk(loc.dir, loc.file_name, contents);
+}
+
+/* Removes the file from both layouts */
+void remove(const Location &loc) {
+    std::error_code ec;
+    std::filesystem::remove(loc.path(), ec);
+    std::filesystem::remove(loc.legacy_path(), ec);
+}
+
+} // ns rs::storage
+
+#endif // RS_STORAGE_HPP
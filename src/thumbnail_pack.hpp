@@ -0,0 +1,431 @@
+#ifndef RS_THUMBNAIL_PACK_HPP
+#define RS_THUMBNAIL_PACK_HPP
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/format.h>
+#include <soci/soci.h>
+#include <soci/connection-pool.h>
+
+#include "static_files.hpp"
+#include "utils.hpp"
+
+namespace rs {
+
+/* Append-only store of upload thumbnails, instead of one small file per photo.
+ * Segment files <dir>/<seq>.pack hold two kinds of records:
+ *   blob  thumbnail of a content hash (see blobs.hpp), stored once for all duplicates
+ *   ref   photo id -> content hash
+ * The in-memory index is rebuilt at startup by replaying segments in order, newer records win.
+ * Deletes only drop index entries: refs are kept at startup only for photos the database reports
+ * with a ready thumbnail of the same hash. Space of dropped records is reclaimed by compaction,
+ * which copies live records of a mostly dead segment to the active one and removes the segment. */
+class ThumbnailPack {
+public:
+    static constexpr std::uint64_t default_segment_size = 64 * 1024 * 1024;
+    static constexpr double compaction_threshold = 0.5; // dead fraction of a sealed segment
+    static constexpr auto compaction_interval = std::chrono::minutes(1);
+
+    struct Stats {
+        std::size_t segments;
+        std::size_t photos;
+        std::size_t blobs;
+        std::uint64_t bytes;
+        std::uint64_t live_bytes;
+    };
+
+private:
+    static constexpr std::uint32_t magic = 0x4b505352; // "RSPK"
+    static constexpr std::size_t hash_len = 64;
+    /* ref records written before 64 bit photo ids keep the id in the header, ref64 ones in their 8 bytes of data */
+    enum class RecordType : std::uint32_t { blob = 1, ref = 2, ref64 = 3 };
+
+    struct RecordHeader {
+        std::uint32_t magic;
+        RecordType type;
+        std::uint32_t photo_id;  // ref only
+        std::uint32_t length;    // of data following the header
+        std::uint32_t crc;       // of header with crc 0 and data
+        char hash[hash_len];
+    };
+
+    struct Location {
+        std::uint64_t segment;
+        std::uint64_t offset;    // of record header
+        std::uint32_t length;    // of data
+        [[nodiscard]] std::uint64_t record_size() const { return sizeof(RecordHeader) + length; }
+    };
+
+    struct Blob {
+        Location location;
+        std::size_t refs = 0;
+    };
+
+    struct Ref {
+        std::string hash;
+        Location location;
+    };
+
+    struct Segment {
+        int fd;
+        std::uint64_t size = 0;
+        std::uint64_t live = 0; // bytes of records still in the index
+    };
+
+    std::string m_dir;
+    std::uint64_t m_segment_size;
+    std::mutex m_mutex;
+    std::map<std::uint64_t, Segment> m_segments; // last one is appended to
+    std::unordered_map<std::string, Blob> m_blobs;
+    std::unordered_map<std::uint64_t, Ref> m_refs;
+    std::condition_variable_any m_cv;
+    std::jthread m_compactor;
+
+    [[nodiscard]] std::string segment_path(std::uint64_t seq) const {
+        return fmt::format("{}/{:08}.pack", m_dir, seq);
+    }
+
+    static std::uint32_t checksum(RecordHeader header, std::string_view data) {
+        header.crc = 0;
+        auto crc = ::crc32(0, reinterpret_cast<const Bytef*>(&header), sizeof(header));
+        if (!data.empty()) /* crc32 of a null buffer is 0 */
+            crc = ::crc32(crc, reinterpret_cast<const Bytef*>(data.data()), static_cast<uInt>(data.size()));
+        return static_cast<std::uint32_t>(crc);
+    }
+
+    static bool pread_all(int fd, void * buf, std::size_t size, std::uint64_t offset) {
+        auto p = static_cast<char*>(buf);
+        while (size > 0) {
+            auto n = ::pread(fd, p, size, static_cast<off_t>(offset));
+            if (n <= 0) return false;
+            p += n; size -= static_cast<std::size_t>(n); offset += static_cast<std::uint64_t>(n);
+        }
+        return true;
+    }
+
+    static bool pwrite_all(int fd, const void * buf, std::size_t size, std::uint64_t offset) {
+        auto p = static_cast<const char*>(buf);
+        while (size > 0) {
+            auto n = ::pwrite(fd, p, size, static_cast<off_t>(offset));
+            if (n <= 0) return false;
+            p += n; size -= static_cast<std::size_t>(n); offset += static_cast<std::uint64_t>(n);
+        }
+        return true;
+    }
+
+    Segment& open_segment(std::uint64_t seq) {
+        int fd = ::open(segment_path(seq).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        throw_if<OtherError>(fd < 0, fmt::format("Can not open thumbnail pack {}", segment_path(seq)));
+        return m_segments.emplace(seq, Segment{fd}).first->second;
+    }
+
+    /* Must be called with m_mutex held */
+    std::optional<Location> append(RecordType type, std::string_view hash, std::string_view data) {
+        RecordHeader header {magic, type, 0, static_cast<std::uint32_t>(data.size()), 0, {}};
+        std::memcpy(header.hash, hash.data(), std::min(hash.size(), hash_len));
+        header.crc = checksum(header, data);
+
+        const std::uint64_t record_size = sizeof(header) + data.size();
+        if (m_segments.empty() || (m_segments.rbegin()->second.size > 0 && m_segments.rbegin()->second.size + record_size > m_segment_size))
+            open_segment(m_segments.empty() ? 1 : m_segments.rbegin()->first + 1);
+        auto &[seq, segment] = *m_segments.rbegin();
+
+        std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+        record.append(data);
+        if (!pwrite_all(segment.fd, record.data(), record.size(), segment.size))
+            return std::nullopt; // partial record is overwritten by the next append
+        Location location {seq, segment.size, header.length};
+        segment.size += record_size;
+        segment.live += record_size;
+        return location;
+    }
+
+    /* Must be called with m_mutex held */
+    std::optional<Location> append_ref(std::uint64_t photo_id, std::string_view hash) {
+        char data[sizeof(photo_id)];
+        std::memcpy(data, &photo_id, sizeof(photo_id));
+        return append(RecordType::ref64, hash, std::string_view(data, sizeof(data)));
+    }
+
+    /* Reads records of a segment into the index, a torn record at the end of the last segment is truncated */
+    void replay(std::uint64_t seq, Segment &segment, bool last) {
+        struct stat st;
+        const std::uint64_t file_size = ::fstat(segment.fd, &st) == 0 ? static_cast<std::uint64_t>(st.st_size) : 0;
+        std::uint64_t offset = 0;
+        std::string data;
+        while (offset + sizeof(RecordHeader) <= file_size) {
+            RecordHeader header;
+            if (!pread_all(segment.fd, &header, sizeof(header), offset) || header.magic != magic
+                || offset + sizeof(header) + header.length > file_size)
+                break;
+            data.resize(header.length);
+            if (!pread_all(segment.fd, data.data(), data.size(), offset + sizeof(header)) || checksum(header, data) != header.crc)
+                break;
+
+            const Location location {seq, offset, header.length};
+            std::string hash(header.hash, hash_len);
+            if (header.type == RecordType::blob)
+                m_blobs[hash].location = location;
+            else if (header.type == RecordType::ref)
+                m_refs[header.photo_id] = Ref{std::move(hash), location};
+            else if (header.type == RecordType::ref64 && data.size() == sizeof(std::uint64_t)) {
+                std::uint64_t photo_id;
+                std::memcpy(&photo_id, data.data(), sizeof(photo_id));
+                m_refs[photo_id] = Ref{std::move(hash), location};
+            }
+            offset += location.record_size();
+        }
+
+        if (offset != file_size) {
+            fmt::print(stderr, "Thumbnail pack {}: invalid record at offset {}, {}\n", segment_path(seq), offset,
+                       last ? "truncating" : "ignoring rest of the segment");
+            throw_if<OtherError>(last && ::ftruncate(segment.fd, static_cast<off_t>(offset)) != 0,
+                                 fmt::format("Can not truncate thumbnail pack {}", segment_path(seq)));
+        }
+        segment.size = offset;
+    }
+
+    /* Drops refs of photos that are deleted or changed, then blobs without refs and counts live bytes */
+    void retain(soci::session &db) {
+        std::unordered_map<std::uint64_t, std::string> ready;
+        soci::rowset<soci::row> rows = (db.prepare << "SELECT id, content_hash FROM photos WHERE thumbnail_status = 'ready' AND content_hash IS NOT NULL");
+        for (const auto &row : rows)
+            ready.emplace(static_cast<std::uint64_t>(row.get<long long>(0)), row.get<std::string>(1));
+
+        std::erase_if(m_refs, [&](const auto &item) {
+            const auto &[id, ref] = item;
+            auto it = ready.find(id);
+            auto blob = m_blobs.find(ref.hash);
+            if (it == ready.end() || it->second != ref.hash || blob == m_blobs.end()) return true;
+            blob->second.refs++;
+            m_segments.at(ref.location.segment).live += ref.location.record_size();
+            return false;
+        });
+        std::erase_if(m_blobs, [&](const auto &item) {
+            const auto &[hash, blob] = item;
+            if (blob.refs == 0) return true;
+            m_segments.at(blob.location.segment).live += blob.location.record_size();
+            return false;
+        });
+    }
+
+    /* Must be called with m_mutex held */
+    void erase_ref(std::unordered_map<std::uint64_t, Ref>::iterator it) {
+        m_segments.at(it->second.location.segment).live -= it->second.location.record_size();
+        auto blob = m_blobs.find(it->second.hash);
+        if (--blob->second.refs == 0) {
+            m_segments.at(blob->second.location.segment).live -= blob->second.location.record_size();
+            m_blobs.erase(blob);
+        }
+        m_refs.erase(it);
+    }
+
+    /* Must be called with m_mutex held */
+    bool add_ref(std::uint64_t photo_id, const std::string &hash) {
+        auto blob = m_blobs.find(hash);
+        if (blob == m_blobs.end()) return false;
+        blob->second.refs++; // before erasing the old ref, which may be to the same blob
+        if (auto it = m_refs.find(photo_id); it != m_refs.end())
+            erase_ref(it);
+        auto location = append_ref(photo_id, hash);
+        if (!location) {
+            if (--blob->second.refs == 0) {
+                m_segments.at(blob->second.location.segment).live -= blob->second.location.record_size();
+                m_blobs.erase(blob);
+            }
+            return false;
+        }
+        m_refs.emplace(photo_id, Ref{hash, *location});
+        return true;
+    }
+
+    /* Copies live records of a sealed segment to the active one and removes it.
+     * Data is read without the lock, the segment is only closed by this thread */
+    void compact(std::uint64_t seq) {
+        std::vector<std::string> hashes;
+        std::vector<std::uint64_t> ids;
+        int fd;
+        {
+            std::scoped_lock lock(m_mutex);
+            if (!m_segments.contains(seq) || seq == m_segments.rbegin()->first) return;
+            fd = m_segments.at(seq).fd;
+            for (const auto &[hash, blob] : m_blobs)
+                if (blob.location.segment == seq) hashes.push_back(hash);
+            for (const auto &[id, ref] : m_refs)
+                if (ref.location.segment == seq) ids.push_back(id);
+        }
+
+        std::string data;
+        for (const auto &hash : hashes) {
+            Location from;
+            {
+                std::scoped_lock lock(m_mutex);
+                auto it = m_blobs.find(hash);
+                if (it == m_blobs.end() || it->second.location.segment != seq) continue;
+                from = it->second.location;
+            }
+            data.resize(from.length);
+            if (!pread_all(fd, data.data(), data.size(), from.offset + sizeof(RecordHeader))) return;
+
+            std::scoped_lock lock(m_mutex);
+            auto it = m_blobs.find(hash);
+            if (it == m_blobs.end() || it->second.location.segment != seq) continue;
+            auto to = append(RecordType::blob, hash, data);
+            if (!to) return;
+            m_segments.at(seq).live -= from.record_size();
+            it->second.location = *to;
+        }
+
+        std::scoped_lock lock(m_mutex);
+        for (auto id : ids) {
+            auto it = m_refs.find(id);
+            if (it == m_refs.end() || it->second.location.segment != seq) continue;
+            auto to = append_ref(id, it->second.hash);
+            if (!to) return;
+            m_segments.at(seq).live -= it->second.location.record_size();
+            it->second.location = *to;
+        }
+
+        if (m_segments.at(seq).live == 0) {
+            ::close(fd);
+            std::error_code ec;
+            std::filesystem::remove(segment_path(seq), ec);
+            m_segments.erase(seq);
+        }
+    }
+
+    void compact_loop(std::stop_token stoken) {
+        std::unique_lock lock(m_mutex);
+        while (true) {
+            m_cv.wait_for(lock, stoken, compaction_interval, [] { return false; });
+            if (stoken.stop_requested()) return;
+            std::vector<std::uint64_t> candidates;
+            for (auto it = m_segments.begin(); it != m_segments.end() && std::next(it) != m_segments.end(); ++it) {
+                const auto &segment = it->second;
+                if (segment.size > 0 && static_cast<double>(segment.size - segment.live) >= compaction_threshold * static_cast<double>(segment.size))
+                    candidates.push_back(it->first);
+            }
+            lock.unlock();
+            for (auto seq : candidates) {
+                if (stoken.stop_requested()) return;
+                compact(seq);
+            }
+            lock.lock();
+        }
+    }
+
+public:
+    /* Opens segments in dir, db is used to drop records of photos deleted since they were written */
+    ThumbnailPack(std::string dir, soci::connection_pool &db_pool, std::uint64_t segment_size = default_segment_size)
+        : m_dir(std::move(dir)), m_segment_size(segment_size) {
+        std::filesystem::create_directories(m_dir);
+        std::vector<std::uint64_t> seqs;
+        for (const auto &entry : std::filesystem::directory_iterator(m_dir))
+            if (entry.is_regular_file() && entry.path().extension() == ".pack")
+                seqs.push_back(std::strtoull(entry.path().stem().c_str(), nullptr, 10));
+        std::sort(seqs.begin(), seqs.end());
+        for (auto seq : seqs)
+            replay(seq, open_segment(seq), seq == seqs.back());
+        soci::session db(db_pool);
+        retain(db);
+        m_compactor = std::jthread([this](std::stop_token stoken) { compact_loop(stoken); });
+    }
+
+    ThumbnailPack(const ThumbnailPack&) = delete;
+    ThumbnailPack& operator=(const ThumbnailPack&) = delete;
+
+    ~ThumbnailPack() {
+        m_compactor.request_stop();
+        m_compactor.join();
+        for (auto &[seq, segment] : m_segments)
+            ::close(segment.fd);
+    }
+
+    /* Stores thumbnail file of a content hash for every photo with that content */
+    bool put_file(std::string_view hash, const std::string &path, std::span<const std::uint64_t> photo_ids) {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) return false;
+        std::string data(static_cast<std::size_t>(in.tellg()), '\0');
+        in.seekg(0);
+        if (!in.read(data.data(), static_cast<std::streamsize>(data.size()))) return false;
+
+        std::scoped_lock lock(m_mutex);
+        const std::string key(hash);
+        if (!m_blobs.contains(key)) {
+            auto location = append(RecordType::blob, key, data);
+            if (!location) return false;
+            m_blobs.emplace(key, Blob{*location});
+        }
+        bool stored = true;
+        for (auto id : photo_ids)
+            stored = add_ref(id, key) && stored;
+        if (m_blobs.at(key).refs == 0) /* no photo left to reference it */ {
+            m_segments.at(m_blobs.at(key).location.segment).live -= m_blobs.at(key).location.record_size();
+            m_blobs.erase(key);
+        }
+        return stored;
+    }
+
+    /* References thumbnail of an already packed content hash, false if it is not packed */
+    bool link(std::uint64_t photo_id, std::string_view hash) {
+        std::scoped_lock lock(m_mutex);
+        return add_ref(photo_id, std::string(hash));
+    }
+
+    [[nodiscard]] bool contains_blob(std::string_view hash) {
+        std::scoped_lock lock(m_mutex);
+        return m_blobs.contains(std::string(hash));
+    }
+
+    void erase(std::uint64_t photo_id) {
+        std::scoped_lock lock(m_mutex);
+        if (auto it = m_refs.find(photo_id); it != m_refs.end())
+            erase_ref(it);
+    }
+
+    /* Duplicated descriptor of the segment and position of the thumbnail, for serve_file_slice */
+    std::optional<FileSlice> open(std::uint64_t photo_id) {
+        std::scoped_lock lock(m_mutex);
+        auto ref = m_refs.find(photo_id);
+        if (ref == m_refs.end()) return std::nullopt;
+        const auto &location = m_blobs.at(ref->second.hash).location;
+        const auto &segment = m_segments.at(location.segment);
+        int fd = ::dup(segment.fd);
+        if (fd < 0) return std::nullopt;
+        restinio::file_meta_t meta {segment.size, std::chrono::system_clock::time_point{}};
+        return FileSlice{fd, meta, location.offset + sizeof(RecordHeader), location.length};
+    }
+
+    [[nodiscard]] Stats stats() {
+        std::scoped_lock lock(m_mutex);
+        Stats s {m_segments.size(), m_refs.size(), m_blobs.size(), 0, 0};
+        for (const auto &[seq, segment] : m_segments) {
+            s.bytes += segment.size;
+            s.live_bytes += segment.live;
+        }
+        return s;
+    }
+};
+
+} // ns rs
+
+#endif // RS_THUMBNAIL_PACK_HPP
@@ -0,0 +1,324 @@
+#ifndef RS_THUMBNAILS_HPP
+#define RS_THUMBNAILS_HPP
+
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "image/thumbnail.hpp"
+#include "static_files.hpp"
+#include "storage.hpp"
+
+extern char **environ;
+
+namespace rs {
+
+/* Thumbnail generation jobs processed by a dedicated worker pool, off the restinio threads.
+ * Images are scaled in process by rs::image, convert is only a fallback */
+class ThumbnailQueue {
+public:
+    static constexpr image::Size thumbnail_size {800, 800};
+
+    struct Job;
+    using on_done_t = std::function<void(const Job&, bool success)>;
+
+    struct Job {
+        std::uint64_t photo_id;
+        std::string source_path;
+        std::string thumbnail_path;
+        image::Size box = thumbnail_size;
+        image::Format format = image::Format::jpeg;
+        on_done_t on_done;
+    };
+
+    /* Runs ImageMagick directly, without a shell. Used for format variants the native engine does not implement,
+     * output format is picked by convert from the thumbnail_path extension. Resources are limited like natively */
+    static bool convert_thumbnail(const std::string &source_path, const std::string &thumbnail_path, image::Size box = thumbnail_size) {
+        const auto geometry = fmt::format("{}x{}", box.width, box.height);
+        const auto max_area = std::to_string(image::max_pixels);
+        const char * argv[] = {"convert", "-limit", "area", max_area.c_str(), "-limit", "memory", "512MiB", "-limit", "map", "1GiB",
+                               "-limit", "disk", "0", "-limit", "time", "60",
+                               "-thumbnail", geometry.c_str(), source_path.c_str(), thumbnail_path.c_str(), nullptr};
+        pid_t pid;
+        if (::posix_spawnp(&pid, argv[0], nullptr, nullptr, const_cast<char * const *>(argv), environ) != 0)
+            return false;
+        int status = 0;
+        if (::waitpid(pid, &status, 0) != pid)
+            return false;
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    /* Place in the queue reserved before the upload is processed, released if never submitted */
+    class Slot {
+        friend class ThumbnailQueue;
+        ThumbnailQueue *m_queue;
+        explicit Slot(ThumbnailQueue *queue) : m_queue(queue) {}
+    public:
+        Slot(Slot &&other) noexcept : m_queue(std::exchange(other.m_queue, nullptr)) {}
+        Slot(const Slot&) = delete;
+        Slot& operator=(const Slot&) = delete;
+        Slot& operator=(Slot&&) = delete;
+        ~Slot() { if (m_queue) m_queue->release(); }
+    };
+
+private:
+    std::size_t m_capacity;
+    std::size_t m_reserved = 0;
+    std::deque<Job> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable_any m_cv;
+    unsigned m_threads_per_image;
+    std::vector<std::jthread> m_workers;
+
+    void release() {
+        std::scoped_lock lock(m_mutex);
+        m_reserved--;
+    }
+
+    static bool make_thumbnail(const Job &job, image::ForkJoinPool &pool) {
+        try {
+            switch (image::make_thumbnail(job.source_path, job.thumbnail_path, job.box, pool, job.format)) {
+                case image::ThumbnailResult::done:        return true;
+                case image::ThumbnailResult::failed:      return false;
+                case image::ThumbnailResult::unsupported: break;
+            }
+        } catch (const std::bad_alloc&) {
+            return false;
+        }
+        return convert_thumbnail(job.source_path, job.thumbnail_path, job.box);
+    }
+
+    void work(std::stop_token stoken) {
+        image::ForkJoinPool pool(m_threads_per_image);
+        while (true) {
+            Job job;
+            {
+                std::unique_lock lock(m_mutex);
+                if (!m_cv.wait(lock, stoken, [this] { return !m_jobs.empty(); }))
+                    return;
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            bool success = make_thumbnail(job, pool);
+            try {
+                if (job.on_done) job.on_done(job, success);
+            } catch (...) {
+                // Nothing to report to
+            }
+            release();
+        }
+    }
+
+public:
+    ThumbnailQueue(unsigned num_of_workers, std::size_t capacity, unsigned threads_per_image)
+        : m_capacity(capacity), m_threads_per_image(threads_per_image) {
+        for (auto i = 0u; i < num_of_workers; i++)
+            m_workers.emplace_back([this](std::stop_token stoken) { work(stoken); });
+    }
+
+    /* Returns nullopt when queue is full, callers should ask clients to retry later */
+    std::optional<Slot> try_reserve() {
+        std::scoped_lock lock(m_mutex);
+        if (m_reserved >= m_capacity)
+            return std::nullopt;
+        m_reserved++;
+        return Slot{this};
+    }
+
+    void submit(Slot &&slot, Job &&job) {
+        slot.m_queue = nullptr; // released by the worker once the job is done
+        {
+            std::scoped_lock lock(m_mutex);
+            m_jobs.push_back(std::move(job));
+        }
+        m_cv.notify_one();
+    }
+};
+
+/* Thumbnail size and format requested by URL, file name is <photo_id>_<size>.<jpg|webp> */
+struct ThumbnailVariant {
+    static constexpr std::array<std::uint32_t, 4> allowed_sizes {150, 300, 600, 800};
+
+    std::uint64_t photo_id;
+    std::uint32_t size;
+    image::Format format;
+
+    [[nodiscard]] std::string file_name() const {
+        return fmt::format("{}_{}.{}", photo_id, size, format == image::Format::webp ? "webp" : "jpg");
+    }
+
+    [[nodiscard]] const char * content_type() const {
+        return format == image::Format::webp ? "image/webp" : "image/jpeg";
+    }
+
+    static std::optional<ThumbnailVariant> parse(std::string_view name) {
+        ThumbnailVariant v{};
+        const auto underscore = name.find('_'), dot = name.find('.');
+        if (underscore == std::string_view::npos || dot == std::string_view::npos || dot < underscore)
+            return std::nullopt;
+        auto to_number = [](std::string_view s, auto &n) {
+            auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+            return !s.empty() && ec == std::errc{} && ptr == s.data() + s.size();
+        };
+        if (!to_number(name.substr(0, underscore), v.photo_id) || !to_number(name.substr(underscore + 1, dot - underscore - 1), v.size))
+            return std::nullopt;
+        if (std::find(allowed_sizes.begin(), allowed_sizes.end(), v.size) == allowed_sizes.end())
+            return std::nullopt;
+
+        const auto ext = name.substr(dot);
+        if (ext == ".jpg") v.format = image::Format::jpeg;
+        else if (ext == ".webp") v.format = image::Format::webp;
+        else return std::nullopt;
+        return image::can_encode(v.format) ? std::optional{v} : std::nullopt;
+    }
+};
+
+/* Thumbnail variants rendered on first request and kept on disk, evicted in LRU order once
+ * total size exceeds capacity. Concurrent requests for a variant being rendered wait for the same job */
+class ThumbnailCache {
+public:
+    /* How waiting for a variant ended: busy when it was not rendered as the queue was full */
+    enum class Result { ready, failed, busy };
+    using waiter_t = std::function<void(Result)>;
+
+    enum class Lookup { cached, waiting, render };
+
+private:
+    struct Entry {
+        std::uintmax_t bytes;
+        std::list<std::string>::iterator lru_it;
+    };
+
+    std::uintmax_t m_capacity;
+    std::uintmax_t m_total = 0;
+    FileDescriptorCache &m_fd_cache;
+    std::mutex m_mutex;
+    std::list<std::string> m_lru;
+    std::unordered_map<std::string, Entry> m_entries;
+    std::unordered_map<std::string, std::vector<waiter_t>> m_pending;
+
+    void insert(const std::string &name, std::uintmax_t bytes) {
+        m_lru.push_front(name);
+        m_entries.emplace(name, Entry{bytes, m_lru.begin()});
+        m_total += bytes;
+        while (m_total > m_capacity && m_lru.size() > 1)
+            erase(std::prev(m_lru.end()));
+    }
+
+    std::vector<waiter_t> take_waiters(const std::string &name) {
+        std::vector<waiter_t> waiters;
+        if (auto it = m_pending.find(name); it != m_pending.end()) {
+            waiters = std::move(it->second);
+            m_pending.erase(it);
+        }
+        return waiters;
+    }
+
+    void erase(std::list<std::string>::iterator lru_it) {
+        const auto loc = location_of(*lru_it);
+        storage::remove(loc);
+        m_fd_cache.invalidate(loc.path());
+        m_fd_cache.invalidate(loc.legacy_path());
+        auto it = m_entries.find(*lru_it);
+        m_total -= it->second.bytes;
+        m_entries.erase(it);
+        m_lru.erase(lru_it);
+    }
+
+public:
+    /* Picks up variants left by previous runs in both storage layouts, least recently written first */
+    ThumbnailCache(std::uintmax_t capacity, FileDescriptorCache &fd_cache)
+        : m_capacity(capacity), m_fd_cache(fd_cache) {
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::directory_entry>> existing;
+        std::error_code ec;
+        for (auto it = std::filesystem::recursive_directory_iterator(storage::thumbnails_dir, ec);
+             it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->path() == storage::blob_thumbnails_dir || it->path() == storage::thumbnail_packs_dir) {
+                it.disable_recursion_pending();
+                continue;
+            }
+            if (it->is_regular_file(ec) && ThumbnailVariant::parse(it->path().filename().string()))
+                existing.emplace_back(it->last_write_time(ec), *it);
+        }
+        std::sort(existing.begin(), existing.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+        std::scoped_lock lock(m_mutex);
+        for (const auto &[time, entry] : existing)
+            if (const auto bytes = entry.file_size(ec); !ec)
+                insert(entry.path().filename().string(), bytes);
+    }
+
+    /* Name must be a valid variant file name, see ThumbnailVariant::parse */
+    [[nodiscard]] static storage::Location location_of(const std::string &name) {
+        return storage::variant(ThumbnailVariant::parse(name)->photo_id, name);
+    }
+
+    /* Marks the variant as recently used if it is on disk (waiter is dropped), registers waiter otherwise.
+     * Both happen under one lock, so a variant completed in between is not rendered again.
+     * render means the caller is the first waiter and must render the variant, then call complete() or abandon() */
+    Lookup lookup(const std::string &name, waiter_t &&waiter) {
+        std::scoped_lock lock(m_mutex);
+        if (auto it = m_entries.find(name); it != m_entries.end()) {
+            m_lru.splice(m_lru.begin(), m_lru, it->second.lru_it);
+            return Lookup::cached;
+        }
+        auto &waiters = m_pending[name];
+        waiters.push_back(std::move(waiter));
+        return waiters.size() == 1 ? Lookup::render : Lookup::waiting;
+    }
+
+    /* Called once rendering is finished, notifies all waiters */
+    void complete(const std::string &name, bool success) {
+        std::vector<waiter_t> waiters;
+        {
+            std::scoped_lock lock(m_mutex);
+            if (success && !m_entries.contains(name)) {
+                std::error_code ec;
+                const auto bytes = std::filesystem::file_size(location_of(name).path(), ec);
+                if (!ec) insert(name, bytes);
+            }
+            waiters = take_waiters(name);
+        }
+        for (auto &w : waiters) w(success ? Result::ready : Result::failed);
+    }
+
+    /* Called by the first waiter when the variant can not be rendered now, notifies all waiters */
+    void abandon(const std::string &name) {
+        std::vector<waiter_t> waiters;
+        {
+            std::scoped_lock lock(m_mutex);
+            waiters = take_waiters(name);
+        }
+        for (auto &w : waiters) w(Result::busy);
+    }
+
+    /* Removes all variants of a deleted photo */
+    void erase_photo(std::uint64_t photo_id) {
+        const auto prefix = fmt::format("{}_", photo_id);
+        std::scoped_lock lock(m_mutex);
+        for (auto it = m_lru.begin(); it != m_lru.end();) {
+            auto curr = it++;
+            if (curr->starts_with(prefix)) erase(curr);
+        }
+    }
+};
+
+} // ns rs
+
+#endif // RS_THUMBNAILS_HPP
@@ -0,0 +1,208 @@
+#ifndef RS_UPLOADS_HPP
+#define RS_UPLOADS_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+
+#include <openssl/rand.h>
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
+
+#include "blobs.hpp"
+#include "errors.hpp"
+#include "file_io.hpp"
+#include "storage.hpp"
+#include "utils.hpp"
+
+namespace rs {
+
+/* Sessions of resumable photo uploads (POST /uploads, PATCH /uploads/<id>, POST /uploads/<id>/finish).
+ * Chunks must be sent in order and are appended to a staging file in storage::uploads_dir, the content
+ * hash is computed while receiving so a finished file is renamed into blob storage without being read again.
+ * Sessions are kept in memory, they survive broken connections but not server restarts. */
+class UploadSessions {
+public:
+    static constexpr std::size_t max_chunk_size = 4 * 1024 * 1024;
+    static constexpr auto session_ttl = std::chrono::hours(24);
+    static constexpr std::size_t max_sessions_per_user = 8;
+    static constexpr auto expire_interval = std::chrono::minutes(1); // between sweeps of all sessions
+
+    struct Status {
+        std::size_t offset;
+        std::size_t size;
+        std::string extension;
+    };
+
+    /* All chunks received, the staging file at path is owned by the caller */
+    struct Finished {
+        std::string path;
+        std::string hash;
+        std::string extension;
+        std::size_t size;
+    };
+
+private:
+    using clock_t = std::chrono::steady_clock;
+
+    struct Session {
+        std::uint32_t user_id;
+        std::string extension;
+        std::size_t size;
+        std::size_t received = 0;
+        blobs::Sha256 sha;
+        clock_t::time_point last_active;
+        bool busy = false; // a chunk is being written
+    };
+
+    std::string m_dir;
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::shared_ptr<Session>> m_sessions;
+    clock_t::time_point m_last_expired = clock_t::now();
+
+    [[nodiscard]] std::string path_of(std::string_view id) const { return fmt::format("{}/{}.part", m_dir, id); }
+
+    static std::string new_id() {
+        unsigned char bytes[16];
+        throw_if<OtherError>(RAND_bytes(bytes, sizeof(bytes)) != 1, "Upload id could not be generated");
+        return fmt::format("{:02x}", fmt::join(std::span(bytes), ""));
+    }
+
+    /* Session of the user, must be called with m_mutex held */
+    std::shared_ptr<Session> find(const std::string &id, std::uint32_t user_id) {
+        expire();
+        auto it = m_sessions.find(id);
+        throw_if<NotFoundError>(it == m_sessions.end(), "Upload not found or expired");
+        throw_if<UnauthorizedError>(it->second->user_id != user_id, "Upload belongs to another user");
+        return it->second;
+    }
+
+    /* Drops sessions inactive for session_ttl, at most once per expire_interval unless forced.
+     * Called by every operation, must be called with m_mutex held */
+    void expire(bool force = false) {
+        const auto now = clock_t::now();
+        if (!force && now - m_last_expired < expire_interval) return;
+        m_last_expired = now;
+        const auto deadline = now - session_ttl;
+        std::erase_if(m_sessions, [&](const auto &kv) {
+            if (kv.second->busy || kv.second->last_active > deadline) return false;
+            std::error_code ec;
+            std::filesystem::remove(path_of(kv.first), ec);
+            return true;
+        });
+    }
+
+public:
+    /* Staging files left by a previous run cannot be resumed and are removed */
+    explicit UploadSessions(std::string dir = storage::uploads_dir) : m_dir(std::move(dir)) {
+        std::error_code ec;
+        std::filesystem::remove_all(m_dir, ec);
+        std::filesystem::create_directories(m_dir);
+    }
+
+    UploadSessions(const UploadSessions&) = delete;
+    UploadSessions &operator=(const UploadSessions&) = delete;
+
+    /* A user may have max_sessions_per_user open uploads, each of them holds a staging file */
+    std::string create(std::uint32_t user_id, std::string extension, std::size_t size) {
+        auto id = new_id();
+        auto session = std::make_shared<Session>();
+        session->user_id = user_id;
+        session->extension = std::move(extension);
+        session->size = size;
+        session->last_active = clock_t::now();
+        {
+            std::lock_guard lock(m_mutex);
+            auto open_sessions = [&] { return std::ranges::count_if(m_sessions, [&](const auto &kv) { return kv.second->user_id == user_id; }); };
+            if (static_cast<std::size_t>(open_sessions()) >= max_sessions_per_user) expire(true);
+            throw_if<TooManyRequestsError>(static_cast<std::size_t>(open_sessions()) >= max_sessions_per_user,
+                fmt::format("At most {} uploads may be open at once, finish or cancel one", max_sessions_per_user));
+            m_sessions.emplace(id, session); // counted before the staging file exists
+        }
+
+        const int fd = ::open(path_of(id).c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::lock_guard lock(m_mutex);
+            m_sessions.erase(id);
+            throw OtherError("Upload could not be created");
+        }
+        ::close(fd);
+        return id;
+    }
+
+    /* Appends chunk which must start at the current offset, on_done gets the new offset once it is written.
+     * A chunk sent again after a lost response gets ConflictError with the offset to continue from.
+     * The chunk is written by file_io, it must stay valid until on_done is called */
+    void append(const std::string &id, std::uint32_t user_id, std::size_t offset, std::string_view chunk,
+                FileIoService &file_io, std::function<void(std::error_code, std::size_t)> on_done) {
+        throw_if<PayloadTooLargeError>(chunk.size() > max_chunk_size, fmt::format("Chunk must not exceed {} bytes", max_chunk_size));
+        std::shared_ptr<Session> session;
+        {
+            std::lock_guard lock(m_mutex);
+            session = find(id, user_id);
+            throw_if<ConflictError>(session->busy, "Another chunk of the upload is being written");
+            throw_if<ConflictError>(offset != session->received, nlohmann::json{{"offset", session->received}});
+            throw_if<InvalidParamsError>(offset + chunk.size() > session->size,
+                                         fmt::format("Upload is {} bytes long", session->size));
+            session->busy = true;
+        }
+
+        /* written outside of the lock, busy keeps other requests away from the session */
+        file_io.write_at(path_of(id), offset, chunk, [this, session, chunk, on_done = std::move(on_done)](std::error_code ec) {
+            if (!ec)
+                session->sha.update(chunk);
+            std::size_t received = 0;
+            {
+                std::lock_guard lock(m_mutex);
+                session->busy = false;
+                session->last_active = clock_t::now();
+                if (!ec) session->received += chunk.size();
+                received = session->received;
+            }
+            on_done(ec, received);
+        });
+    }
+
+    Status status(const std::string &id, std::uint32_t user_id) {
+        std::lock_guard lock(m_mutex);
+        auto session = find(id, user_id);
+        return {session->received, session->size, session->extension};
+    }
+
+    /* Ends a complete upload, the session is gone afterwards */
+    Finished finish(const std::string &id, std::uint32_t user_id) {
+        std::shared_ptr<Session> session;
+        {
+            std::lock_guard lock(m_mutex);
+            session = find(id, user_id);
+            throw_if<ConflictError>(session->busy, "Another chunk of the upload is being written");
+            throw_if<ConflictError>(session->received != session->size,
+                                    nlohmann::json{{"offset", session->received}, {"size", session->size}});
+            m_sessions.erase(id);
+        }
+        return {path_of(id), session->sha.hex_digest(), session->extension, session->size};
+    }
+
+    void cancel(const std::string &id, std::uint32_t user_id) {
+        std::lock_guard lock(m_mutex);
+        auto session = find(id, user_id);
+        throw_if<ConflictError>(session->busy, "Another chunk of the upload is being written");
+        m_sessions.erase(id);
+        std::error_code ec;
+        std::filesystem::remove(path_of(id), ec);
+    }
+};
+
+} // ns rs
+
+#endif // RS_UPLOADS_HPP
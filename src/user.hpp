@@ -3,6 +3,8 @@
 
 #include <string>
 #include <functional>
+#include <bitset>
+#include <span>
 #include <ctype.h>
 #include <nlohmann/json.hpp>
 #include <jwt/jwt.hpp>
@@ -10,43 +12,18 @@
 #include "errors.hpp"
 #include "utils.hpp"
 
-#include "3rd_party/magic_enum.hpp"
-
 #include "model/model.hpp"
 #include "models.hpp"
+#include "permission.hpp"
 
 namespace rs {
-enum class UserGroup {
-    other = 0,
-    owner = 1,
-    guest = 2,
-    user = 3,
-    admin = 4
-};
-constexpr unsigned num_of_user_groups = magic_enum::enum_count<UserGroup>();
-constexpr const char * group_name(UserGroup g) {
-    return magic_enum::enum_name(g).data();
-}
-
-constexpr bool have_exact_permissions(uint8_t desired, uint8_t perms) {
-    return (desired ^ perms) == 0;
-}
-
-constexpr bool have_permissions(uint8_t desired, uint8_t perms) {
-    return (desired & perms) == desired;
-}
-
-namespace permission {
-    constexpr uint8_t CREATE = 0b1000;
-    constexpr uint8_t READ = 0b0100;
-    constexpr uint8_t UPDATE = 0b0010;
-    constexpr uint8_t DELETE = 0b0001;
-};
-
 struct PermissionParams {
     rs::UserGroup group_id = UserGroup::guest;
     std::optional<uint64_t> user_id;
     std::optional<std::string> owner_field_name;
+    std::optional<std::string> private_field_name; // rows with this field set are visible only to their owner
+    std::optional<std::string> deleted_field_name; // rows with this column set are deleted and wait for the Purger
+    std::optional<std::string> version_field_name; // incremented by every update of the row, see versions.hpp
     bool has_granted_perms = false;
 
     PermissionParams without_owner() const {
@@ -114,11 +91,15 @@ void grant_permission_params_from_auth_token(soci::session &db, const model::Aut
 
 template <model::CModel M>
 class AuthorizedModelAccess {
-    using permissions_matrix_t = std::array<std::array<uint8_t, M::num_of_fields()+1>,rs::num_of_user_groups>;
+    using permissions_matrix_t = rs::permissions_matrix_t<M>;
+    using field_mask_t = std::bitset<M::num_of_fields()>;
     M m_model;
     uint8_t m_desired_permissions;
     PermissionParams m_permission_params;
-    permissions_matrix_t m_permissions_matrix;
+    permissions_matrix_t m_permissions_matrix{};
+    field_mask_t m_group_mask;
+    field_mask_t m_owner_mask;
+    std::optional<unsigned> m_owner_field_index;
 
     void check_instance_permissions() {
         uint8_t group_instance_perms = m_permissions_matrix[static_cast<uint8_t>(m_permission_params.group_id)][0];
@@ -156,52 +137,153 @@ class AuthorizedModelAccess {
         });
     }
 
-    void erase_unauthorized_fields() {
-        auto perms = m_permissions_matrix[static_cast<unsigned>(m_permission_params.group_id)];
-        if (m_permission_params.owner_field_name.has_value() && m_permission_params.user_id.has_value()) {
-            std::optional<int32_t>& resource_owner_id = 
-                m_model.template field_opt_value<int32_t>(M::field_index(m_permission_params.owner_field_name->c_str()));
-            if (resource_owner_id.has_value() && *resource_owner_id == *m_permission_params.user_id) {
-                std::transform(std::cbegin(perms), std::cend(perms), 
-                               std::cbegin(m_permissions_matrix[static_cast<uint8_t>(UserGroup::owner)]),
-                               std::begin(perms), std::bit_or{});
-            }
-        }
+    /* Allowed fields for the (desired permission, group) pair, and the same set extended
+     * with owner permissions. Computed once per access, then applied to every row. */
+    void compute_field_masks() {
+        const auto &group_perms = m_permissions_matrix[static_cast<unsigned>(m_permission_params.group_id)];
+        const auto &owner_perms = m_permissions_matrix[static_cast<unsigned>(UserGroup::owner)];
+        const bool can_be_owner = m_permission_params.owner_field_name.has_value() && m_permission_params.user_id.has_value();
 
-        int num_of_erased_fields = 0;
-        for (auto i=1u; i < perms.size(); i++) {
-            if (!have_permissions(m_desired_permissions, perms[i])) {
-                 m_model.template erase_value(i-1);
-                 num_of_erased_fields++;
-            }
+        for (auto i=0u; i < M::num_of_fields(); i++) {
+            m_group_mask[i] = have_permissions(m_desired_permissions, group_perms[i+1]);
+            m_owner_mask[i] = m_group_mask[i] || (can_be_owner && have_permissions(m_desired_permissions, owner_perms[i+1]));
         }
-        rs::throw_if<UnauthorizedError>(num_of_erased_fields == M::num_of_fields(), permissions_to_json(m_desired_permissions));
+
+        if (can_be_owner)
+            m_owner_field_index = M::field_index(m_permission_params.owner_field_name->c_str());
     }
+
+    [[nodiscard]] bool is_owner(M &m) const {
+        if (!m_owner_field_index.has_value())
+            return false;
+        const std::optional<int32_t>& resource_owner_id = m.template field_opt_value<int32_t>(*m_owner_field_index);
+        return resource_owner_id.has_value() && *resource_owner_id == *m_permission_params.user_id;
+    }
+
+    /* Private rows stay visible to groups that are allowed to change their visibility */
+    [[nodiscard]] bool sees_private_rows() const {
+        if (!m_permission_params.private_field_name.has_value())
+            return true;
+        const auto i = M::field_index(m_permission_params.private_field_name->c_str());
+        return have_permissions(permission::UPDATE, m_permissions_matrix[static_cast<unsigned>(m_permission_params.group_id)][i+1]);
+    }
+
+    void erase_unauthorized_fields(M &m) const {
+        const field_mask_t &mask = is_owner(m) ? m_owner_mask : m_group_mask;
+        rs::throw_if<UnauthorizedError>(mask.none(), permissions_to_json(m_desired_permissions));
+        m.retain_values(mask);
+    }
+
     public:
     AuthorizedModelAccess(uint8_t desired_permissions, model::AuthToken auth_tok, PermissionParams pp, soci::session &db, std::string_view table_name, M &&m) 
         : m_model(std::move(m)),
           m_desired_permissions(desired_permissions),
           m_permission_params(std::move(pp)) {
         grant_permission_params_from_auth_token(db, auth_tok, m_permission_params);
-        load_perms_from_db(db, table_name);
+        if constexpr (CStaticPermissions<M>)
+            m_permissions_matrix = static_permissions<M>::matrix;
+        else
+            load_perms_from_db(db, table_name);
         check_instance_permissions();
+        compute_field_masks();
     }
 
     M get_safely() {
-        erase_unauthorized_fields();
+        erase_unauthorized_fields(m_model);
         return m_model;
     }
 
     M move_safely() {
-        erase_unauthorized_fields();
+        erase_unauthorized_fields(m_model);
         M tmp = std::move(m_model);
-
-        for (auto i=0u; i < M::num_of_fields(); i++)
-            m_model.template erase_value(i);
-        
+        m_model.erase_values();
         return tmp;
     }
 
+    /* Columns which can be returned for at least one row, plus the owner column needed for
+     * deciding which mask applies. Everything else is never read from the database. */
+    [[nodiscard]] std::string select_columns() const {
+        field_mask_t columns = m_owner_mask;
+        if (m_owner_field_index.has_value())
+            columns.set(*m_owner_field_index);
+        rs::throw_if<UnauthorizedError>(columns.none(), permissions_to_json(m_desired_permissions));
+
+        std::string result;
+        for (auto i=0u; i < M::num_of_fields(); i++) {
+            if (!columns.test(i)) continue;
+            if (!result.empty()) result.append(",");
+            result.append(M::field_name(i));
+        }
+        return result;
+    }
+
+    /* Predicate matching rows owned by the caller, empty if the caller can not be an owner */
+    [[nodiscard]] std::string owner_predicate() const {
+        return m_owner_field_index.has_value()
+            ? fmt::format("{}={}", M::field_name(*m_owner_field_index), *m_permission_params.user_id)
+            : "";
+    }
+
+    /* Predicate matching rows which are not deleted, empty for tables deleted right away */
+    [[nodiscard]] std::string live_predicate() const {
+        return m_permission_params.deleted_field_name.has_value()
+            ? fmt::format("{} IS NULL", *m_permission_params.deleted_field_name)
+            : "";
+    }
+
+    /* Row-level WHERE predicate (without the WHERE keyword) restricting rows to ones
+     * the caller may access, empty if every row is accessible */
+    [[nodiscard]] std::string row_predicate() const {
+        const std::string owner_cond = owner_predicate();
+        const std::string live_cond = live_predicate();
+        auto and_live = [&](std::string cond) {
+            if (live_cond.empty()) return cond;
+            return cond.empty() ? live_cond : fmt::format("{} AND {}", std::move(cond), live_cond);
+        };
+
+        if (m_group_mask.none()) {
+            rs::throw_if<UnauthorizedError>(owner_cond.empty(), permissions_to_json(m_desired_permissions));
+            return and_live(owner_cond);
+        }
+
+        if (sees_private_rows())
+            return and_live("");
+
+        const std::string public_cond = fmt::format("{}=0", *m_permission_params.private_field_name);
+        return and_live(owner_cond.empty() ? public_cond : fmt::format("({} OR {})", owner_cond, public_cond));
+    }
+
+    /* Same as move_safely, for models that were already moved out of unsafe_ref() */
+    void filter_safely(std::span<M> models) const {
+        for (M &m : models)
+            erase_unauthorized_fields(m);
+    }
+
+    /* Owner column of the table when the caller can own rows, see owner_predicate */
+    [[nodiscard]] std::optional<std::string_view> owner_column() const {
+        if (!m_owner_field_index.has_value()) return std::nullopt;
+        return M::field_name(*m_owner_field_index);
+    }
+
+    /* Fields filter_safely keeps of a row owned by owner_id */
+    [[nodiscard]] const field_mask_t& row_mask(std::optional<std::int64_t> owner_id) const {
+        const bool owner = m_owner_field_index.has_value() && owner_id.has_value()
+                        && static_cast<std::uint64_t>(*owner_id) == *m_permission_params.user_id;
+        return owner ? m_owner_mask : m_group_mask;
+    }
+
+    [[nodiscard]] const field_mask_t& group_mask() const {
+        return m_group_mask;
+    }
+
+    [[nodiscard]] const field_mask_t& owner_mask() const {
+        return m_owner_mask;
+    }
+
+    [[nodiscard]] uint8_t desired_permissions() const {
+        return m_desired_permissions;
+    }
+
     M& unsafe_ref() {
         return m_model;
     }
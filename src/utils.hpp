@@ -1,15 +1,19 @@
 #ifndef RS_UTILS_HPP
 #define RS_UTILS_HPP
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
 #include <fstream>
 #include <string_view>
 #include <filesystem>
 #include <span>
+#include <vector>
 #include <restinio/router/easy_parser_router.hpp>
 #include <restinio/helpers/file_upload.hpp>
 #include <restinio/helpers/multipart_body.hpp>
+#include <restinio/helpers/http_field_parsers/content-disposition.hpp>
 #include <boost/lexical_cast.hpp>
-#include <random>
 #include <iomanip>
 #include "errors.hpp"
 
@@ -36,6 +40,7 @@ template <typename T> constexpr std::string_view type_name;
 template <> constexpr const char * type_name<int> = "int";
 template <> constexpr const char * type_name<char> = "char";
 template <> constexpr const char * type_name<long> = "long int";
+template <> constexpr const char * type_name<long long> = "long long int";
 template <> constexpr const char * type_name<unsigned> = "unsigned int";
 template <> constexpr const char * type_name<unsigned long> = "unsigned long int";
 template <> constexpr const char * type_name<float> = "float";
@@ -63,12 +68,32 @@ struct CmdLineArgs {
     std::optional<const char*> address;
     std::optional<unsigned> port;
     std::optional<const char *> db_config;
+    std::optional<std::size_t> max_body_size;
+    std::optional<std::uintmax_t> thumbnail_cache_size;
+    std::optional<std::uint32_t> node_id;
+    std::optional<const char *> cors_origins;
+    bool close_on_error {false};
+    std::optional<unsigned> idle_timeout;
+    std::optional<unsigned> write_timeout;
+    std::optional<std::size_t> max_requests_per_connection;
+    std::optional<std::size_t> max_connections;
+    std::optional<std::size_t> concurrent_accepts;
     bool help {false};
 
     static constexpr const char * help_string = 
           "--address -a\t\tServer address\n"
           "--port -p\t\tServer port\n"
           "--db -d\t\t\tPath to db to be used\n"
+          "--max-body-size\t\tMax request body size in bytes\n"
+          "--thumbnail-cache-size\tDisk space for on-demand thumbnail variants in bytes\n"
+          "--node-id\t\tPhoto id node of this server (0-255), unique per server sharing the db\n"
+          "--cors-origins\t\tComma separated origins allowed to make cross-origin requests with credentials, * for any without (default *)\n"
+          "--close-on-error\tClose connections after error responses instead of keeping them alive\n"
+          "--idle-timeout\t\tSeconds to wait for and read the next request of a connection (default 60)\n"
+          "--write-timeout\t\tSeconds to send a response (default 30)\n"
+          "--max-requests-per-connection\tClose connections after this many requests (default unlimited)\n"
+          "--max-connections\tMax concurrent connections, further ones wait to be accepted (default unlimited)\n"
+          "--concurrent-accepts\tParallel accept operations (default 1)\n"
           "-h --help\t\tShow help menu\n";
 };
 
@@ -86,6 +111,26 @@ CmdLineArgs parse_cmdline_args(std::span<char *> args)
             result.port = std::strtoul(*it_next, nullptr, 10);
         else if ((curr == "--db" || curr == "-d") && it_next != it_end)
             result.db_config = *it_next;
+        else if (curr == "--max-body-size" && it_next != it_end)
+            result.max_body_size = std::strtoull(*it_next, nullptr, 10);
+        else if (curr == "--thumbnail-cache-size" && it_next != it_end)
+            result.thumbnail_cache_size = std::strtoull(*it_next, nullptr, 10);
+        else if (curr == "--node-id" && it_next != it_end)
+            result.node_id = static_cast<std::uint32_t>(std::strtoul(*it_next, nullptr, 10));
+        else if (curr == "--cors-origins" && it_next != it_end)
+            result.cors_origins = *it_next;
+        else if (curr == "--close-on-error")
+            result.close_on_error = true;
+        else if (curr == "--idle-timeout" && it_next != it_end)
+            result.idle_timeout = std::strtoul(*it_next, nullptr, 10);
+        else if (curr == "--write-timeout" && it_next != it_end)
+            result.write_timeout = std::strtoul(*it_next, nullptr, 10);
+        else if (curr == "--max-requests-per-connection" && it_next != it_end)
+            result.max_requests_per_connection = std::strtoull(*it_next, nullptr, 10);
+        else if (curr == "--max-connections" && it_next != it_end)
+            result.max_connections = std::max(1ull, std::strtoull(*it_next, nullptr, 10));
+        else if (curr == "--concurrent-accepts" && it_next != it_end)
+            result.concurrent_accepts = std::max(1ull, std::strtoull(*it_next, nullptr, 10));
         else if ((curr == "--help" || curr == "-h"))
             result.help = true;
     }
@@ -116,33 +161,17 @@ struct function_traits<ReturnType(ClassType::*)(Args...) const>
     };
 };
 
-void register_api_reference_route(auto &router, std::string_view path) {
-    router.epr->http_get(restinio::router::easy_parser_router::path_to_params(path),
-        [&](const auto &req) {
-            std::string content = {"<!DOCTYPE html><html></body><h1>API reference</h1>"};
-            for (const auto &r : router.registered_routes_info) {
-                content.append(fmt::format("<b>{}</b>:&nbsp;&nbsp;{}<br><code>", r.method_id, r.url));
-                for (const auto &[k,v] : r.params_description) {
-                    content.append(fmt::format("&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;{} : {} &lt;", k, v.type));
-                    if (v.cnstr_names.begin() != v.cnstr_names.end()) {
-                        content.append(std::accumulate(v.cnstr_names.begin() + 1,
-                                        v.cnstr_names.end(),
-                                        std::string{*v.cnstr_names.begin()},
-                                        [](std::string acc, std::string_view s) {
-                                           return acc + ", " + std::string(s);
-                                        }
-                        ));
-                    }
-                    content.append("&gt;<br>");
-                }
-                content.append("</code><br>");
-            }
-            content.append("</body></html>");
-            return req->create_response(restinio::status_ok())
-               .append_header(restinio::http_field::content_type, "text/html")
-               .set_body(content)
-               .done();
-    });
+/* HTML listing of registered routes, rendered once into StaticResponses */
+std::string api_reference_html(const auto &routes_info) {
+    std::string content = {"<!DOCTYPE html><html><body><h1>API reference</h1>"};
+    for (const auto &r : routes_info) {
+        content.append(fmt::format("<b>{}</b>:&nbsp;&nbsp;{}<br><code>", r.method_id, r.url));
+        for (const auto &[k,v] : r.params_description)
+            content.append(fmt::format("&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;{} : {} &lt;{}&gt;<br>", k, v.type, fmt::join(v.cnstr_names, ", ")));
+        content.append("</code><br>");
+    }
+    content.append("</body></html>");
+    return content;
 }
 
 nlohmann::json extract_json_field(const restinio::request_handle_t & req) {
@@ -161,6 +190,67 @@ nlohmann::json extract_json_field(const restinio::request_handle_t & req) {
     return nullptr;
 }
 
+/* Calls f(name, q) for every item of a header listing values with q parameters (Accept, Accept-Encoding),
+ * q in thousandths, 1000 when not given. Other parameters are dropped from name */
+template <typename F>
+void for_each_weighted_item(std::string_view header, F &&f) {
+    auto trim = [](std::string_view s) {
+        while (!s.empty() && std::isspace(static_cast<unsigned char>(s.front()))) s.remove_prefix(1);
+        while (!s.empty() && std::isspace(static_cast<unsigned char>(s.back()))) s.remove_suffix(1);
+        return s;
+    };
+    while (!header.empty()) {
+        const auto comma = header.find(',');
+        auto item = header.substr(0, comma);
+        header = comma == std::string_view::npos ? std::string_view{} : header.substr(comma + 1);
+
+        auto semicolon = item.find(';');
+        const auto name = trim(item.substr(0, semicolon));
+        int q = 1000;
+        while (semicolon != std::string_view::npos) {
+            item.remove_prefix(semicolon + 1);
+            semicolon = item.find(';');
+            auto param = trim(item.substr(0, semicolon));
+            if (!param.starts_with("q=") && !param.starts_with("Q=")) continue;
+            param.remove_prefix(2);
+            /* "0.5" -> 500, "1" -> 1000 */
+            int whole = 0, frac = 0, digits = 0;
+            const auto dot = param.find('.');
+            std::from_chars(param.data(), param.data() + std::min(dot, param.size()), whole);
+            if (dot != std::string_view::npos)
+                for (char c : param.substr(dot + 1))
+                    if (std::isdigit(static_cast<unsigned char>(c)) && digits < 3) { frac = frac * 10 + (c - '0'); digits++; }
+            while (digits++ < 3) frac *= 10;
+            q = std::clamp(whole * 1000 + frac, 0, 1000);
+        }
+        if (!name.empty()) f(name, q);
+    }
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+    return std::ranges::equal(a, b, [](char x, char y) { return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y)); });
+}
+
+/* Non-empty parts of s separated by delimiter */
+std::vector<std::string> split(std::string_view s, char delimiter) {
+    std::vector<std::string> parts;
+    while (!s.empty()) {
+        const auto pos = s.find(delimiter);
+        if (pos != 0) parts.emplace_back(s.substr(0, pos));
+        if (pos == std::string_view::npos) break;
+        s.remove_prefix(pos + 1);
+    }
+    return parts;
+}
+
+/* Seconds a connection waits for another writer (request, Purger, thumbnail worker, rs-bulkload)
+ * before failing with "database is locked" */
+constexpr unsigned db_busy_timeout = 10;
+
+std::string db_connection_string(std::string_view path) {
+    return fmt::format("dbname={} timeout={}", path, db_busy_timeout);
+}
+
 std::string iso_date_now() {
     std::time_t t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
     std::stringstream ss;
@@ -176,80 +266,32 @@ std::string iso_date_time_now() {
 }
 
 // Taken from https://github.com/Stiffstream/restinio/blob/master/dev/sample/file_upload/main.cpp
-// and modifed for purpose of this application
+// and modifed for purpose of this application. Content goes to a temporary file first,
+// which is renamed once fully written, so readers never see partially written files.
 static void store_file_to_disk(
 	std::string_view dest_folder,
 	std::string_view file_name,
 	std::string_view raw_content)
 {
-	std::ofstream dest_file;
-	dest_file.exceptions( std::ofstream::failbit );
-	dest_file.open(
-			fmt::format( "{}/{}", dest_folder, file_name ),
-			std::ios_base::out | std::ios_base::trunc | std::ios_base::binary );
-	dest_file.write( raw_content.data(), raw_content.size() );
-}
-
-struct MFile {
-    std::string file_name;
-    std::string file_extension;
-    std::string file_contents;
-};
-
-MFile parse_file_field_multiform(const restinio::request_handle_t & req)
-{
-	using namespace restinio::file_upload;
-    std::optional<MFile> result_file;
-	enumerate_parts_with_files(
-        *req, [&](const part_description_t &part) {
-            if(part.name == "file" && part.filename.has_value() 
-                    && !part.body.empty()) {
-                result_file = {
-                    .file_name = *part.filename,
-                    .file_contents = std::string{part.body}
-                };
-            }
-            return handling_result_t::terminate_enumeration;
-        });
-
-    throw_if<InvalidParamsError>(!result_file.has_value(), "File is required");
-    result_file->file_extension = std::filesystem::path(result_file->file_name).extension();
-    return *result_file;
+	const auto dest_path = fmt::format( "{}/{}", dest_folder, file_name );
+	const auto tmp_path = fmt::format( "{}/.{}.part", dest_folder, file_name );
+	{
+		std::ofstream dest_file;
+		dest_file.exceptions( std::ofstream::failbit );
+		dest_file.open(
+				tmp_path,
+				std::ios_base::out | std::ios_base::trunc | std::ios_base::binary );
+		dest_file.write( raw_content.data(), raw_content.size() );
+	}
+	std::filesystem::rename( tmp_path, dest_path );
 }
 
-auto parse_json_field_multiform(const restinio::request_handle_t & req)
-{
-	using namespace restinio::multipart_body;
-    std::optional<nlohmann::json> json;
-    auto hstatus = handling_result_t::continue_enumeration;
-	auto parts = enumerate_parts(
-        *req, [&](const parsed_part_t &part) {
-            part.fields.for_each_field([&](const restinio::http_header_field_t& f) {
-                if (hstatus == handling_result_t::stop_enumeration) {
-                    return;
-                } else if (auto pos = f.value().find("name=\""); pos != std::string::npos) {
-                    if ((f.value().length() - pos) >= 10) {
-                        std::string substr = f.value().substr(pos+6, 4);
-                        if (substr == "json") {
-                            json = nlohmann::json::parse(part.body);
-                            hstatus = handling_result_t::stop_enumeration;
-                        }
-                    }
-                }
-            });
-        return hstatus;
-    });
-
-    throw_if<InvalidParamsError>(!json.has_value(), "json field is required");
-    return *json;
+/* Rejects requests whose body exceeds the limit of the route */
+void throw_if_body_too_large(const restinio::request_handle_t & req, std::size_t max_body_size) {
+    throw_if<PayloadTooLargeError>(req->body().size() > max_body_size,
+                                   fmt::format("Request body must not exceed {} bytes", max_body_size));
 }
 
-int randint() {
-    std::random_device dev;
-    std::mt19937 rgen(dev());
-    std::uniform_int_distribution<std::mt19937::result_type> dist(0,INT_MAX);
-    return dist(rgen); 
-}
 } // ns rs
 
 #endif
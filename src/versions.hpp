@@ -0,0 +1,54 @@
+#ifndef RS_VERSIONS_HPP
+#define RS_VERSIONS_HPP
+
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/format.h>
+#include <restinio/all.hpp>
+
+/* Row versions (PermissionParams::version_field_name) exposed as ETags of single rows. Owners and other
+ * groups read different fields of the same row, so the tag is "<version>.<mask of readable fields>",
+ * responses append their format and content coding to it (representation_etag) */
+namespace rs {
+
+std::string version_etag(std::int64_t version, unsigned long long fields_mask) {
+    return fmt::format("\"{}.{:x}\"", version, fields_mask);
+}
+
+/* Version in a strong ETag made by version_etag, the mask and representation after it are ignored.
+ * nullopt for weak or foreign tags */
+std::optional<std::int64_t> etag_version(std::string_view etag) {
+    if (etag.size() < 3 || etag.front() != '"' || etag.back() != '"') return std::nullopt;
+    std::int64_t version = 0;
+    const char *last = etag.data() + etag.size() - 1;
+    auto [ptr, ec] = std::from_chars(etag.data() + 1, last, version);
+    if (ec != std::errc{} || ptr == last || *ptr != '.') return std::nullopt;
+    return version;
+}
+
+/* Versions listed in If-Match, nullopt without the header or with "*" which any existing row matches.
+ * If-Match uses strong comparison, weak tags match no version */
+std::optional<std::vector<std::int64_t>> if_match_versions(const restinio::request_handle_t &req) {
+    auto header = req->header().opt_value_of(restinio::http_field::if_match);
+    if (!header) return std::nullopt;
+    std::vector<std::int64_t> versions;
+    for (std::string_view rest = *header; !rest.empty();) {
+        const auto comma = rest.find(',');
+        auto tag = rest.substr(0, comma);
+        rest = comma == std::string_view::npos ? std::string_view{} : rest.substr(comma + 1);
+        while (!tag.empty() && tag.front() == ' ') tag.remove_prefix(1);
+        while (!tag.empty() && tag.back() == ' ') tag.remove_suffix(1);
+        if (tag == "*") return std::nullopt;
+        if (auto v = etag_version(tag)) versions.push_back(*v);
+    }
+    return versions;
+}
+
+} // ns rs
+
+#endif // RS_VERSIONS_HPP